@@ -35,6 +35,7 @@
 #include <cmath>
 #include <list>
 #include <forward_list>
+#include <thread>
 
 #include <pthread.h>
 
@@ -84,6 +85,7 @@
 
 #include "glimpse_log.h"
 #include "glimpse_mem_pool.h"
+#include "glimpse_thread_pool.h"
 #include "glimpse_assets.h"
 #include "glimpse_context.h"
 
@@ -290,6 +292,24 @@ struct gm_skeleton {
       distance(0.f) {}
 };
 
+/* The output of label inference for one person: either full probability
+ * tables or, if top_k is non-zero, the top_k most likely labels of each
+ * pixel. If sparse is set there's only a table for each of the listed
+ * pixels (in the same order) and every other pixel is certain background.
+ *
+ * The buffers are only grown, so they can be reused between frames.
+ */
+struct inferred_labels
+{
+    float *probs;
+    size_t probs_size;
+    InferLabelPr *top_k_prs;
+    size_t top_k_prs_size;
+    int top_k;
+    bool sparse;
+    std::vector<int> pixels;
+};
+
 struct gm_prediction_impl
 {
     struct gm_prediction base;
@@ -342,8 +362,15 @@ struct gm_tracking_impl
     // Label inference data
     uint8_t *label_map;
 
-    // Label probability tables
+    // Label inference output for the best person
+    struct inferred_labels labels;
+
+    // Full label probability tables, only allocated and expanded from the
+    // labels on demand for gm_tracking_get_label_probabilities(), which
+    // may be called from any thread. See get_label_probs()
+    pthread_mutex_t label_probs_lock;
     float *label_probs;
+    bool label_probs_expanded;
 
     // The unprojected full-resolution depth cloud
     pcl::PointCloud<pcl::PointXYZL>::Ptr depth_cloud;
@@ -428,6 +455,106 @@ struct gm_context
     RDTree **decision_trees;
     int n_decision_trees;
 
+    /* Worker threads shared by label inference and the other per-pixel
+     * tracking stages. This is only used from the tracking thread, which
+     * will (re)create the pool if the n_inference_threads or
+     * inference_work_stealing properties no longer match.
+     */
+    struct gm_thread_pool *inference_pool;
+    int n_inference_threads;
+    bool inference_work_stealing;
+
+    /* Worker threads for joint inference, which spreads the joints across
+     * the pool. There are only as many work items as joints so this is
+     * kept separate so that its size can be capped independently.
+     */
+    struct gm_thread_pool *joints_pool;
+    int n_joint_inference_threads;
+
+    /* Use the SIMD, level-synchronous tree traversal for label inference */
+    bool batched_inference;
+
+    /* Only run label inference for the pixels of each person cluster
+     * instead of the full training-resolution image
+     */
+    bool sparse_inference;
+
+    /* Evaluate labels coarse to fine, starting with every Nth pixel (only
+     * applies to dense inference with full probability tables)
+     */
+    int coarse_inference_scale;
+
+    /* Stop walking decision trees at this depth, using the label
+     * distributions of split nodes (zero to walk to the leaves)
+     */
+    int max_inference_depth;
+
+    /* Only evaluate more than the first decision tree for pixels that
+     * aren't labelled with at least this confidence (zero to disable)
+     */
+    float cascade_confidence;
+
+    /* Only keep this many of the most likely labels for each pixel
+     * (between 1 and INFER_MAX_TOP_K), or full probability tables if zero
+     */
+    int label_top_k;
+
+    /* Temporal label cache: the training-camera depth image and label
+     * probabilities of the last frame's best person, so the next frame only
+     * needs to infer labels for pixels whose depth (or the depth anywhere
+     * the decision trees might sample for them, see max_uv_offset) changed
+     * by more than label_cache_threshold. This is owned by the tracking
+     * thread.
+     *
+     * label_cache_age counts the frames since labels were last fully
+     * inferred and once it reaches label_cache_refresh_interval the cache
+     * is bypassed to bound any drift.
+     */
+    bool temporal_label_cache;
+    float label_cache_threshold;
+    int label_cache_refresh_interval;
+    float *label_cache_depth;
+    float *label_cache_probs;
+    int label_cache_width;
+    int label_cache_height;
+    int label_cache_age;
+
+    /* The largest u,v offset of any split node in the decision trees, see
+     * get_max_uv_offset()
+     */
+    float max_uv_offset;
+
+    /* Joint inference scratch and results (including the pixel weights),
+     * reused across frames and only re-created if the training camera
+     * resolution changes. This is owned by the tracking thread.
+     */
+    InferJointsWorkspace *joints_workspace;
+    int joints_workspace_width;
+    int joints_workspace_height;
+
+    /* Keeps label inference from allocating its padded copy of the depth
+     * image for every call
+     */
+    InferLabelsWorkspace *labels_workspace;
+
+    /* Label inference output buffers for the person being considered,
+     * swapped with those of the tracking state for the best person. Also
+     * a map from each pixel to its table when inference was sparse, which
+     * is -1 everywhere between uses. These are owned by the tracking
+     * thread.
+     */
+    struct inferred_labels labels_scratch;
+    int *label_rows;
+    int label_rows_size;
+
+    /* While tracking, search for joints near their positions in the last
+     * tracked skeleton first, see infer_joints_seeded(). joint_seeds is
+     * owned by the tracking thread.
+     */
+    bool seeded_joint_inference;
+    float joint_seed_radius;
+    std::vector<Joint> joint_seeds;
+
     size_t grey_width;
     size_t grey_height;
     //size_t yuv_size;
@@ -527,6 +654,8 @@ struct gm_context
     int n_labels;
 
     JSON_Value *joint_map;
+    /* joint_map compiled into the tables used by joint inference */
+    struct gm_joint_map *compiled_joint_map;
     JIParams *joint_params;
     struct joint_info *joint_stats;
     int n_joints;
@@ -1215,34 +1344,46 @@ is_bone_length_diff(const struct bone_info &ref_bone,
 }
 
 static inline bool
-is_bone_angle_diff(const struct bone_info &bone,
-                   const struct gm_skeleton &ref_skel,
-                   const struct gm_skeleton &skel,
+is_bone_angle_diff(const struct gm_joint &head,
+                   const struct gm_joint &tail,
+                   uint64_t timestamp,
+                   const struct gm_joint &ref_head,
+                   const struct gm_joint &ref_tail,
+                   uint64_t ref_timestamp,
                    float max_angle)
 {
-    glm::vec3 bone_vec = glm::vec3(skel.joints[bone.tail].x -
-                                   skel.joints[bone.head].x,
-                                   skel.joints[bone.tail].y -
-                                   skel.joints[bone.head].y,
-                                   skel.joints[bone.tail].z -
-                                   skel.joints[bone.head].z);
-    glm::vec3 ref_vec = glm::vec3(ref_skel.joints[bone.tail].x -
-                                  ref_skel.joints[bone.head].x,
-                                  ref_skel.joints[bone.tail].y -
-                                  ref_skel.joints[bone.head].y,
-                                  ref_skel.joints[bone.tail].z -
-                                  ref_skel.joints[bone.head].z);
+    glm::vec3 bone_vec = glm::vec3(tail.x - head.x,
+                                   tail.y - head.y,
+                                   tail.z - head.z);
+    glm::vec3 ref_vec = glm::vec3(ref_tail.x - ref_head.x,
+                                  ref_tail.y - ref_head.y,
+                                  ref_tail.z - ref_head.z);
     float angle = glm::degrees(acosf(
         glm::dot(glm::normalize(bone_vec), glm::normalize(ref_vec))));
     while (angle > 180.f) angle -= 360.f;
-    float time = skel.timestamp > ref_skel.timestamp ?
-        (float)((skel.timestamp - ref_skel.timestamp) / 1e9) :
-        (float)((ref_skel.timestamp - skel.timestamp) / 1e9);
+    float time = timestamp > ref_timestamp ?
+        (float)((timestamp - ref_timestamp) / 1e9) :
+        (float)((ref_timestamp - timestamp) / 1e9);
     float angle_delta = fabsf(angle) / time;
 
     return angle_delta > max_angle;
 }
 
+static inline bool
+is_bone_angle_diff(const struct bone_info &bone,
+                   const struct gm_skeleton &ref_skel,
+                   const struct gm_skeleton &skel,
+                   float max_angle)
+{
+    return is_bone_angle_diff(skel.joints[bone.head],
+                              skel.joints[bone.tail],
+                              skel.timestamp,
+                              ref_skel.joints[bone.head],
+                              ref_skel.joints[bone.tail],
+                              ref_skel.timestamp,
+                              max_angle);
+}
+
 static int
 is_skeleton_diff(const struct gm_context *ctx,
                  const struct gm_skeleton &skel,
@@ -1285,13 +1426,21 @@ is_skeleton_diff(const struct gm_context *ctx,
     return violations;
 }
 
+static inline bool
+compare_skeleton_scores(float distance1, float confidence1,
+                        float distance2, float confidence2)
+{
+    return (distance1 == distance2) ?
+        confidence1 > confidence2 :
+        distance1 < distance2;
+}
+
 static bool
 compare_skeletons(const struct gm_skeleton &skel1,
                   const struct gm_skeleton &skel2)
 {
-    return (skel1.distance == skel2.distance) ?
-        skel1.confidence > skel2.confidence :
-        skel1.distance < skel2.distance;
+    return compare_skeleton_scores(skel1.distance, skel1.confidence,
+                                   skel2.distance, skel2.confidence);
 }
 
 static void
@@ -1366,9 +1515,30 @@ build_bones(struct gm_context *ctx,
     }
 }
 
+/* How far the bone from joint head_no to joint tail_no falls outside of the
+ * expected distance between the joints, squared
+ */
+static inline float
+bone_distance_penalty(const struct gm_context *ctx,
+                      int head_no, int tail_no,
+                      const float *head, const float *tail)
+{
+    const struct joint_dist &joint_dist =
+        ctx->joint_stats[head_no].dist[tail_no];
+
+    float dist = distance_between(tail, head);
+
+    if (dist < joint_dist.min) {
+        return powf(joint_dist.min - dist, 2.f);
+    } else if (dist > joint_dist.max) {
+        return powf(dist - joint_dist.max, 2.f);
+    }
+    return 0.f;
+}
+
 static void
 build_skeleton(struct gm_context *ctx,
-               InferredJoints *result,
+               const InferredJoints *result,
                struct gm_skeleton &skeleton,
                int joint_no = 0,
                int last_joint_no = -1)
@@ -1376,8 +1546,8 @@ build_skeleton(struct gm_context *ctx,
     // Add the highest confidence joint to the skeleton and track the sum
     // confidence and deviation from the expected joint distances.
     if (joint_no != last_joint_no) {
-        if (result->joints[joint_no]) {
-            Joint *tail = (Joint *)result->joints[joint_no]->data;
+        if (result->n_candidates[joint_no]) {
+            const Joint *tail = inferred_joint_candidates(result, joint_no);
 
             if (last_joint_no != -1 &&
                 skeleton.joints[last_joint_no].confidence > 0) {
@@ -1385,16 +1555,9 @@ build_skeleton(struct gm_context *ctx,
                 // last_joint_no and see if this bone falls outside of the
                 // expected distance between joints.
                 struct gm_joint &head = skeleton.joints[last_joint_no];
-                const struct joint_dist &joint_dist =
-                    ctx->joint_stats[last_joint_no].dist[joint_no];
-
-                float dist = distance_between(&tail->x, &head.x);
-
-                if (dist < joint_dist.min) {
-                    skeleton.distance += powf(joint_dist.min - dist, 2.f);
-                } else if (dist > joint_dist.max) {
-                    skeleton.distance += powf(dist - joint_dist.max, 2.f);
-                }
+                skeleton.distance +=
+                    bone_distance_penalty(ctx, last_joint_no, joint_no,
+                                          &head.x, &tail->x);
             }
 
             skeleton.confidence += tail->confidence;
@@ -1421,9 +1584,113 @@ build_skeleton(struct gm_context *ctx,
     }
 }
 
+/* Finds the parent of each joint as seen by build_bones(), which walks the
+ * joint connections from the first joint
+ */
+static void
+find_joint_parents(struct gm_context *ctx,
+                   int *parents,
+                   int joint_no = 0,
+                   int last_joint_no = -1)
+{
+    parents[joint_no] = last_joint_no;
+
+    for (int i = 0; i < ctx->joint_stats[joint_no].n_connections; ++i) {
+        if (ctx->joint_stats[joint_no].connections[i] == last_joint_no) {
+            continue;
+        }
+        find_joint_parents(ctx, parents,
+                           ctx->joint_stats[joint_no].connections[i],
+                           joint_no);
+    }
+}
+
+/* The is_skeleton_diff() violations for the bone ending at joint tail_no,
+ * given the positions of the bone's head and tail joints
+ */
+static inline int
+bone_violations(const struct gm_context *ctx,
+                const struct gm_skeleton &ref,
+                int head_no, int tail_no,
+                const struct gm_joint &head,
+                const struct gm_joint &tail,
+                uint64_t timestamp)
+{
+    if (tail_no >= (int)ref.bones.size()) {
+        return 0;
+    }
+
+    const struct bone_info &ref_bone = ref.bones[tail_no];
+    if (ref_bone.head < 0) {
+        return 0;
+    }
+
+    // build_bones() only adds bones between two joints with confidence
+    if (head.confidence <= 0.f || tail.confidence <= 0.f ||
+        ref_bone.head != head_no || ref_bone.tail != tail_no) {
+        return 2;
+    }
+
+    int violations = 0;
+    float length = distance_between(&tail.x, &head.x);
+    if (fabsf(length - ref_bone.length) > ctx->bone_length_variance) {
+        ++violations;
+    }
+    if (is_bone_angle_diff(head, tail, timestamp,
+                           ref.joints[head_no], ref.joints[tail_no],
+                           ref.timestamp, ctx->bone_rotation_variance)) {
+        ++violations;
+    }
+
+    return violations;
+}
+
+/* The parts of a skeleton's score that depend on the position of joint
+ * joint_no: the distance penalties for the bones connected to the joint
+ * and, if there's a reference skeleton, their is_skeleton_diff()
+ * violations. The other joints are taken from the given skeleton.
+ */
+static void
+score_joint(struct gm_context *ctx,
+            const struct gm_skeleton &skeleton,
+            const int *parents,
+            const struct gm_skeleton *ref,
+            int joint_no,
+            const struct gm_joint &joint,
+            float *out_distance,
+            int *out_violations)
+{
+    float distance = 0.f;
+    int violations = 0;
+
+    for (int i = 0; i < ctx->joint_stats[joint_no].n_connections; ++i) {
+        int other_no = ctx->joint_stats[joint_no].connections[i];
+        const struct gm_joint &other = skeleton.joints[other_no];
+
+        if (joint.confidence > 0.f && other.confidence > 0.f) {
+            distance += bone_distance_penalty(ctx, joint_no, other_no,
+                                              &joint.x, &other.x);
+        }
+
+        if (!ref) {
+            continue;
+        }
+        if (other_no == parents[joint_no]) {
+            violations += bone_violations(ctx, *ref, other_no, joint_no,
+                                          other, joint, skeleton.timestamp);
+        } else {
+            violations += bone_violations(ctx, *ref, joint_no, other_no,
+                                          joint, other, skeleton.timestamp);
+        }
+    }
+
+    *out_distance = distance;
+    *out_violations = violations;
+}
+
 static void
 refine_skeleton(struct gm_context *ctx,
-                InferredJoints *result,
+                const InferredJoints *result,
                 struct gm_skeleton &skeleton)
 {
     if (!ctx->joint_stats || !ctx->joint_refinement) {
@@ -1435,52 +1702,90 @@ refine_skeleton(struct gm_context *ctx,
 
     // If we tracked the previous frame, predict a skeleton to use as a
     // reference for refinement.
+    const struct gm_skeleton *ref = NULL;
     int skel_diff = 0;
     if (ctx->n_tracking && ctx->tracking_history[0]) {
-        skel_diff = is_skeleton_diff(ctx, skeleton,
-                                     ctx->tracking_history[0]->skeleton);
+        ref = &ctx->tracking_history[0]->skeleton;
+        skel_diff = is_skeleton_diff(ctx, skeleton, *ref);
     }
 
+    int parents[GM_JOINT_MAP_MAX_JOINTS];
+    std::fill(parents, parents + ctx->n_joints, -1);
+    find_joint_parents(ctx, parents);
+
     // For each joint, we look at the score of the skeleton using each
     // joint cluster and if it scores higher than the most confident
     // joint, we replace that joint and continue.
-    bool is_refined = false;
+    //
+    // Each candidate skeleton only differs from the given skeleton by the
+    // one joint, so only the terms of the score that touch that joint are
+    // recalculated and a skeleton is only built for the best candidate.
+    int best_joint = -1;
+    int best_cluster = 0;
+    float best_distance = skeleton.distance;
+    float best_confidence = skeleton.confidence;
+    int best_diff = skel_diff;
     for (int j = 0; j < ctx->n_joints; ++j) {
-        if (!result->joints[j] || !result->joints[j]->next) {
+        if (result->n_candidates[j] < 2) {
             continue;
         }
 
-        for (LList *l = result->joints[j]->next; l; l = l->next) {
-            struct gm_skeleton candidate_skeleton(result->n_joints);
-            candidate_skeleton.timestamp = skeleton.timestamp;
-
-            Joint *joint = (Joint *)l->data;
-            candidate_skeleton.joints[j].x = joint->x;
-            candidate_skeleton.joints[j].y = joint->y;
-            candidate_skeleton.joints[j].z = joint->z;
-            candidate_skeleton.joints[j].confidence = joint->confidence;
-            candidate_skeleton.joints[j].predicted = false;
-            candidate_skeleton.confidence += joint->confidence;
-
-            build_skeleton(ctx, result, candidate_skeleton, j, j);
-            build_bones(ctx, candidate_skeleton);
-
-            int cand_diff = 0;
-            if (ctx->n_tracking && ctx->tracking_history[0]) {
-                cand_diff =
-                    is_skeleton_diff(ctx, candidate_skeleton,
-                                     ctx->tracking_history[0]->skeleton);
-            }
-            if (cand_diff < skel_diff &&
-                compare_skeletons(candidate_skeleton, skeleton)) {
-                std::swap(skeleton, candidate_skeleton);
-                skel_diff = cand_diff;
-                is_refined = true;
+        const struct gm_joint &prime = skeleton.joints[j];
+        float prime_distance;
+        int prime_diff;
+        score_joint(ctx, skeleton, parents, ref, j, prime,
+                    &prime_distance, &prime_diff);
+
+        const Joint *candidates = inferred_joint_candidates(result, j);
+        for (int c = 1; c < result->n_candidates[j]; ++c) {
+            const Joint *joint = &candidates[c];
+            struct gm_joint cand = prime;
+            cand.x = joint->x;
+            cand.y = joint->y;
+            cand.z = joint->z;
+            cand.confidence = joint->confidence;
+            cand.predicted = false;
+
+            float cand_distance;
+            int cand_diff;
+            score_joint(ctx, skeleton, parents, ref, j, cand,
+                        &cand_distance, &cand_diff);
+
+            cand_distance += skeleton.distance - prime_distance;
+            cand_diff += skel_diff - prime_diff;
+            float cand_confidence = skeleton.confidence - prime.confidence +
+                joint->confidence;
+
+            if (cand_diff < best_diff &&
+                compare_skeleton_scores(cand_distance, cand_confidence,
+                                        best_distance, best_confidence)) {
+                best_joint = j;
+                best_cluster = c;
+                best_distance = cand_distance;
+                best_confidence = cand_confidence;
+                best_diff = cand_diff;
             }
         }
     }
 
-    if (is_refined) {
+    if (best_joint >= 0) {
+        struct gm_skeleton candidate_skeleton(result->n_joints);
+        candidate_skeleton.timestamp = skeleton.timestamp;
+
+        const Joint *joint =
+            &inferred_joint_candidates(result, best_joint)[best_cluster];
+        candidate_skeleton.joints[best_joint].x = joint->x;
+        candidate_skeleton.joints[best_joint].y = joint->y;
+        candidate_skeleton.joints[best_joint].z = joint->z;
+        candidate_skeleton.joints[best_joint].confidence = joint->confidence;
+        candidate_skeleton.joints[best_joint].predicted = false;
+        candidate_skeleton.confidence += joint->confidence;
+
+        build_skeleton(ctx, result, candidate_skeleton,
+                       best_joint, best_joint);
+        build_bones(ctx, candidate_skeleton);
+        std::swap(skeleton, candidate_skeleton);
+
         gm_debug(ctx->log, "Refined skeleton confidence: %f, distance: %f",
                  skeleton.confidence, skeleton.distance);
     }
@@ -2585,6 +2890,258 @@ colour_debug_cloud(struct gm_context *ctx,
     }
 }
 
+static void
+update_thread_pool(struct gm_context *ctx,
+                   struct gm_thread_pool **pool,
+                   const char *name,
+                   int n_threads,
+                   bool work_stealing)
+{
+    if (*pool &&
+        thread_pool_get_n_threads(*pool) == n_threads &&
+        thread_pool_get_work_stealing(*pool) == work_stealing)
+    {
+        return;
+    }
+
+    if (*pool) {
+        thread_pool_free(*pool);
+        *pool = NULL;
+    }
+
+    /* A single thread is handled synchronously without a pool */
+    if (n_threads <= 1)
+        return;
+
+    char *err = NULL;
+    *pool = thread_pool_alloc(ctx->log, name, n_threads, work_stealing, &err);
+    if (!*pool) {
+        gm_warn(ctx->log, "Failed to create %s thread pool: %s", name, err);
+        free(err);
+    }
+}
+
+static void
+update_inference_pool(struct gm_context *ctx)
+{
+    update_thread_pool(ctx, &ctx->inference_pool, "Glimpse Infer",
+                       ctx->n_inference_threads,
+                       ctx->inference_work_stealing);
+
+    /* The cost of finding each joint varies a lot (e.g. with the number of
+     * pixels labelled for it) so threads are always allowed to steal work
+     */
+    update_thread_pool(ctx, &ctx->joints_pool, "Glimpse Joints",
+                       ctx->n_joint_inference_threads, true);
+}
+
+/* Returns buf, reallocated if it's smaller than size bytes */
+static void *
+reserve_label_buffer(void *buf, size_t *buf_size, size_t size)
+{
+    if (*buf_size < size) {
+        xfree(buf);
+        buf = xmalloc(size);
+        *buf_size = size;
+    }
+    return buf;
+}
+
+static void
+free_inferred_labels(struct inferred_labels *labels)
+{
+    xfree(labels->probs);
+    xfree(labels->top_k_prs);
+    labels->probs = NULL;
+    labels->top_k_prs = NULL;
+    labels->probs_size = 0;
+    labels->top_k_prs_size = 0;
+}
+
+/* Expands the labels into full probability tables for all n_pixels pixels,
+ * for the temporal label cache and gm_tracking_get_label_probabilities()
+ */
+static void
+expand_inferred_labels(struct gm_context *ctx,
+                       const struct inferred_labels *labels,
+                       int n_pixels,
+                       float *label_probs)
+{
+    int n_labels = ctx->n_labels;
+
+    if (!labels->sparse) {
+        if (labels->top_k) {
+            expand_top_k_labels(labels->top_k_prs, n_pixels, labels->top_k,
+                                n_labels, label_probs);
+        } else {
+            memcpy(label_probs, labels->probs,
+                   n_pixels * n_labels * sizeof(float));
+        }
+        return;
+    }
+
+    int bg_label = ctx->decision_trees[0]->header.bg_label;
+    memset(label_probs, 0, n_pixels * n_labels * sizeof(float));
+    for (int i = 0; i < n_pixels; ++i) {
+        label_probs[i * n_labels + bg_label] = 1.0f;
+    }
+
+    for (unsigned i = 0; i < labels->pixels.size(); ++i) {
+        float *pr_table = &label_probs[labels->pixels[i] * n_labels];
+        if (labels->top_k) {
+            expand_top_k_labels(&labels->top_k_prs[i * labels->top_k], 1,
+                                labels->top_k, n_labels, pr_table);
+        } else {
+            memcpy(pr_table, &labels->probs[i * n_labels],
+                   n_labels * sizeof(float));
+        }
+    }
+}
+
+/* Finds the pixels whose labels can't be reused from the temporal label
+ * cache: those whose own depth has changed by more than
+ * label_cache_threshold, or which might sample the depth of a pixel that
+ * has. A pixel at depth d only samples within ceil(max_uv_offset / d)
+ * pixels of itself (see get_max_uv_offset()), and out of bounds samples
+ * always read the background depth.
+ *
+ * Depth changes within the threshold are ignored, both where they're
+ * sampled and where they shift a pixel's own sample positions, so cached
+ * labels can differ slightly from full inference. label_cache_refresh_interval
+ * bounds how long such differences can accumulate.
+ */
+static void
+find_changed_label_pixels(struct gm_context *ctx,
+                          const float *depth_img,
+                          int width,
+                          int height,
+                          std::vector<int> &changed)
+{
+    const float *cache_depth = ctx->label_cache_depth;
+    float threshold = ctx->label_cache_threshold;
+    int max_radius = std::max(width, height);
+
+    /* A summed area table of the changed pixels, so the changes within each
+     * pixel's sampling extent can be counted in constant time
+     */
+    int stride = width + 1;
+    std::vector<int> n_changed(stride * (height + 1));
+    for (int y = 0; y < height; ++y) {
+        int row_sum = 0;
+        for (int x = 0; x < width; ++x) {
+            int off = y * width + x;
+            row_sum += fabsf(depth_img[off] - cache_depth[off]) > threshold;
+            n_changed[(y + 1) * stride + x + 1] =
+                n_changed[y * stride + x + 1] + row_sum;
+        }
+    }
+
+    changed.clear();
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            int off = y * width + x;
+            float depth = depth_img[off];
+
+            /* Background pixels aren't sampled from, so only their own
+             * depth matters
+             */
+            int radius = 0;
+            if (depth < HUGE_DEPTH) {
+                float extent = ceilf(ctx->max_uv_offset / depth);
+                radius = extent < max_radius ? (int)extent : max_radius;
+            }
+
+            int x0 = std::max(0, x - radius);
+            int y0 = std::max(0, y - radius);
+            int x1 = std::min(width, x + radius + 1);
+            int y1 = std::min(height, y + radius + 1);
+            int count = n_changed[y1 * stride + x1] -
+                n_changed[y0 * stride + x1] -
+                n_changed[y1 * stride + x0] +
+                n_changed[y0 * stride + x0];
+            if (count) {
+                changed.push_back(off);
+            }
+        }
+    }
+}
+
+/* Keeps the depth image and labels of this frame's best person for the
+ * temporal label cache
+ */
+static void
+update_label_cache(struct gm_context *ctx,
+                   const float *depth_img,
+                   const struct inferred_labels *labels,
+                   int width,
+                   int height,
+                   bool full_inference)
+{
+    if (ctx->label_cache_width != width || ctx->label_cache_height != height) {
+        xfree(ctx->label_cache_depth);
+        xfree(ctx->label_cache_probs);
+        ctx->label_cache_depth = (float *)
+            xmalloc(width * height * sizeof(float));
+        ctx->label_cache_probs = (float *)
+            xmalloc(width * height * ctx->n_labels * sizeof(float));
+        ctx->label_cache_width = width;
+        ctx->label_cache_height = height;
+    }
+
+    memcpy(ctx->label_cache_depth, depth_img, width * height * sizeof(float));
+    expand_inferred_labels(ctx, labels, width * height,
+                           ctx->label_cache_probs);
+
+    ctx->label_cache_age = full_inference ? 0 : ctx->label_cache_age + 1;
+}
+
+static void
+free_label_cache(struct gm_context *ctx)
+{
+    xfree(ctx->label_cache_depth);
+    xfree(ctx->label_cache_probs);
+    ctx->label_cache_depth = NULL;
+    ctx->label_cache_probs = NULL;
+    ctx->label_cache_width = 0;
+    ctx->label_cache_height = 0;
+}
+
+/* Returns the full label probability tables for a tracking state, expanding
+ * them from the inferred labels the first time they're requested.
+ *
+ * The labels of a tracking state don't change after it's been published so
+ * the expanded tables stay valid, but the expansion itself is serialized
+ * since the getters may be called from any thread.
+ */
+static float *
+get_label_probs(struct gm_tracking_impl *tracking)
+{
+    struct gm_context *ctx = tracking->ctx;
+    struct inferred_labels &labels = tracking->labels;
+    int n_pixels = tracking->training_camera_intrinsics.width *
+        tracking->training_camera_intrinsics.height;
+
+    pthread_mutex_lock(&tracking->label_probs_lock);
+    if (!tracking->label_probs_expanded) {
+        if (!tracking->label_probs) {
+            tracking->label_probs = (float *)
+                xmalloc(n_pixels * ctx->n_labels * sizeof(float));
+        }
+        bool inferred = labels.top_k ? !!labels.top_k_prs : !!labels.probs;
+        if (inferred) {
+            expand_inferred_labels(ctx, &labels, n_pixels,
+                                   tracking->label_probs);
+        } else {
+            memset(tracking->label_probs, 0,
+                   n_pixels * ctx->n_labels * sizeof(float));
+        }
+        tracking->label_probs_expanded = true;
+    }
+    pthread_mutex_unlock(&tracking->label_probs_lock);
+
+    return tracking->label_probs;
+}
+
 static bool
 gm_context_track_skeleton(struct gm_context *ctx,
                           struct gm_tracking_impl *tracking)
@@ -3265,6 +3822,7 @@ gm_context_track_skeleton(struct gm_context *ctx,
     int height = tracking->training_camera_intrinsics.height;
 
     std::vector<float*> depth_images;
+    std::vector<std::vector<int>> person_pixels(persons.size());
     for (std::vector<pcl::PointIndices>::iterator p_it = persons.begin();
          p_it != persons.end(); ++p_it) {
 
@@ -3272,6 +3830,7 @@ gm_context_track_skeleton(struct gm_context *ctx,
         for (int i = 0; i < width * height; ++i) {
             depth_img[i] = HUGE_DEPTH;
         }
+        std::vector<int> &pixels = person_pixels[p_it - persons.begin()];
 
         for (std::vector<int>::const_iterator it = (*p_it).indices.begin();
              it != (*p_it).indices.end (); ++it) {
@@ -3308,6 +3867,9 @@ gm_context_track_skeleton(struct gm_context *ctx,
                     }
 
                     int doff = width * y + x;
+                    if (depth_img[doff] == HUGE_DEPTH) {
+                        pixels.push_back(doff);
+                    }
                     depth_img[doff] = point_t.z;
                 }
             }
@@ -3328,41 +3890,267 @@ gm_context_track_skeleton(struct gm_context *ctx,
 
     float vfov =  pcl::rad2deg(2.0f * atanf(0.5 * height /
                                tracking->training_camera_intrinsics.fy));
-    float *weights = (float*)
-        xmalloc(width * height * ctx->n_joints * sizeof(float));
-    float *label_probs = (float*)xmalloc(width * height * ctx->n_labels *
-                                         sizeof(float));
+    if (ctx->joints_workspace &&
+        (ctx->joints_workspace_width != width ||
+         ctx->joints_workspace_height != height)) {
+        infer_joints_workspace_free(ctx->joints_workspace);
+        ctx->joints_workspace = NULL;
+    }
+    if (!ctx->joints_workspace) {
+        ctx->joints_workspace =
+            infer_joints_workspace_new(width, height, ctx->n_joints, 0);
+        ctx->joints_workspace_width = width;
+        ctx->joints_workspace_height = height;
+    }
+    float *weights = infer_joints_workspace_get_weights(ctx->joints_workspace);
+    if (!ctx->labels_workspace) {
+        ctx->labels_workspace = infer_labels_workspace_new();
+    }
+
+    const Joint *joint_seeds = NULL;
+    if (ctx->seeded_joint_inference && ctx->n_tracking &&
+        ctx->tracking_history[0]) {
+        struct gm_skeleton &prev = ctx->tracking_history[0]->skeleton;
+        ctx->joint_seeds.resize(ctx->n_joints);
+        for (int j = 0; j < ctx->n_joints; ++j) {
+            ctx->joint_seeds[j].x = prev.joints[j].x;
+            ctx->joint_seeds[j].y = prev.joints[j].y;
+            ctx->joint_seeds[j].z = prev.joints[j].z;
+            ctx->joint_seeds[j].confidence = prev.joints[j].confidence;
+        }
+        joint_seeds = ctx->joint_seeds.data();
+    }
+
+    int top_k = std::min(ctx->label_top_k,
+                         std::min((int)ctx->n_labels, INFER_MAX_TOP_K));
+    size_t n_table_floats = (size_t)width * height * ctx->n_labels;
+    size_t n_top_k_prs = (size_t)width * height * top_k;
+    struct inferred_labels &labels = ctx->labels_scratch;
+    std::vector<float> sparse_label_probs;
+
+    /* The temporal label cache only holds full probability tables */
+    bool label_cache_enabled = ctx->temporal_label_cache && !top_k;
+    if (!label_cache_enabled) {
+        free_label_cache(ctx);
+    }
+    bool use_label_cache = label_cache_enabled &&
+        ctx->label_cache_width == width &&
+        ctx->label_cache_height == height &&
+        ctx->label_cache_age < ctx->label_cache_refresh_interval;
+    bool sparse = ctx->sparse_inference && !use_label_cache;
+    std::vector<int> changed_pixels;
+
+    if (sparse && ctx->label_rows_size != width * height) {
+        xfree(ctx->label_rows);
+        ctx->label_rows = (int *)xmalloc(width * height * sizeof(int));
+        ctx->label_rows_size = width * height;
+        for (int p = 0; p < width * height; ++p) {
+            ctx->label_rows[p] = -1;
+        }
+    }
+
+    update_inference_pool(ctx);
     unsigned best_person = 0;
     for (unsigned i = 0; i < depth_images.size(); ++i) {
         float *depth_img = depth_images[i];
 
         uint64_t lstart, lend, lduration;
 
+        labels.top_k = top_k;
+        labels.sparse = sparse;
+        labels.pixels.clear();
+        if (sparse) {
+            labels.pixels = person_pixels[i];
+            n_table_floats = labels.pixels.size() * ctx->n_labels;
+            n_top_k_prs = labels.pixels.size() * top_k;
+        }
+        if (top_k) {
+            labels.top_k_prs = (InferLabelPr *)
+                reserve_label_buffer(labels.top_k_prs, &labels.top_k_prs_size,
+                                     n_top_k_prs * sizeof(InferLabelPr));
+        } else {
+            labels.probs = (float *)
+                reserve_label_buffer(labels.probs, &labels.probs_size,
+                                     n_table_floats * sizeof(float));
+        }
+
         // Do inference
         lstart = get_time();
-        infer_labels<float>(ctx->decision_trees, ctx->n_decision_trees,
-                            depth_img, width, height, label_probs, true);
+        bool weights_inferred = false;
+        InferLabelsOptions infer_opts = {};
+        infer_opts.cascade_confidence = ctx->cascade_confidence;
+        infer_opts.max_depth = ctx->max_inference_depth;
+        infer_opts.workspace = ctx->labels_workspace;
+        if (use_label_cache) {
+            /* NB: pixels outside the person cluster have a background
+             * depth, so this is equivalent for sparse and dense inference
+             */
+            find_changed_label_pixels(ctx, depth_img, width, height,
+                                      changed_pixels);
+            sparse_label_probs.resize(changed_pixels.size() * ctx->n_labels);
+            infer_labels_sparse<float>(ctx->decision_trees,
+                                       ctx->n_decision_trees,
+                                       depth_img, width, height,
+                                       changed_pixels.data(),
+                                       changed_pixels.size(),
+                                       sparse_label_probs.data(),
+                                       ctx->inference_pool, &infer_opts);
+            memcpy(labels.probs, ctx->label_cache_probs,
+                   n_table_floats * sizeof(float));
+            for (unsigned p = 0; p < changed_pixels.size(); ++p) {
+                memcpy(&labels.probs[changed_pixels[p] * ctx->n_labels],
+                       &sparse_label_probs[p * ctx->n_labels],
+                       ctx->n_labels * sizeof(float));
+            }
+            LOGI("\tRe-inferring labels for %d/%d changed pixels",
+                 (int)changed_pixels.size(), width * height);
+        } else if (sparse) {
+            if (top_k) {
+                infer_labels_sparse_top_k<float>(ctx->decision_trees,
+                                                 ctx->n_decision_trees,
+                                                 depth_img, width, height,
+                                                 labels.pixels.data(),
+                                                 labels.pixels.size(),
+                                                 top_k, labels.top_k_prs,
+                                                 ctx->inference_pool,
+                                                 &infer_opts);
+            } else {
+                infer_labels_sparse<float>(ctx->decision_trees,
+                                           ctx->n_decision_trees,
+                                           depth_img, width, height,
+                                           labels.pixels.data(),
+                                           labels.pixels.size(),
+                                           labels.probs,
+                                           ctx->inference_pool, &infer_opts);
+            }
+        } else {
+            infer_opts.traversal = ctx->batched_inference ?
+                INFER_TRAVERSAL_BATCHED : INFER_TRAVERSAL_SCALAR;
+            infer_opts.coarse_scale = ctx->coarse_inference_scale;
+            if (top_k) {
+                infer_labels_top_k<float>(ctx->decision_trees,
+                                          ctx->n_decision_trees,
+                                          depth_img, width, height, top_k,
+                                          labels.top_k_prs,
+                                          ctx->inference_pool, &infer_opts);
+            } else {
+                /* Calculate the pixel weights while each pixel's table is
+                 * still in cache, instead of in a separate pass below
+                 */
+                infer_labels_with_weights<float>(ctx->decision_trees,
+                                                 ctx->n_decision_trees,
+                                                 depth_img, width, height,
+                                                 ctx->compiled_joint_map,
+                                                 weights, labels.probs,
+                                                 ctx->inference_pool,
+                                                 &infer_opts);
+                weights_inferred = true;
+            }
+        }
         lend = get_time();
         lduration = lend - lstart;
         LOGI("\tLabel inference took %.3f%s",
              get_duration_ns_print_scale(lduration),
              get_duration_ns_print_scale_suffix(lduration));
 
-        lstart = get_time();
-        calc_pixel_weights<float>(depth_img, label_probs, width, height,
-                                  ctx->n_labels, ctx->joint_map, weights);
-        lend = get_time();
-        lduration = lend - lstart;
-        LOGI("\tCalculating pixel weights took %.3f%s",
-             get_duration_ns_print_scale(lduration),
-             get_duration_ns_print_scale_suffix(lduration));
+        if (!weights_inferred) {
+            lstart = get_time();
+            if (sparse && top_k) {
+                calc_pixel_weights_sparse<float>(depth_img, labels.top_k_prs,
+                                                 top_k, labels.pixels.data(),
+                                                 labels.pixels.size(),
+                                                 width, height,
+                                                 ctx->compiled_joint_map,
+                                                 weights, ctx->inference_pool);
+            } else if (sparse) {
+                calc_pixel_weights_sparse<float>(depth_img, labels.probs,
+                                                 labels.pixels.data(),
+                                                 labels.pixels.size(),
+                                                 width, height, ctx->n_labels,
+                                                 ctx->compiled_joint_map,
+                                                 weights, ctx->inference_pool);
+            } else if (top_k) {
+                calc_pixel_weights<float>(depth_img, labels.top_k_prs, top_k,
+                                          width, height,
+                                          ctx->compiled_joint_map,
+                                          weights, ctx->inference_pool);
+            } else {
+                calc_pixel_weights<float>(depth_img, labels.probs,
+                                          width, height, ctx->n_labels,
+                                          ctx->compiled_joint_map, weights,
+                                          ctx->inference_pool);
+            }
+            lend = get_time();
+            lduration = lend - lstart;
+            LOGI("\tCalculating pixel weights took %.3f%s",
+                 get_duration_ns_print_scale(lduration),
+                 get_duration_ns_print_scale_suffix(lduration));
+        }
 
         lstart = get_time();
-        InferredJoints *candidate =
-            infer_joints_fast<float>(depth_img, label_probs, weights,
-                                     width, height, ctx->n_labels,
-                                     ctx->joint_map,
-                                     vfov, ctx->joint_params->joint_params);
+        const InferredJoints *candidate;
+        if (sparse) {
+            /* Map each pixel to its table while finding the joints, leaving
+             * the map cleared again for the next person
+             */
+            for (unsigned p = 0; p < labels.pixels.size(); ++p) {
+                ctx->label_rows[labels.pixels[p]] = p;
+            }
+            candidate = top_k ?
+                infer_joints_seeded<float>(depth_img, labels.top_k_prs, top_k,
+                                           ctx->label_rows, weights,
+                                           width, height,
+                                           ctx->compiled_joint_map, vfov,
+                                           ctx->joint_params->joint_params,
+                                           joint_seeds,
+                                           ctx->joint_seed_radius,
+                                           ctx->joints_workspace,
+                                           ctx->joints_pool) :
+                infer_joints_seeded<float>(depth_img, labels.probs,
+                                           ctx->label_rows, weights,
+                                           width, height, ctx->n_labels,
+                                           ctx->compiled_joint_map, vfov,
+                                           ctx->joint_params->joint_params,
+                                           joint_seeds,
+                                           ctx->joint_seed_radius,
+                                           ctx->joints_workspace,
+                                           ctx->joints_pool);
+            for (unsigned p = 0; p < labels.pixels.size(); ++p) {
+                ctx->label_rows[labels.pixels[p]] = -1;
+            }
+        } else if (joint_seeds) {
+            candidate = top_k ?
+                infer_joints_seeded<float>(depth_img, labels.top_k_prs, top_k,
+                                           weights, width, height,
+                                           ctx->compiled_joint_map, vfov,
+                                           ctx->joint_params->joint_params,
+                                           joint_seeds,
+                                           ctx->joint_seed_radius,
+                                           ctx->joints_workspace,
+                                           ctx->joints_pool) :
+                infer_joints_seeded<float>(depth_img, labels.probs, weights,
+                                           width, height, ctx->n_labels,
+                                           ctx->compiled_joint_map, vfov,
+                                           ctx->joint_params->joint_params,
+                                           joint_seeds,
+                                           ctx->joint_seed_radius,
+                                           ctx->joints_workspace,
+                                           ctx->joints_pool);
+        } else {
+            candidate = top_k ?
+                infer_joints_fast<float>(depth_img, labels.top_k_prs, top_k,
+                                         weights, width, height,
+                                         ctx->compiled_joint_map, vfov,
+                                         ctx->joint_params->joint_params,
+                                         ctx->joints_workspace,
+                                         ctx->joints_pool) :
+                infer_joints_fast<float>(depth_img, labels.probs, weights,
+                                         width, height, ctx->n_labels,
+                                         ctx->compiled_joint_map, vfov,
+                                         ctx->joint_params->joint_params,
+                                         ctx->joints_workspace,
+                                         ctx->joints_pool);
+        }
         lend = get_time();
         lduration = lend - lstart;
         LOGI("\tJoint inference took %.3f%s",
@@ -3379,13 +4167,12 @@ gm_context_track_skeleton(struct gm_context *ctx,
         build_bones(ctx, candidate_skeleton);
         refine_skeleton(ctx, candidate, candidate_skeleton);
 
-        free_joints(candidate);
-
         // If this skeleton has higher confidence than the last, keep it
         if (i == 0 ||
             compare_skeletons(candidate_skeleton, tracking->skeleton)) {
             std::swap(tracking->skeleton, candidate_skeleton);
-            std::swap(tracking->label_probs, label_probs);
+            std::swap(tracking->labels, labels);
+            tracking->label_probs_expanded = false;
             best_person = i;
         }
         lend = get_time();
@@ -3394,8 +4181,12 @@ gm_context_track_skeleton(struct gm_context *ctx,
              get_duration_ns_print_scale(lduration),
              get_duration_ns_print_scale_suffix(lduration));
     }
-    xfree(label_probs);
-    xfree(weights);
+
+    if (label_cache_enabled) {
+        update_label_cache(ctx, depth_images[best_person],
+                           &tracking->labels, width, height,
+                           !use_label_cache);
+    }
 
     if (ctx->debug_cloud_mode &&
         (ctx->debug_cloud_stage == TRACKING_STAGE_BEST_PERSON_BUF ||
@@ -4155,7 +4946,9 @@ tracking_state_free(struct gm_mem_pool *pool,
 {
     struct gm_tracking_impl *tracking = (struct gm_tracking_impl *)self;
 
-    free(tracking->label_probs);
+    xfree(tracking->label_probs);
+    free_inferred_labels(&tracking->labels);
+    pthread_mutex_destroy(&tracking->label_probs_lock);
     free(tracking->joints_processed);
 
     free(tracking->depth);
@@ -4182,6 +4975,7 @@ tracking_state_recycle(struct gm_tracking *self)
     tracking->frame = NULL;
 
     tracking->trail.clear();
+    tracking->label_probs_expanded = false;
 
     mem_pool_recycle_resource(pool, tracking);
 }
@@ -4221,15 +5015,10 @@ tracking_state_alloc(struct gm_mem_pool *pool, void *user_data)
     tracking->pool = pool;
     tracking->ctx = ctx;
 
-    int labels_width = ctx->training_camera_intrinsics.width;
-    int labels_height = ctx->training_camera_intrinsics.height;
-
-    assert(labels_width);
-    assert(labels_height);
+    assert(ctx->training_camera_intrinsics.width);
+    assert(ctx->training_camera_intrinsics.height);
 
-    tracking->label_probs = (float *)xcalloc(labels_width *
-                                             labels_height *
-                                             ctx->n_labels, sizeof(float));
+    pthread_mutex_init(&tracking->label_probs_lock, NULL);
 
     tracking->skeleton.joints.resize(ctx->n_joints);
     tracking->skeleton.bones.resize(ctx->n_joints);
@@ -4519,6 +5308,18 @@ gm_context_destroy(struct gm_context *ctx)
     gm_context_stop_tracking(ctx);
     gm_context_clear_tracking(ctx);
 
+    if (ctx->inference_pool)
+        thread_pool_free(ctx->inference_pool);
+    if (ctx->joints_pool)
+        thread_pool_free(ctx->joints_pool);
+    free_label_cache(ctx);
+    if (ctx->joints_workspace)
+        infer_joints_workspace_free(ctx->joints_workspace);
+    if (ctx->labels_workspace)
+        infer_labels_workspace_free(ctx->labels_workspace);
+    free_inferred_labels(&ctx->labels_scratch);
+    xfree(ctx->label_rows);
+
     /* Free the prediction pool. The user must have made sure to unref any
      * predictions before destroying the context.
      */
@@ -4553,6 +5354,9 @@ gm_context_destroy(struct gm_context *ctx)
     if (ctx->joint_params)
         jip_free(ctx->joint_params);
 
+    if (ctx->compiled_joint_map)
+        gm_joint_map_free(ctx->compiled_joint_map);
+
     if (ctx->joint_map)
         json_value_free(ctx->joint_map);
 
@@ -4691,6 +5495,8 @@ gm_context_new(struct gm_logger *logger, char **err)
     }
 
     ctx->n_labels = ctx->decision_trees[0]->header.n_labels;
+    ctx->max_uv_offset = get_max_uv_offset(ctx->decision_trees,
+                                           ctx->n_decision_trees);
 
     int ret = gm_context_start_tracking(ctx, err);
     if (ret != 0) {
@@ -4737,7 +5543,22 @@ gm_context_new(struct gm_logger *logger, char **err)
             return NULL;
         }
 
-        ctx->n_joints = json_array_get_count(json_array(ctx->joint_map));
+        ctx->compiled_joint_map = gm_joint_map_new(logger, ctx->joint_map,
+                                                   err);
+        if (!ctx->compiled_joint_map) {
+            gm_context_destroy(ctx);
+            return NULL;
+        }
+        if (ctx->compiled_joint_map->n_labels > ctx->n_labels) {
+            gm_throw(logger, err,
+                     "Joint map refers to label %d but decision trees only "
+                     "have %d labels",
+                     ctx->compiled_joint_map->n_labels - 1, ctx->n_labels);
+            gm_context_destroy(ctx);
+            return NULL;
+        }
+
+        ctx->n_joints = ctx->compiled_joint_map->n_joints;
 
     } else {
         gm_throw(logger, err, "Failed to open joint-map.json: %s", open_err);
@@ -5115,6 +5936,167 @@ gm_context_new(struct gm_logger *logger, char **err)
     prop.float_state.max = 3.0f;
     ctx->properties.push_back(prop);
 
+    ctx->n_inference_threads =
+        std::max(1, (int)std::thread::hardware_concurrency());
+    prop = gm_ui_property();
+    prop.object = ctx;
+    prop.name = "n_inference_threads";
+    prop.desc = "Number of threads to use for label inference and other "
+                "per-pixel tracking stages";
+    prop.type = GM_PROPERTY_INT;
+    prop.int_state.ptr = &ctx->n_inference_threads;
+    prop.int_state.min = 1;
+    prop.int_state.max = std::max(1, (int)std::thread::hardware_concurrency());
+    ctx->properties.push_back(prop);
+
+    ctx->inference_work_stealing = false;
+    prop = gm_ui_property();
+    prop.object = ctx;
+    prop.name = "inference_work_stealing";
+    prop.desc = "Let idle inference threads take work from busy threads";
+    prop.type = GM_PROPERTY_BOOL;
+    prop.bool_state.ptr = &ctx->inference_work_stealing;
+    ctx->properties.push_back(prop);
+
+    ctx->n_joint_inference_threads =
+        std::max(1, std::min(4, (int)std::thread::hardware_concurrency()));
+    prop = gm_ui_property();
+    prop.object = ctx;
+    prop.name = "n_joint_inference_threads";
+    prop.desc = "Number of threads to spread joint inference across, one "
+                "joint at a time";
+    prop.type = GM_PROPERTY_INT;
+    prop.int_state.ptr = &ctx->n_joint_inference_threads;
+    prop.int_state.min = 1;
+    prop.int_state.max = std::max(1, (int)std::thread::hardware_concurrency());
+    ctx->properties.push_back(prop);
+
+    ctx->batched_inference = false;
+    prop = gm_ui_property();
+    prop.object = ctx;
+    prop.name = "batched_inference";
+    prop.desc = "Walk decision trees for batches of pixels together, one "
+                "level at a time (SIMD)";
+    prop.type = GM_PROPERTY_BOOL;
+    prop.bool_state.ptr = &ctx->batched_inference;
+    ctx->properties.push_back(prop);
+
+    ctx->sparse_inference = true;
+    prop = gm_ui_property();
+    prop.object = ctx;
+    prop.name = "sparse_inference";
+    prop.desc = "Only infer labels for the pixels of each person cluster "
+                "(batched_inference only applies when this is disabled)";
+    prop.type = GM_PROPERTY_BOOL;
+    prop.bool_state.ptr = &ctx->sparse_inference;
+    ctx->properties.push_back(prop);
+
+    ctx->coarse_inference_scale = 1;
+    prop = gm_ui_property();
+    prop.object = ctx;
+    prop.name = "coarse_inference_scale";
+    prop.desc = "Infer labels for every Nth pixel first and only re-infer "
+                "other pixels near label boundaries (only applies when "
+                "sparse_inference and label_top_k are disabled)";
+    prop.type = GM_PROPERTY_INT;
+    prop.int_state.ptr = &ctx->coarse_inference_scale;
+    prop.int_state.min = 1;
+    prop.int_state.max = 4;
+    ctx->properties.push_back(prop);
+
+    ctx->max_inference_depth = 0;
+    prop = gm_ui_property();
+    prop.object = ctx;
+    prop.name = "max_inference_depth";
+    prop.desc = "Stop walking decision trees at this depth, using the label "
+                "distributions of split nodes if the trees have them "
+                "(0 walks to the leaves)";
+    prop.type = GM_PROPERTY_INT;
+    prop.int_state.ptr = &ctx->max_inference_depth;
+    prop.int_state.min = 0;
+    prop.int_state.max = 30;
+    ctx->properties.push_back(prop);
+
+    ctx->cascade_confidence = 0.f;
+    prop = gm_ui_property();
+    prop.object = ctx;
+    prop.name = "cascade_confidence";
+    prop.desc = "Only evaluate the remaining decision trees for pixels "
+                "labelled with less than this confidence by the first "
+                "(0 evaluates all trees)";
+    prop.type = GM_PROPERTY_FLOAT;
+    prop.float_state.ptr = &ctx->cascade_confidence;
+    prop.float_state.min = 0.f;
+    prop.float_state.max = 1.f;
+    ctx->properties.push_back(prop);
+
+    ctx->temporal_label_cache = false;
+    prop = gm_ui_property();
+    prop.object = ctx;
+    prop.name = "temporal_label_cache";
+    prop.desc = "Reuse the previous frame's labels for pixels whose depth "
+                "hasn't changed (only with full label probability tables)";
+    prop.type = GM_PROPERTY_BOOL;
+    prop.bool_state.ptr = &ctx->temporal_label_cache;
+    ctx->properties.push_back(prop);
+
+    ctx->label_cache_threshold = 0.01f;
+    prop = gm_ui_property();
+    prop.object = ctx;
+    prop.name = "label_cache_threshold";
+    prop.desc = "Depth change (in meters) beyond which a pixel's cached "
+                "labels are re-inferred";
+    prop.type = GM_PROPERTY_FLOAT;
+    prop.float_state.ptr = &ctx->label_cache_threshold;
+    prop.float_state.min = 0.f;
+    prop.float_state.max = 0.1f;
+    ctx->properties.push_back(prop);
+
+    ctx->label_cache_refresh_interval = 10;
+    prop = gm_ui_property();
+    prop.object = ctx;
+    prop.name = "label_cache_refresh_interval";
+    prop.desc = "Fully re-infer labels at least every N frames";
+    prop.type = GM_PROPERTY_INT;
+    prop.int_state.ptr = &ctx->label_cache_refresh_interval;
+    prop.int_state.min = 1;
+    prop.int_state.max = 100;
+    ctx->properties.push_back(prop);
+
+    ctx->label_top_k = 0;
+    prop = gm_ui_property();
+    prop.object = ctx;
+    prop.name = "label_top_k";
+    prop.desc = "Only keep this many of the most likely labels per pixel "
+                "after label inference (0 keeps full probability tables)";
+    prop.type = GM_PROPERTY_INT;
+    prop.int_state.ptr = &ctx->label_top_k;
+    prop.int_state.min = 0;
+    prop.int_state.max = INFER_MAX_TOP_K;
+    ctx->properties.push_back(prop);
+
+    ctx->seeded_joint_inference = false;
+    prop = gm_ui_property();
+    prop.object = ctx;
+    prop.name = "seeded_joint_inference";
+    prop.desc = "While tracking, look for each joint near its last tracked "
+                "position before searching the whole image";
+    prop.type = GM_PROPERTY_BOOL;
+    prop.bool_state.ptr = &ctx->seeded_joint_inference;
+    ctx->properties.push_back(prop);
+
+    ctx->joint_seed_radius = 0.2f;
+    prop = gm_ui_property();
+    prop.object = ctx;
+    prop.name = "joint_seed_radius";
+    prop.desc = "Distance (in meters) from a joint's last tracked position "
+                "within which to look for it";
+    prop.type = GM_PROPERTY_FLOAT;
+    prop.float_state.ptr = &ctx->joint_seed_radius;
+    prop.float_state.min = 0.05f;
+    prop.float_state.max = 1.f;
+    ctx->properties.push_back(prop);
+
     ctx->joint_refinement = true;
     prop = gm_ui_property();
     prop.object = ctx;
@@ -5482,6 +6464,28 @@ gm_tracking_get_skeleton(struct gm_tracking *_tracking)
     return tracking->success ? &tracking->skeleton : NULL;
 }
 
+/* Writes the RGB color of a pixel in gm_tracking_create_rgb_label_map(),
+ * given its most likely label and its probability of ctx->debug_label
+ */
+static void
+write_label_color(struct gm_context *ctx, uint8_t label, float debug_pr,
+                  uint8_t *rgb)
+{
+    if (ctx->debug_label == -1) {
+        rgb[0] = default_palette[label].red;
+        rgb[1] = default_palette[label].green;
+        rgb[2] = default_palette[label].blue;
+    } else {
+        struct color col = stops_color_from_val(ctx->heat_color_stops,
+                                                ctx->n_heat_color_stops,
+                                                1,
+                                                debug_pr);
+        rgb[0] = col.r;
+        rgb[1] = col.g;
+        rgb[2] = col.b;
+    }
+}
+
 void
 gm_tracking_create_rgb_label_map(struct gm_tracking *_tracking,
                                  int *width, int *height, uint8_t **output)
@@ -5502,38 +6506,54 @@ gm_tracking_create_rgb_label_map(struct gm_tracking *_tracking,
               "Can't create RGB map of invalid label %u",
               ctx->debug_label);
 
-    foreach_xy_off(*width, *height) {
-        uint8_t label = 0;
-        float pr = -1.0;
-        float *pr_table = &tracking->label_probs[off * n_labels];
-        for (uint8_t l = 0; l < n_labels; l++) {
-            if (pr_table[l] > pr) {
-                label = l;
-                pr = pr_table[l];
-            }
+    /* Read the labels in whichever form they were inferred instead of
+     * expanding full probability tables for every pixel
+     */
+    struct inferred_labels &labels = tracking->labels;
+    bool inferred = labels.top_k ? !!labels.top_k_prs : !!labels.probs;
+    int n_pixels = (*width) * (*height);
+
+    if (!inferred || labels.sparse) {
+        int bg_label = ctx->decision_trees[0]->header.bg_label;
+        for (int off = 0; off < n_pixels; ++off) {
+            write_label_color(ctx, bg_label,
+                              ctx->debug_label == bg_label ? 1.f : 0.f,
+                              &(*output)[off * 3]);
         }
+        if (!inferred) {
+            return;
+        }
+    }
 
-        uint8_t r;
-        uint8_t g;
-        uint8_t b;
-
-        if (ctx->debug_label == -1) {
-            r = default_palette[label].red;
-            g = default_palette[label].green;
-            b = default_palette[label].blue;
+    int n_tables = labels.sparse ? (int)labels.pixels.size() : n_pixels;
+    for (int i = 0; i < n_tables; ++i) {
+        int off = labels.sparse ? labels.pixels[i] : i;
+        uint8_t label = 0;
+        float debug_pr = 0.f;
+
+        if (labels.top_k) {
+            const InferLabelPr *prs = &labels.top_k_prs[i * labels.top_k];
+            label = prs[0].label;
+            for (int k = 0; k < labels.top_k; ++k) {
+                if (prs[k].label == ctx->debug_label) {
+                    debug_pr += prs[k].pr / 255.f;
+                }
+            }
         } else {
-            struct color col = stops_color_from_val(ctx->heat_color_stops,
-                                                    ctx->n_heat_color_stops,
-                                                    1,
-                                                    pr_table[ctx->debug_label]);
-            r = col.r;
-            g = col.g;
-            b = col.b;
+            float pr = -1.0;
+            float *pr_table = &labels.probs[i * n_labels];
+            for (uint8_t l = 0; l < n_labels; l++) {
+                if (pr_table[l] > pr) {
+                    label = l;
+                    pr = pr_table[l];
+                }
+            }
+            if (ctx->debug_label != -1) {
+                debug_pr = pr_table[ctx->debug_label];
+            }
         }
 
-        (*output)[off * 3] = r;
-        (*output)[off * 3 + 1] = g;
-        (*output)[off * 3 + 2] = b;
+        write_label_color(ctx, label, debug_pr, &(*output)[off * 3]);
     }
 }
 
@@ -5759,7 +6779,7 @@ gm_tracking_get_label_probabilities(struct gm_tracking *_tracking,
     *width = tracking->training_camera_intrinsics.width;
     *height = tracking->training_camera_intrinsics.height;
 
-    return tracking->label_probs;
+    return get_label_probs(tracking);
 }
 
 uint64_t
@@ -159,7 +159,8 @@ struct gm_rdt_context_impl {
 
     int      n_images;      // Number of training images
     uint8_t* label_images;  // Label images (row-major)
-    half*    depth_images;  // Depth images (row-major)
+    half*    depth_images;  // Padded depth images (row-major), see
+                            // get_depth_image()
 
     int      n_uvs;         // Number of combinations of u,v pairs
     float    uv_range;      // Range of u,v combinations to generate
@@ -579,6 +580,65 @@ calculate_gain(float entropy, int n_pixels,
                       (r_n_pixels / (float)n_pixels * r_entropy));
 }
 
+/* Pads all the training depth images (see pad_depth_image()) so that
+ * sample_uv_padded() can avoid bounds checks.
+ *
+ * Considering the size of training sets, this is done in place, working
+ * backwards so that no pixels are overwritten before they have been moved.
+ */
+static void
+pad_depth_images(struct gm_rdt_context_impl* ctx)
+{
+    int width = ctx->width;
+    int height = ctx->height;
+    int stride = padded_depth_image_stride(width);
+    size_t image_size = (size_t)width * height;
+    size_t padded_size = padded_depth_image_size(width, height);
+    const half bg_depth = (half)1000.f;
+
+    ctx->depth_images = (half*)xrealloc(ctx->depth_images,
+                                        ctx->n_images * padded_size *
+                                        sizeof(half));
+
+    for (int64_t i = ctx->n_images - 1; i >= 0; i--)
+    {
+        half* src = &ctx->depth_images[i * image_size];
+        half* dst = &ctx->depth_images[i * padded_size];
+
+        for (int y = height - 1; y >= 0; y--)
+        {
+            half* row = dst + (y + DEPTH_IMAGE_PADDING) * stride;
+            memmove(row + DEPTH_IMAGE_PADDING, src + y * width,
+                    width * sizeof(half));
+            for (int p = 0; p < DEPTH_IMAGE_PADDING; p++)
+            {
+                row[p] = bg_depth;
+                row[DEPTH_IMAGE_PADDING + width + p] = bg_depth;
+            }
+        }
+
+        for (int p = 0; p < DEPTH_IMAGE_PADDING * stride; p++)
+        {
+            dst[p] = bg_depth;
+            dst[padded_size - 1 - p] = bg_depth;
+        }
+    }
+}
+
+/* Returns a pointer to the first pixel of a padded depth image, see
+ * pad_depth_image()
+ */
+static inline half*
+get_depth_image(struct gm_rdt_context_impl* ctx, int image)
+{
+    size_t padded_size = padded_depth_image_size(ctx->width, ctx->height);
+    int stride = padded_depth_image_stride(ctx->width);
+
+    return &ctx->depth_images[image * padded_size +
+                              DEPTH_IMAGE_PADDING * stride +
+                              DEPTH_IMAGE_PADDING];
+}
+
 static void
 accumulate_uvt_lr_histograms(struct gm_rdt_context_impl* ctx,
                              struct thread_state *state,
@@ -607,12 +667,13 @@ accumulate_uvt_lr_histograms(struct gm_rdt_context_impl* ctx,
 
         int64_t image_idx = (int64_t)i * ctx->width * ctx->height;
 
-        half* depth_image = &ctx->depth_images[image_idx];
+        half* depth_image = get_depth_image(ctx, i);
         uint8_t* label_image = &ctx->label_images[image_idx];
 
         int pixel_idx = (pixel[1] * ctx->width) + pixel[0];
         int label = (int)label_image[pixel_idx];
-        float depth = depth_image[pixel_idx];
+        int stride = padded_depth_image_stride(ctx->width);
+        float depth = depth_image[(pixel[1] * stride) + pixel[0]];
 
         gm_assert(ctx->log, label < ctx->n_labels,
                   "Label '%d' is bigger than expected (max %d)\n",
@@ -633,9 +694,9 @@ accumulate_uvt_lr_histograms(struct gm_rdt_context_impl* ctx,
         for (int c = uv_start; c < uv_end; c++)
         {
             UVPair uv = ctx->uvs[c];
-            samples[c - uv_start] = sample_uv(depth_image,
-                                              ctx->width, ctx->height,
-                                              pixel, depth, uv);
+            samples[c - uv_start] = sample_uv_padded(depth_image,
+                                                     ctx->width, ctx->height,
+                                                     pixel, depth, uv);
         }
 
         // Partition on thresholds
@@ -816,12 +877,13 @@ collect_pixels(struct gm_rdt_context_impl* ctx,
     for (int p = 0; p < data->n_pixels; p++)
     {
         Int3D* pixel = &data->pixels[p];
-        int64_t image_idx = (int64_t)pixel->i * ctx->width * ctx->height;
-        half* depth_image = &ctx->depth_images[image_idx];
+        half* depth_image = get_depth_image(ctx, pixel->i);
 
-        float depth = depth_image[(pixel->xy[1] * ctx->width) + pixel->xy[0]];
-        float value = sample_uv(depth_image, ctx->width, ctx->height,
-                                pixel->xy, depth, uv);
+        float depth = depth_image[(pixel->xy[1] *
+                                   padded_depth_image_stride(ctx->width)) +
+                                  pixel->xy[0]];
+        float value = sample_uv_padded(depth_image, ctx->width, ctx->height,
+                                       pixel->xy, depth, uv);
 
         if (value < t)
         {
@@ -1069,11 +1131,42 @@ gm_rdt_context_destroy(struct gm_rdt_context *_ctx)
     delete ctx;
 }
 
+/* Returns the (1-based) index of the new table, see Node::label_pr_idx */
+static uint32_t
+add_tree_histogram(struct gm_rdt_context_impl* ctx, const float* histogram)
+{
+    int len = ctx->tree_histograms.size();
+    ctx->tree_histograms.resize(len + ctx->n_labels);
+    memcpy(&ctx->tree_histograms[len], histogram,
+           ctx->n_labels * sizeof(float));
+
+    // NB: 0 is reserved for non-leaf nodes
+    return (len / ctx->n_labels) + 1;
+}
+
+static JSON_Value*
+build_pr_table_json(struct gm_rdt_context_impl* ctx, uint32_t pr_idx)
+{
+    JSON_Value* probs_val = json_value_init_array();
+    JSON_Array* probs = json_array(probs_val);
+
+    /* NB: pr_idx is a base-one index since index zero is reserved to
+     * indicate that the node has no table
+     */
+    float* pr_table = &ctx->tree_histograms[(pr_idx - 1) * ctx->n_labels];
+
+    for (int i = 0; i < ctx->n_labels; i++)
+    {
+        json_array_append_number(probs, pr_table[i]);
+    }
+
+    return probs_val;
+}
+
 static JSON_Value*
 recursive_build_tree(struct gm_rdt_context_impl* ctx,
                      Node* node,
-                     int depth,
-                     int id)
+                     int depth)
 {
     JSON_Value* json_node_val = json_value_init_object();
     JSON_Object* json_node = json_object(json_node_val);
@@ -1094,46 +1187,36 @@ recursive_build_tree(struct gm_rdt_context_impl* ctx,
         json_array_append_number(v, node->uv[3]);
         json_object_set_value(json_node, "v", v_val);
 
+        /* The distribution of all the pixels that reached this node, used
+         * to limit the depth of inference
+         */
+        if (node->split_pr_idx)
+        {
+            json_object_set_value(json_node, "q",
+                                  build_pr_table_json(ctx,
+                                                      node->split_pr_idx));
+        }
+
         if (depth < (ctx->max_depth - 1))
         {
-            /* NB: The nodes in .rdt files are in a packed array arranged in
-             * breadth-first, left then right child order with the root node at
-             * index zero.
-             *
-             * With this layout then given an index for any particular node
-             * ('id' here) then 2 * id + 1 is the index for the left child and
-             * 2 * id + 2 is the index for the right child...
+            /* NB: The right child always immediately follows the left
+             * child
              */
-            int left_id = id * 2 + 1;
-            Node* left_node = &ctx->tree[left_id];
-            int right_id = id * 2 + 2;
-            Node* right_node = &ctx->tree[right_id];
+            Node* left_node = &ctx->tree[node->left_idx];
+            Node* right_node = left_node + 1;
 
             JSON_Value* left_json = recursive_build_tree(ctx, left_node,
-                                                         depth + 1, left_id);
+                                                         depth + 1);
             json_object_set_value(json_node, "l", left_json);
             JSON_Value* right_json = recursive_build_tree(ctx, right_node,
-                                                          depth + 1, right_id);
+                                                          depth + 1);
             json_object_set_value(json_node, "r", right_json);
         }
     }
     else if (node->label_pr_idx != INT_MAX) // Return empty obj for untrained nodes
     {
-        JSON_Value* probs_val = json_value_init_array();
-        JSON_Array* probs = json_array(probs_val);
-
-        /* NB: node->label_pr_idx is a base-one index since index zero is
-         * reserved to indicate that the node is not a leaf node
-         */
-        float* pr_table = &ctx->tree_histograms[(node->label_pr_idx - 1) *
-            ctx->n_labels];
-
-        for (int i = 0; i < ctx->n_labels; i++)
-        {
-            json_array_append_number(probs, pr_table[i]);
-        }
-
-        json_object_set_value(json_node, "p", probs_val);
+        json_object_set_value(json_node, "p",
+                              build_pr_table_json(ctx, node->label_pr_idx));
     }
 
     return json_node_val;
@@ -1177,7 +1260,7 @@ save_tree_json(struct gm_rdt_context_impl *ctx,
     json_object_set_number(json_object(root), "n_labels", ctx->n_labels);
     json_object_set_number(json_object(root), "bg_label", 0);
 
-    JSON_Value *nodes = recursive_build_tree(ctx, &tree[0], 0, 0);
+    JSON_Value *nodes = recursive_build_tree(ctx, &tree[0], 0);
 
     json_object_set_value(json_object(root), "root", nodes);
 
@@ -1227,6 +1310,22 @@ reload_tree(struct gm_rdt_context_impl *ctx,
         return false;
 
     // Do some basic validation
+    if (!checkpoint->nodes)
+    {
+        gm_throw(ctx->log, err,
+                 "%s uses the compact node format which can't be reloaded "
+                 "for training\n", filename);
+        return false;
+    }
+
+    if (!checkpoint->label_pr_tables)
+    {
+        gm_throw(ctx->log, err,
+                 "%s has quantized label probability tables which can't be "
+                 "reloaded for training\n", filename);
+        return false;
+    }
+
     if (checkpoint->header.n_labels != ctx->n_labels)
     {
         gm_throw(ctx->log, err, "%s has %d labels, expected %d\n",
@@ -1249,10 +1348,14 @@ reload_tree(struct gm_rdt_context_impl *ctx,
     int reload_depth = std::min((int)checkpoint->header.depth, ctx->max_depth);
     gm_info(ctx->log, "Reloading %d levels", reload_depth);
 
-    // Restore nodes
-    int n_reload_nodes = (1<<reload_depth) - 1;
-    gm_info(ctx->log, "Reloading %d nodes", n_reload_nodes);
-    memcpy(ctx->tree.data(), checkpoint->nodes, n_reload_nodes * sizeof(Node));
+    /* Restore nodes
+     *
+     * Note: if we're pruning the tree then the nodes below the new last
+     * level are left unreachable, and aren't saved
+     */
+    gm_info(ctx->log, "Reloading %u nodes", checkpoint->n_nodes);
+    ctx->tree.assign(checkpoint->nodes,
+                     checkpoint->nodes + checkpoint->n_nodes);
 
     // Navigate the tree to determine any unfinished nodes and the last
     // trained depth
@@ -1266,6 +1369,12 @@ reload_tree(struct gm_rdt_context_impl *ctx,
         reload_queue.pop();
         Node* node = &ctx->tree[node_data.id];
 
+        /* NB: the indices of any tables are re-assigned below as they're
+         * copied to tree_histograms
+         */
+        uint32_t split_pr_idx = node->split_pr_idx;
+        node->split_pr_idx = 0;
+
         if (node->label_pr_idx == INT_MAX)
         {
             // INT_MAX implies it wasn't trained yet..
@@ -1305,13 +1414,15 @@ reload_tree(struct gm_rdt_context_impl *ctx,
                  * in the loaded tree, but the indices aren't necessarily
                  * preserved as we copy them across to tree_histograms...
                  */
-                int len = ctx->tree_histograms.size();
-                ctx->tree_histograms.resize(len + ctx->n_labels);
-                memcpy(&ctx->tree_histograms[len], pr_table, ctx->n_labels * sizeof(float));
-
-                // NB: 0 is reserved for non-leaf nodes
-                node->label_pr_idx = (len / ctx->n_labels) + 1;
+                node->label_pr_idx = add_tree_histogram(ctx, pr_table);
             } else {
+                if (split_pr_idx)
+                {
+                    node->split_pr_idx = add_tree_histogram(ctx,
+                        &checkpoint->label_pr_tables[ctx->n_labels *
+                                                     (split_pr_idx - 1)]);
+                }
+
                 // If the node isn't a leaf-node, calculate which pixels should
                 // go to the next two nodes and add them to the reload
                 // queue
@@ -1323,7 +1434,7 @@ reload_tree(struct gm_rdt_context_impl *ctx,
                                &l_pixels, &r_pixels,
                                n_lr_pixels);
 
-                int id = (2 * node_data.id) + 1;
+                int id = node->left_idx;
                 int depth = node_data.depth + 1;
 
                 NodeTrainData ldata;
@@ -1436,6 +1547,8 @@ gm_rdt_context_train(struct gm_rdt_context* _ctx, char** err)
               "Can't handle training with more than %d labels",
               MAX_LABELS);
 
+    pad_depth_images(ctx);
+
     // Work out pixels per meter and adjust uv range accordingly
     float ppm = (ctx->height / 2.f) / tanf(ctx->fov / 2.f);
     ctx->uv_range *= ppm;
@@ -1459,16 +1572,11 @@ gm_rdt_context_train(struct gm_rdt_context* _ctx, char** err)
             (i * ctx->threshold_range / (float)(ctx->n_thresholds - 1));
     }
 
-    // Allocate memory to store the decision tree.
-    int n_tree_nodes = (1<<ctx->max_depth) - 1;
-    ctx->tree.resize(n_tree_nodes);
-
-    // Mark nodes in tree as unfinished, for checkpoint restoration
-    // Note: we still do this if we are reloading a tree, since it may
-    // be shallower than the total tree size.
-    for (int i = 0; i < (int)ctx->tree.size(); i++) {
-        ctx->tree[i].label_pr_idx = INT_MAX;
-    }
+    /* Nodes are only allocated as they're split, so we start with an
+     * unfinished root node (replaced if we're reloading a tree)
+     */
+    ctx->tree.resize(1);
+    ctx->tree[0].label_pr_idx = INT_MAX;
 
     // Create the randomized sample points across all images that the decision
     // tree is going to learn to classify, and associate with a root node...
@@ -1655,7 +1763,27 @@ gm_rdt_context_train(struct gm_rdt_context* _ctx, char** err)
             collect_pixels(ctx, &node_data, node->uv, node->t,
                            &l_pixels, &r_pixels, n_lr_pixels);
 
-            int id = (2 * node_data.id) + 1;
+            /* Allocate the children together, marked as unfinished for
+             * checkpoint restoration, so that the right child immediately
+             * follows the left child
+             */
+            int id = ctx->tree.size();
+            Node unfinished = {};
+            unfinished.label_pr_idx = INT_MAX;
+            ctx->tree.push_back(unfinished);
+            ctx->tree.push_back(unfinished);
+
+            // NB: push_back() may have moved the tree
+            node = &ctx->tree[node_data.id];
+            node->left_idx = id;
+
+            /* Also keep the distribution of the pixels at this node so that
+             * inference can be stopped at this depth (see the same
+             * histogram being used for leaves below)
+             */
+            node->split_pr_idx = add_tree_histogram(ctx,
+                                                    ctx->results[0].nhistogram);
+
             int depth = node_data.depth + 1;
             NodeTrainData ldata;
             ldata.id = id;
@@ -1693,11 +1821,7 @@ gm_rdt_context_train(struct gm_rdt_context* _ctx, char** err)
                 }
             }
 
-            // NB: 0 is reserved for non-leaf nodes
-            node->label_pr_idx = (ctx->tree_histograms.size() / ctx->n_labels) + 1;
-            int len = ctx->tree_histograms.size();
-            ctx->tree_histograms.resize(len + ctx->n_labels);
-            memcpy(&ctx->tree_histograms[len], nhistogram, ctx->n_labels * sizeof(float));
+            node->label_pr_idx = add_tree_histogram(ctx, nhistogram);
         }
 
         // We no longer need the node's pixel data
@@ -0,0 +1,354 @@
+/*
+ * Copyright (C) 2018 Glimp IP Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "xalloc.h"
+#include "glimpse_log.h"
+#include "glimpse_thread_pool.h"
+
+
+/* Each thread's range of items lives on its own cache line since the
+ * 'next' counter is updated for every item claimed.
+ */
+struct thread_range {
+    std::atomic<int> next;
+    int end;
+} __attribute__((aligned(64)));
+
+struct gm_thread_pool;
+
+struct worker_state {
+    struct gm_thread_pool *pool;
+    int thread;
+    pthread_t handle;
+};
+
+struct gm_thread_pool {
+    struct gm_logger *log;
+
+    char *name;
+    int n_threads;
+    bool work_stealing;
+
+    std::vector<struct worker_state> workers;
+    struct thread_range *ranges;
+
+    /* Held for the duration of thread_pool_run() to serialize callers */
+    pthread_mutex_t submit_lock;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    uint64_t generation;
+    int n_busy;
+    bool quit;
+
+    /* The current job, only valid while the submit_lock is held */
+    void (*func)(int item, int thread, void *user_data);
+    void *user_data;
+};
+
+/* Lets us recognise nested calls from within a work callback so they can
+ * be run synchronously instead of deadlocking on the submit_lock.
+ */
+static __thread struct gm_thread_pool *tls_current_pool;
+static __thread int tls_current_thread;
+
+static void
+process_items(struct gm_thread_pool *pool, int thread)
+{
+    struct thread_range *range = &pool->ranges[thread];
+    int i;
+
+    while ((i = range->next.fetch_add(1, std::memory_order_relaxed)) <
+           range->end)
+    {
+        pool->func(i, thread, pool->user_data);
+    }
+
+    if (!pool->work_stealing)
+        return;
+
+    for (int t = 1; t < pool->n_threads; t++) {
+        range = &pool->ranges[(thread + t) % pool->n_threads];
+        while ((i = range->next.fetch_add(1, std::memory_order_relaxed)) <
+               range->end)
+        {
+            pool->func(i, thread, pool->user_data);
+        }
+    }
+}
+
+static void *
+worker_thread_cb(void *data)
+{
+    struct worker_state *state = (struct worker_state *)data;
+    struct gm_thread_pool *pool = state->pool;
+    uint64_t generation = 0;
+
+    tls_current_pool = pool;
+    tls_current_thread = state->thread;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (pool->generation == generation && !pool->quit)
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        if (pool->quit)
+            break;
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        process_items(pool, state->thread);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->n_busy == 0)
+            pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static void
+stop_workers(struct gm_thread_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned i = 0; i < pool->workers.size(); i++) {
+        if (pthread_join(pool->workers[i].handle, NULL) != 0) {
+            gm_error(pool->log, "Error joining %s pool thread %d",
+                     pool->name, pool->workers[i].thread);
+        }
+    }
+    pool->workers.clear();
+}
+
+struct gm_thread_pool *
+thread_pool_alloc(struct gm_logger *log,
+                  const char *name,
+                  int n_threads,
+                  bool work_stealing,
+                  char **err)
+{
+    if (n_threads < 1) {
+        gm_throw(log, err, "Invalid number of threads (%d) for %s pool",
+                 n_threads, name);
+        return NULL;
+    }
+
+    struct gm_thread_pool *pool = new gm_thread_pool();
+
+    pool->log = log;
+    pool->name = strdup(name);
+    pool->n_threads = n_threads;
+    pool->work_stealing = work_stealing;
+    pool->ranges = (struct thread_range *)
+        xaligned_alloc(64, sizeof(struct thread_range) * n_threads);
+    for (int i = 0; i < n_threads; i++) {
+        pool->ranges[i].next.store(0);
+        pool->ranges[i].end = 0;
+    }
+
+    pthread_mutex_init(&pool->submit_lock, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    /* Reserve up-front so the worker_state pointers we pass to each thread
+     * remain valid
+     */
+    pool->workers.reserve(n_threads - 1);
+    for (int i = 1; i < n_threads; i++) {
+        struct worker_state state = { pool, i, 0 };
+        pool->workers.push_back(state);
+
+        struct worker_state *worker = &pool->workers.back();
+        int ret = pthread_create(&worker->handle, NULL,
+                                 worker_thread_cb, worker);
+        if (ret != 0) {
+            gm_throw(log, err, "Failed to create %s pool thread %d: %s",
+                     name, i, strerror(ret));
+            pool->workers.pop_back();
+            thread_pool_free(pool);
+            return NULL;
+        }
+
+#ifdef __linux__
+        /* Room for the whole prefix and index, then cut down to the 16
+         * bytes (including the terminator) that Linux allows for names
+         */
+        char thread_name[32];
+        snprintf(thread_name, sizeof(thread_name), "%.11s %d", name, i);
+        thread_name[15] = '\0';
+        pthread_setname_np(worker->handle, thread_name);
+#endif
+    }
+
+    return pool;
+}
+
+void
+thread_pool_free(struct gm_thread_pool *pool)
+{
+    stop_workers(pool);
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->submit_lock);
+
+    xfree(pool->ranges);
+    free(pool->name);
+    delete pool;
+}
+
+int
+thread_pool_get_n_threads(struct gm_thread_pool *pool)
+{
+    return pool ? pool->n_threads : 1;
+}
+
+bool
+thread_pool_get_work_stealing(struct gm_thread_pool *pool)
+{
+    return pool ? pool->work_stealing : false;
+}
+
+void
+thread_pool_run(struct gm_thread_pool *pool,
+                int n_items,
+                void (*func)(int item, int thread, void *user_data),
+                void *user_data)
+{
+    if (n_items <= 0)
+        return;
+
+    if (!pool || pool->n_threads == 1 || n_items == 1 ||
+        tls_current_pool == pool)
+    {
+        int thread = (pool && tls_current_pool == pool) ?
+            tls_current_thread : 0;
+        for (int i = 0; i < n_items; i++)
+            func(i, thread, user_data);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->submit_lock);
+
+    pool->func = func;
+    pool->user_data = user_data;
+
+    int n_threads = pool->n_threads;
+    for (int t = 0; t < n_threads; t++) {
+        pool->ranges[t].next.store((int)((int64_t)n_items * t / n_threads),
+                                   std::memory_order_relaxed);
+        pool->ranges[t].end = (int)((int64_t)n_items * (t + 1) / n_threads);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->n_busy = n_threads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    struct gm_thread_pool *prev_pool = tls_current_pool;
+    int prev_thread = tls_current_thread;
+    tls_current_pool = pool;
+    tls_current_thread = 0;
+    process_items(pool, 0);
+    tls_current_pool = prev_pool;
+    tls_current_thread = prev_thread;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->n_busy)
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    pool->func = NULL;
+    pool->user_data = NULL;
+
+    pthread_mutex_unlock(&pool->submit_lock);
+}
+
+struct tiles_job {
+    int width;
+    int height;
+    int tile_width;
+    int tile_height;
+    int n_tiles_x;
+    void (*func)(int x0, int y0, int x1, int y1, int thread, void *user_data);
+    void *user_data;
+};
+
+static void
+run_tile_cb(int item, int thread, void *user_data)
+{
+    struct tiles_job *job = (struct tiles_job *)user_data;
+
+    int x0 = (item % job->n_tiles_x) * job->tile_width;
+    int y0 = (item / job->n_tiles_x) * job->tile_height;
+    int x1 = std::min(x0 + job->tile_width, job->width);
+    int y1 = std::min(y0 + job->tile_height, job->height);
+
+    job->func(x0, y0, x1, y1, thread, job->user_data);
+}
+
+void
+thread_pool_run_tiles(struct gm_thread_pool *pool,
+                      int width,
+                      int height,
+                      int tile_width,
+                      int tile_height,
+                      void (*func)(int x0, int y0, int x1, int y1,
+                                   int thread, void *user_data),
+                      void *user_data)
+{
+    if (width <= 0 || height <= 0)
+        return;
+
+    struct tiles_job job;
+    job.width = width;
+    job.height = height;
+    job.tile_width = tile_width > 0 ? std::min(tile_width, width) : width;
+    job.tile_height = tile_height > 0 ? std::min(tile_height, height) : height;
+    job.n_tiles_x = (width + job.tile_width - 1) / job.tile_width;
+    job.func = func;
+    job.user_data = user_data;
+
+    int n_tiles_y = (height + job.tile_height - 1) / job.tile_height;
+
+    thread_pool_run(pool, job.n_tiles_x * n_tiles_y, run_tile_cb, &job);
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2018 Glimp IP Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "glimpse_log.h"
+
+/* A long-lived set of worker threads that can be handed data-parallel
+ * work without paying for thread creation/joining on every call.
+ *
+ * The thread that calls thread_pool_run() participates as thread 0 and
+ * blocks until all items have been processed, so a pool of N threads only
+ * spawns N-1 workers. Items are statically split into one contiguous range
+ * per thread and if work stealing is enabled then threads that finish
+ * early will go on to claim items from the ranges of other threads.
+ *
+ * Concurrent calls to thread_pool_run() from different threads are
+ * serialized, and a nested call from within a work callback is run
+ * synchronously by the calling thread.
+ *
+ * Passing a NULL pool to the run functions is valid and will process all
+ * items synchronously as thread 0.
+ */
+struct gm_thread_pool;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct gm_thread_pool *
+thread_pool_alloc(struct gm_logger *log,
+                  const char *name,
+                  int n_threads,
+                  bool work_stealing,
+                  char **err);
+
+void
+thread_pool_free(struct gm_thread_pool *pool);
+
+int
+thread_pool_get_n_threads(struct gm_thread_pool *pool);
+
+bool
+thread_pool_get_work_stealing(struct gm_thread_pool *pool);
+
+/* Calls func() once for each item in [0, n_items). The 'thread' argument
+ * is in the range [0, n_threads) and can be used to index per-thread
+ * scratch state, since a thread never runs two items concurrently.
+ */
+void
+thread_pool_run(struct gm_thread_pool *pool,
+                int n_items,
+                void (*func)(int item, int thread, void *user_data),
+                void *user_data);
+
+/* Divides a width x height image into tiles and calls func() once for each
+ * tile with the half-open bounds [x0, x1) x [y0, y1).
+ *
+ * A tile_width or tile_height <= 0 means to use the full image width or
+ * height respectively, so e.g. tile_width = 0, tile_height = 1 will
+ * process individual rows.
+ */
+void
+thread_pool_run_tiles(struct gm_thread_pool *pool,
+                      int width,
+                      int height,
+                      int tile_width,
+                      int tile_height,
+                      void (*func)(int x0, int y0, int x1, int y1,
+                                   int thread, void *user_data),
+                      void *user_data);
+
+#ifdef __cplusplus
+}
+#endif
@@ -24,17 +24,23 @@
 
 
 #include <stdbool.h>
+#include <assert.h>
+#include <limits.h>
 #include <math.h>
+#include <string.h>
+#include <algorithm>
 #include <vector>
-#include <list>
-#include <forward_list>
-#include <thread>
-#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "half.hpp"
 
 #include "infer.h"
+#include "rdt_compiled.h"
 #include "xalloc.h"
+#include "glimpse_thread_pool.h"
 #include "utils.h"
 #include "rdt_tree.h"
 #include "jip.h"
@@ -42,82 +48,460 @@
 #define N_SHIFTS 5
 #define SHIFT_THRESHOLD 0.01f
 
+/* infer_joints() ignores points further than this many bandwidths apart,
+ * where the gaussian kernel weight has dropped below 1.2% of its peak */
+#define MEAN_SHIFT_CUTOFF 3.f
+
+/* Upper bound on the number of cells of a mean-shift grid, beyond which the
+ * cells are grown to cover the points with fewer of them */
+#define MEAN_SHIFT_MAX_CELLS (1 << 16)
+
+/* Number of points weighed together by infer_joints(), kept to the native
+ * vector width since the kernel's temporaries don't fit in SSE registers
+ * when split in halves */
+#ifdef __AVX__
+#define MEAN_SHIFT_BATCH_SIZE 8
+#else
+#define MEAN_SHIFT_BATCH_SIZE 4
+#endif
+
 #define ARRAY_LEN(ARRAY) (sizeof(ARRAY)/sizeof(ARRAY[0]))
 
+/* Number of pixels advanced together by INFER_TRAVERSAL_BATCHED */
+#define INFER_BATCH_SIZE 8
 
-using half_float::half;
+/* Number of trees walked together by INFER_TRAVERSAL_INTERLEAVED */
+#define INFER_MAX_INTERLEAVED_TREES 8
 
+/* Number of pixels per work item for infer_labels_sparse() */
+#define INFER_SPARSE_CHUNK_SIZE 64
 
-typedef struct {
-    int n_labels;
 
-    /* XXX: There's a runtime check that we don't have joints mapped to
-     * more than two labels and this can easily be bumped if necessary.
-     * Keeping this at the minimum size seems likely to help improve
-     * locality considering the frequency of accessing this data within
-     * some of the inner loops below.
-     */
-    uint8_t labels[2];
-} JointMapEntry;
+using half_float::half;
+
 
 typedef struct {
-    int thread;
-    int n_threads;
     RDTree** forest;
     int n_trees;
+    /* A padded copy of the depth image, see pad_depth_image() */
     void* depth_image;
     int width;
     int height;
+    int n_labels;
+    int n_stripes;
     float* output;
-} InferThreadData;
+    enum infer_traversal traversal;
+    float cascade_confidence;
+
+    /* For infer_labels_sparse(), the list of pixel offsets to evaluate, in
+     * the same order as the (compact) output tables
+     */
+    const int* pixels;
+    int n_pixels;
+
+    /* If all trees have quantized tables with the same format and scale then
+     * leaf distributions are summed as integers into a per-thread
+     * accumulator and only scaled once per pixel.
+     */
+    int table_format;
+    float table_scale;
+    uint32_t* accumulators;
+
+    /* For infer_labels_top_k(), each pixel's table is accumulated in a
+     * per-thread scratch table and then reduced to its top_k labels
+     */
+    int top_k;
+    InferLabelPr* top_k_output;
+    float* scratch;
+
+    /* Non-NULL if the forest matches the forest built in by rdt-compile,
+     * in which case the scalar traversal starts from the node reached by
+     * the generated code for each tree's top levels
+     */
+    const RDTCompiledForest* compiled;
+
+    /* The depth at which to stop at split nodes that have a distribution,
+     * INT_MAX if unlimited, see InferLabelsOptions::max_depth
+     */
+    int max_depth;
+
+    /* For infer_labels_with_weights(), each pixel's joint weights are
+     * calculated as soon as its table is complete, and tables are only kept
+     * if the output is non-NULL (otherwise they are accumulated in the
+     * per-thread scratch tables)
+     */
+    const struct gm_joint_map* joint_map;
+    float* weights;
+} InferLabelsState;
+
+/* Compact nodes store U and V as half-floats. Since these are never
+ * infinite or NaN we can avoid the general (table based) conversion and
+ * convert all four values at once by shifting the exponent and mantissa
+ * into place and re-biasing the exponent with a multiply.
+ */
+static inline UVPair
+unpack_compact_uv(RDTCompactNode* node)
+{
+    typedef vector(uint32_t, 4) UVBits;
+
+    UVBits h = { node->uv[0], node->uv[1], node->uv[2], node->uv[3] };
+    UVBits bits = ((h & 0x7fff) << 13) | ((h & 0x8000) << 16);
+
+    return (UVPair)bits * 0x1p112f;
+}
+
+/* Adds a quantized leaf distribution to a set of 32bit accumulators, eight
+ * labels at a time.
+ */
+template<typename QuantT>
+static inline void
+accumulate_quantized_table(uint32_t* acc, const QuantT* table, int n_labels)
+{
+    typedef vector(QuantT, 8) QuantVec;
+    typedef vector(uint32_t, 8) AccVec;
+
+    int n = 0;
+    for (; n + 8 <= n_labels; n += 8)
+    {
+        QuantVec q;
+        AccVec sum;
+        memcpy(&q, table + n, sizeof(q));
+        memcpy(&sum, acc + n, sizeof(sum));
+        sum += __builtin_convertvector(q, AccVec);
+        memcpy(acc + n, &sum, sizeof(sum));
+    }
+    for (; n < n_labels; ++n)
+    {
+        acc[n] += table[n];
+    }
+}
+
+static inline void
+accumulate_leaf_table(InferLabelsState* data, RDTree* tree, uint32_t leaf_idx,
+                      float* out_pr_table, uint32_t* acc)
+{
+    int n_labels = tree->header.n_labels;
+    size_t off = (size_t)leaf_idx * n_labels;
+
+    if (acc)
+    {
+        if (data->table_format == RDT_TABLE_FORMAT_U8)
+        {
+            accumulate_quantized_table(
+                acc, (uint8_t*)tree->quantized_pr_tables + off, n_labels);
+        }
+        else
+        {
+            accumulate_quantized_table(
+                acc, (uint16_t*)tree->quantized_pr_tables + off, n_labels);
+        }
+        return;
+    }
+
+    switch (tree->table_format)
+    {
+    case RDT_TABLE_FORMAT_FLOAT: {
+        float* pr_table = &tree->label_pr_tables[off];
+        for (int n = 0; n < n_labels; ++n)
+        {
+            out_pr_table[n] += pr_table[n];
+        }
+        break;
+    }
+    case RDT_TABLE_FORMAT_U8: {
+        uint8_t* q = (uint8_t*)tree->quantized_pr_tables + off;
+        for (int n = 0; n < n_labels; ++n)
+        {
+            out_pr_table[n] += q[n] * tree->table_scale;
+        }
+        break;
+    }
+    case RDT_TABLE_FORMAT_U16: {
+        uint16_t* q = (uint16_t*)tree->quantized_pr_tables + off;
+        for (int n = 0; n < n_labels; ++n)
+        {
+            out_pr_table[n] += q[n] * tree->table_scale;
+        }
+        break;
+    }
+    }
+}
 
+/* Clears the output (and integer accumulator) for a pixel before the leaf
+ * distributions of each tree are accumulated.
+ *
+ * Returns false for background pixels, which don't need to be evaluated.
+ */
+static inline bool
+begin_pixel(InferLabelsState* data, float depth_value,
+            float* out_pr_table, uint32_t* acc)
+{
+    int n_labels = data->forest[0]->header.n_labels;
+
+    memset(out_pr_table, 0, n_labels * sizeof(float));
+
+    // TODO: Provide a configurable threshold here?
+    if (depth_value >= HUGE_DEPTH)
+    {
+        out_pr_table[data->forest[0]->header.bg_label] += 1.0f;
+        return false;
+    }
+
+    if (acc)
+    {
+        memset(acc, 0, n_labels * sizeof(uint32_t));
+    }
+
+    return true;
+}
+
+/* For cascaded evaluation, checks whether the running distribution of a
+ * pixel after the first n_evaluated trees is confident enough that the
+ * remaining trees can be skipped
+ */
+static inline bool
+pixel_is_confident(InferLabelsState* data, const float* pr_table,
+                   const uint32_t* acc, int n_evaluated)
+{
+    if (data->cascade_confidence <= 0.f || n_evaluated >= data->n_trees)
+    {
+        return false;
+    }
+
+    int n_labels = data->n_labels;
+    float max_pr = 0.f;
+
+    if (acc)
+    {
+        uint32_t max_acc = 0;
+        for (int n = 0; n < n_labels; ++n)
+        {
+            max_acc = std::max(max_acc, acc[n]);
+        }
+        max_pr = max_acc * data->table_scale;
+    }
+    else
+    {
+        for (int n = 0; n < n_labels; ++n)
+        {
+            max_pr = std::max(max_pr, pr_table[n]);
+        }
+    }
+
+    return max_pr >= data->cascade_confidence * n_evaluated;
+}
+
+/* Normalizes the sum of the leaf distributions of the first n_evaluated
+ * trees (all of them unless the evaluation was cascaded)
+ */
+static inline void
+end_pixel(InferLabelsState* data, float* out_pr_table, uint32_t* acc,
+          int n_evaluated)
+{
+    int n_labels = data->forest[0]->header.n_labels;
+
+    if (acc)
+    {
+        float scale = data->table_scale / (float)n_evaluated;
+        for (int n = 0; n < n_labels; ++n)
+        {
+            out_pr_table[n] = acc[n] * scale;
+        }
+        return;
+    }
+
+    for (int n = 0; n < n_labels; ++n)
+    {
+        out_pr_table[n] /= (float)n_evaluated;
+    }
+}
+
+/* Returns the table to accumulate the i'th output pixel's probabilities
+ * in, for the given batch lane
+ */
+static inline float*
+get_pixel_pr_table(InferLabelsState* data, int i, int thread, int lane)
+{
+    if (data->top_k || !data->output)
+    {
+        return &data->scratch[(thread * INFER_BATCH_SIZE + lane) *
+                              data->n_labels];
+    }
+
+    return &data->output[i * data->n_labels];
+}
+
+/* Equivalent to calc_pixel_weights() for the i'th pixel of a dense output */
 template<typename FloatT>
-static void*
-infer_labels_thread(void* userdata)
+static inline void
+store_pixel_weights(InferLabelsState* data, int i, const float* pr_table)
 {
-    InferThreadData* data = (InferThreadData*)userdata;
     FloatT* depth_image = (FloatT*)data->depth_image;
-    int n_labels = data->forest[0]->header.n_labels;
+    int x = i % data->width;
+    int y = i / data->width;
+    float depth = depth_to_float(
+        depth_image[y * padded_depth_image_stride(data->width) + x]);
+    float depth_2 = depth * depth;
+
+    const struct gm_joint_map* map = data->joint_map;
+    float* weights = &data->weights[i * map->n_joints];
+    for (int j = 0; j < map->n_joints; j++)
+    {
+        float pr = 0.f;
+        for (int n = map->label_offsets[j]; n < map->label_offsets[j + 1]; n++)
+        {
+            pr += pr_table[map->labels[n]];
+        }
+        weights[j] = pr * depth_2;
+    }
+}
 
-    // Accumulate probability map
-    for (int off = data->thread;
-         off < data->width * data->height;
-         off += data->n_threads)
+/* Writes the i'th output pixel's top_k labels or joint weights once its
+ * table is complete
+ */
+template<typename FloatT>
+static inline void
+store_pixel_pr_table(InferLabelsState* data, int i, const float* pr_table)
+{
+    if (data->weights)
     {
-        int y = off / data->width;
-        int x = off % data->width;
+        store_pixel_weights<FloatT>(data, i, pr_table);
+    }
 
-        float* out_pr_table = &data->output[off * n_labels];
-        float depth_value = (float)depth_image[off];
+    if (!data->top_k)
+    {
+        return;
+    }
+
+    int top_k = data->top_k;
+    InferLabelPr* out = &data->top_k_output[i * top_k];
+    float top_pr[INFER_MAX_TOP_K];
+
+    for (int k = 0; k < top_k; ++k)
+    {
+        top_pr[k] = 0.f;
+        out[k].label = 0;
+        out[k].pr = 0;
+    }
 
-        // TODO: Provide a configurable threshold here?
-        if (depth_value >= HUGE_DEPTH)
+    // Insertion sort into the top_k, most likely first
+    for (int n = 0; n < data->n_labels; ++n)
+    {
+        float pr = pr_table[n];
+        if (pr <= top_pr[top_k - 1])
         {
-            out_pr_table[data->forest[0]->header.bg_label] += 1.0f;
             continue;
         }
 
-        Int2D pixel = { x, y };
-        for (int i = 0; i < data->n_trees; ++i)
+        int k = top_k - 1;
+        for (; k > 0 && pr > top_pr[k - 1]; --k)
         {
-            RDTree* tree = data->forest[i];
-            Node* node = tree->nodes;
+            top_pr[k] = top_pr[k - 1];
+            out[k].label = out[k - 1].label;
+        }
+        top_pr[k] = pr;
+        out[k].label = (uint8_t)n;
+    }
+
+    for (int k = 0; k < top_k; ++k)
+    {
+        out[k].pr = (uint8_t)lroundf(std::min(top_pr[k], 1.f) * 255.f);
+    }
+}
+
+template<typename FloatT>
+static inline void
+infer_labels_pixel(InferLabelsState* data, int x, int y,
+                   float* out_pr_table, int thread)
+{
+    FloatT* depth_image = (FloatT*)data->depth_image;
+    int n_labels = data->forest[0]->header.n_labels;
+    int off = y * padded_depth_image_stride(data->width) + x;
+
+    float depth_value = depth_to_float(depth_image[off]);
+    uint32_t* acc = data->accumulators ?
+        &data->accumulators[thread * INFER_BATCH_SIZE * n_labels] : NULL;
+
+    if (!begin_pixel(data, depth_value, out_pr_table, acc))
+    {
+        return;
+    }
 
-            int id = 0;
+    Int2D pixel = { x, y };
+    int n_evaluated = data->n_trees;
+    for (int i = 0; i < data->n_trees; ++i)
+    {
+        RDTree* tree = data->forest[i];
+        uint32_t leaf_idx;
+
+        if (tree->compact_nodes)
+        {
+            RDTCompactNode* node = tree->compact_nodes;
+            if (data->compiled)
+            {
+                node = &tree->compact_nodes[
+                    rdt_compiled_tree_eval(&data->compiled->trees[i],
+                                           depth_image,
+                                           data->width, data->height,
+                                           pixel, depth_value)];
+            }
+            while (!(node->idx & RDT_COMPACT_LEAF_BIT))
+            {
+                float value = sample_uv_padded<FloatT>(depth_image,
+                                                       data->width,
+                                                       data->height,
+                                                       pixel, depth_value,
+                                                       unpack_compact_uv(node));
+
+                /* NB: The right child always immediately follows the left
+                 * child in the compact format.
+                 *
+                 * Keep this as a branch so the CPU can speculatively start
+                 * on the next level since neighbouring pixels tend to take
+                 * the same path.
+                 */
+                if (value < node->t)
+                {
+                    node = &tree->compact_nodes[node->idx];
+                }
+                else
+                {
+                    node = &tree->compact_nodes[node->idx + 1];
+                }
+            }
+            leaf_idx = node->idx & ~RDT_COMPACT_LEAF_BIT;
+        }
+        else
+        {
+            Node* node = tree->nodes;
+            int level = 0;
+            if (data->compiled)
+            {
+                node = &tree->nodes[
+                    rdt_compiled_tree_eval(&data->compiled->trees[i],
+                                           depth_image,
+                                           data->width, data->height,
+                                           pixel, depth_value)];
+                level = data->compiled->n_levels;
+            }
             while (node->label_pr_idx == 0)
             {
-                float value = sample_uv<FloatT>(depth_image,
-                                                data->width, data->height,
-                                                pixel, depth_value, node->uv);
+                if (level++ == data->max_depth && node->split_pr_idx)
+                {
+                    break;
+                }
 
-                /* NB: The nodes are arranged in breadth-first, left then
-                 * right child order with the root node at index zero.
-                 *
-                 * In this case if you have an index for any particular node
-                 * ('id' here) then 2 * id + 1 is the index for the left
-                 * child and 2 * id + 2 is the index for the right child...
+                float value = sample_uv_padded<FloatT>(depth_image,
+                                                       data->width,
+                                                       data->height,
+                                                       pixel, depth_value,
+                                                       node->uv);
+
+                /* NB: As with the compact format, the right child always
+                 * immediately follows the left child
                  */
-                id = (value < node->t) ? 2 * id + 1 : 2 * id + 2;
+                uint32_t id = (value < node->t) ?
+                    node->left_idx : node->left_idx + 1;
 
                 node = &tree->nodes[id];
             }
@@ -125,390 +509,2580 @@ infer_labels_thread(void* userdata)
             /* NB: node->label_pr_idx is a base-one index since index zero
              * is reserved to indicate that the node is not a leaf node
              */
-            float* pr_table =
-                &tree->label_pr_tables[(node->label_pr_idx - 1) * n_labels];
-            for (int n = 0; n < n_labels; ++n)
+            leaf_idx = (node->label_pr_idx ?
+                        node->label_pr_idx : node->split_pr_idx) - 1;
+        }
+
+        accumulate_leaf_table(data, tree, leaf_idx, out_pr_table, acc);
+
+        if (pixel_is_confident(data, out_pr_table, acc, i + 1))
+        {
+            n_evaluated = i + 1;
+            break;
+        }
+    }
+
+    end_pixel(data, out_pr_table, acc, n_evaluated);
+}
+
+/* Splits sample_uv_padded() in two so the depth samples can be prefetched
+ * between calculating their offsets and reading them.
+ */
+static inline int
+get_sample_offset(int width, int height, Int2D pixel, float depth,
+                  float u, float v)
+{
+    int x = clamp_sample_coord((int)(pixel[0] + u / depth), width);
+    int y = clamp_sample_coord((int)(pixel[1] + v / depth), height);
+
+    return y * padded_depth_image_stride(width) + x;
+}
+
+/* Walks up to INFER_MAX_INTERLEAVED_TREES trees for a single pixel in
+ * lockstep, one level per round.
+ *
+ * Each round first reads the current node of every unfinished tree and
+ * prefetches both its children and the depth samples it needs, and only
+ * then evaluates the split tests. This way the (otherwise serial) cache
+ * misses of independent trees overlap instead of each level of each tree
+ * waiting for the last.
+ */
+template<typename FloatT>
+static inline void
+infer_labels_pixel_interleaved(InferLabelsState* data, int x, int y,
+                               float* out_pr_table, int thread)
+{
+    FloatT* depth_image = (FloatT*)data->depth_image;
+    int n_labels = data->forest[0]->header.n_labels;
+    int width = data->width;
+    int height = data->height;
+    int off = y * padded_depth_image_stride(width) + x;
+
+    float depth_value = depth_to_float(depth_image[off]);
+    uint32_t* acc = data->accumulators ?
+        &data->accumulators[thread * INFER_BATCH_SIZE * n_labels] : NULL;
+
+    if (!begin_pixel(data, depth_value, out_pr_table, acc))
+    {
+        return;
+    }
+
+    /* When cascading, the first tree is evaluated on its own before
+     * interleaving the remaining trees
+     */
+    int group_size = data->cascade_confidence > 0.f ?
+        1 : INFER_MAX_INTERLEAVED_TREES;
+    int n_evaluated = data->n_trees;
+
+    Int2D pixel = { x, y };
+    for (int first = 0; first < data->n_trees; first += group_size,
+         group_size = INFER_MAX_INTERLEAVED_TREES)
+    {
+        RDTree** trees = &data->forest[first];
+        int n_trees = std::min(group_size, data->n_trees - first);
+
+        uint32_t ids[INFER_MAX_INTERLEAVED_TREES];
+        uint32_t leaf_idx[INFER_MAX_INTERLEAVED_TREES];
+
+        /* Indices of the trees that haven't reached a leaf yet, and the
+         * state of their current split for the evaluation phase
+         */
+        int active[INFER_MAX_INTERLEAVED_TREES];
+        uint32_t children[INFER_MAX_INTERLEAVED_TREES];
+        float thresholds[INFER_MAX_INTERLEAVED_TREES];
+        int u_offsets[INFER_MAX_INTERLEAVED_TREES];
+        int v_offsets[INFER_MAX_INTERLEAVED_TREES];
+
+        for (int i = 0; i < n_trees; ++i)
+        {
+            ids[i] = 0;
+            active[i] = i;
+        }
+
+        int n_active = n_trees;
+        for (int level = 0; n_active; ++level)
+        {
+            int n_splits = 0;
+            for (int a = 0; a < n_active; ++a)
+            {
+                int i = active[a];
+                RDTree* tree = trees[i];
+                UVPair uv;
+
+                if (tree->compact_nodes)
+                {
+                    RDTCompactNode* node = &tree->compact_nodes[ids[i]];
+                    if (node->idx & RDT_COMPACT_LEAF_BIT)
+                    {
+                        leaf_idx[i] = node->idx & ~RDT_COMPACT_LEAF_BIT;
+                        continue;
+                    }
+                    uv = unpack_compact_uv(node);
+                    thresholds[n_splits] = node->t;
+                    children[n_splits] = node->idx;
+                }
+                else
+                {
+                    Node* node = &tree->nodes[ids[i]];
+                    if (node->label_pr_idx)
+                    {
+                        leaf_idx[i] = node->label_pr_idx - 1;
+                        continue;
+                    }
+                    if (level == data->max_depth && node->split_pr_idx)
+                    {
+                        leaf_idx[i] = node->split_pr_idx - 1;
+                        continue;
+                    }
+                    uv = node->uv;
+                    thresholds[n_splits] = node->t;
+                    children[n_splits] = node->left_idx;
+                }
+
+                int u_off = get_sample_offset(width, height, pixel,
+                                              depth_value, uv[0], uv[1]);
+                int v_off = get_sample_offset(width, height, pixel,
+                                              depth_value, uv[2], uv[3]);
+                __builtin_prefetch(&depth_image[u_off]);
+                __builtin_prefetch(&depth_image[v_off]);
+
+                /* NB: for both node formats the right child immediately
+                 * follows the left child, though the pair may straddle a
+                 * cache line
+                 */
+                if (tree->compact_nodes)
+                {
+                    __builtin_prefetch(&tree->compact_nodes[children[n_splits]]);
+                    __builtin_prefetch(&tree->compact_nodes[children[n_splits] + 1]);
+                }
+                else
+                {
+                    __builtin_prefetch(&tree->nodes[children[n_splits]]);
+                    __builtin_prefetch(&tree->nodes[children[n_splits] + 1]);
+                }
+
+                u_offsets[n_splits] = u_off;
+                v_offsets[n_splits] = v_off;
+                active[n_splits++] = i;
+            }
+            n_active = n_splits;
+
+            for (int a = 0; a < n_active; ++a)
+            {
+                float value = depth_to_float(depth_image[u_offsets[a]]) -
+                    depth_to_float(depth_image[v_offsets[a]]);
+
+                ids[active[a]] = (value < thresholds[a]) ?
+                    children[a] : children[a] + 1;
+            }
+        }
+
+        /* NB: accumulating in tree order keeps the results identical to
+         * infer_labels_pixel()
+         */
+        for (int i = 0; i < n_trees; ++i)
+        {
+            accumulate_leaf_table(data, trees[i], leaf_idx[i],
+                                  out_pr_table, acc);
+
+            /* NB: checking after every tree (even though the rest of the
+             * group has already been walked) keeps cascaded results
+             * identical to infer_labels_pixel() too
+             */
+            if (pixel_is_confident(data, out_pr_table, acc, first + i + 1))
             {
-                out_pr_table[n] += pr_table[n];
+                n_evaluated = first + i + 1;
+                break;
             }
         }
 
-        for (int n = 0; n < n_labels; ++n)
+        if (n_evaluated < data->n_trees)
+        {
+            break;
+        }
+    }
+
+    end_pixel(data, out_pr_table, acc, n_evaluated);
+}
+
+/* NB: The batch helpers below are all internal to this file so GCC's
+ * warning that returning 256bit vectors without AVX enabled changes the ABI
+ * isn't relevant. (Vector arguments are passed by reference to also avoid
+ * a note about the ABI for passing 32 byte aligned parameters)
+ */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+#if defined(__AVX2__)
+#define INFER_BATCH_AVX2 1
+#else
+#define INFER_BATCH_AVX2 0
+#endif
+namespace batch_default {
+#include "infer_batch.h"
+}
+#undef INFER_BATCH_AVX2
+
+/* Unless the whole build already targets AVX2, the batched traversal is
+ * built a second time for AVX2 and chosen at runtime on CPUs that have it
+ */
+#if !defined(__AVX2__) && defined(__x86_64__) && \
+    defined(__GNUC__) && !defined(__clang__)
+#define INFER_BATCH_DISPATCH_AVX2
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#define INFER_BATCH_AVX2 1
+namespace batch_avx2 {
+#include "infer_batch.h"
+}
+#undef INFER_BATCH_AVX2
+#pragma GCC pop_options
+#endif
+
+template<typename FloatT>
+static inline void
+infer_labels_batch(InferLabelsState* data, int x0, int y, int n_pixels,
+                   int thread)
+{
+#ifdef INFER_BATCH_DISPATCH_AVX2
+    if (__builtin_cpu_supports("avx2"))
+    {
+        batch_avx2::infer_labels_batch<FloatT>(data, x0, y, n_pixels, thread);
+        return;
+    }
+#endif
+    batch_default::infer_labels_batch<FloatT>(data, x0, y, n_pixels, thread);
+}
+
+/* Legacy scheduling that interleaves individual pixels between threads.
+ *
+ * Neighbouring pixels end up being written by different threads, which
+ * means the threads contend for the same cache lines of the output
+ * probability tables.
+ */
+template<typename FloatT>
+static void
+infer_labels_stripe_cb(int stripe, int thread, void* userdata)
+{
+    InferLabelsState* data = (InferLabelsState*)userdata;
+
+    for (int off = stripe;
+         off < data->width * data->height;
+         off += data->n_stripes)
+    {
+        int x = off % data->width;
+        int y = off / data->width;
+        float* out_pr_table = get_pixel_pr_table(data, off, thread, 0);
+
+        if (data->traversal == INFER_TRAVERSAL_INTERLEAVED)
+        {
+            infer_labels_pixel_interleaved<FloatT>(data, x, y, out_pr_table,
+                                                   thread);
+        }
+        else
+        {
+            infer_labels_pixel<FloatT>(data, x, y, out_pr_table, thread);
+        }
+        store_pixel_pr_table<FloatT>(data, off, out_pr_table);
+    }
+}
+
+template<typename FloatT>
+static void
+infer_labels_tile_cb(int x0, int y0, int x1, int y1,
+                     int thread, void* userdata)
+{
+    InferLabelsState* data = (InferLabelsState*)userdata;
+
+    if (data->traversal == INFER_TRAVERSAL_BATCHED)
+    {
+        for (int y = y0; y < y1; y++)
+        {
+            for (int x = x0; x < x1; x += INFER_BATCH_SIZE)
+            {
+                infer_labels_batch<FloatT>(data, x, y,
+                                           std::min(INFER_BATCH_SIZE, x1 - x),
+                                           thread);
+            }
+        }
+        return;
+    }
+
+    if (data->traversal == INFER_TRAVERSAL_INTERLEAVED)
+    {
+        for (int y = y0; y < y1; y++)
+        {
+            for (int x = x0; x < x1; x++)
+            {
+                int off = y * data->width + x;
+                float* out_pr_table = get_pixel_pr_table(data, off, thread, 0);
+                infer_labels_pixel_interleaved<FloatT>(data, x, y,
+                                                       out_pr_table, thread);
+                store_pixel_pr_table<FloatT>(data, off, out_pr_table);
+            }
+        }
+        return;
+    }
+
+    for (int y = y0; y < y1; y++)
+    {
+        for (int x = x0; x < x1; x++)
+        {
+            int off = y * data->width + x;
+            float* out_pr_table = get_pixel_pr_table(data, off, thread, 0);
+            infer_labels_pixel<FloatT>(data, x, y, out_pr_table, thread);
+            store_pixel_pr_table<FloatT>(data, off, out_pr_table);
+        }
+    }
+}
+
+/* Checks whether the forest's leaf tables can be accumulated as integers
+ * and if so allocates the per-thread accumulators
+ */
+static void
+init_accumulators(InferLabelsState* state, int n_threads,
+                  std::vector<uint32_t>& accumulators)
+{
+    RDTree** forest = state->forest;
+
+    state->table_format = forest[0]->table_format;
+    state->table_scale = forest[0]->table_scale;
+    for (int i = 1; i < state->n_trees; ++i)
+    {
+        if (forest[i]->table_format != state->table_format ||
+            forest[i]->table_scale != state->table_scale)
+        {
+            state->table_format = RDT_TABLE_FORMAT_FLOAT;
+            break;
+        }
+    }
+
+    if (state->table_format != RDT_TABLE_FORMAT_FLOAT)
+    {
+        accumulators.resize(n_threads * INFER_BATCH_SIZE * state->n_labels);
+        state->accumulators = accumulators.data();
+    }
+}
+
+/* Allocates the per-thread scratch tables for infer_labels_top_k() */
+static void
+init_top_k_output(InferLabelsState* state, int top_k,
+                  InferLabelPr* top_k_output, std::vector<float>& scratch)
+{
+    state->top_k = top_k;
+    state->top_k_output = top_k_output;
+    scratch.resize(state->n_stripes * INFER_BATCH_SIZE * state->n_labels);
+    state->scratch = scratch.data();
+}
+
+static const RDTCompiledForest*
+find_compiled_forest(RDTree** forest, int n_trees)
+{
+#ifdef USE_RDT_COMPILED
+    if (rdt_compiled_forest.n_trees != n_trees)
+    {
+        return NULL;
+    }
+    for (int i = 0; i < n_trees; ++i)
+    {
+        if (!rdt_compiled_forest.trees[i].matches(forest[i]))
+        {
+            return NULL;
+        }
+    }
+    return &rdt_compiled_forest;
+#else
+    return NULL;
+#endif
+}
+
+static void
+set_max_depth(InferLabelsState* state, int max_depth)
+{
+    state->max_depth = max_depth > 0 ? max_depth : INT_MAX;
+
+    /* The generated code for compiled trees doesn't stop early */
+    if (state->compiled && state->max_depth <= state->compiled->n_levels)
+    {
+        state->compiled = NULL;
+    }
+}
+
+struct InferLabelsWorkspace {
+    /* The padded copy of the depth image, whose border is only written when
+     * it's (re)allocated for a different image size or sample type
+     */
+    void* padded;
+    int width;
+    int height;
+    size_t sample_size;
+};
+
+InferLabelsWorkspace*
+infer_labels_workspace_new(void)
+{
+    return (InferLabelsWorkspace*)xcalloc(1, sizeof(InferLabelsWorkspace));
+}
+
+void
+infer_labels_workspace_free(InferLabelsWorkspace* workspace)
+{
+    xfree(workspace->padded);
+    xfree(workspace);
+}
+
+/* Returns a padded copy of depth_image, see pad_depth_image(), kept in
+ * options->workspace if there is one or otherwise in 'scratch', whose
+ * buffer the caller must free
+ */
+template<typename FloatT>
+static FloatT*
+get_padded_depth_image(FloatT* depth_image, int width, int height,
+                       const InferLabelsOptions* options,
+                       InferLabelsWorkspace* scratch)
+{
+    InferLabelsWorkspace* workspace = options && options->workspace ?
+        options->workspace : scratch;
+    FloatT* padded = (FloatT*)workspace->padded;
+
+    if (workspace->width != width || workspace->height != height ||
+        workspace->sample_size != sizeof(FloatT))
+    {
+        xfree(padded);
+        padded = (FloatT*)xmalloc(padded_depth_image_size(width, height) *
+                                  sizeof(FloatT));
+        workspace->padded = (void*)padded;
+        workspace->width = width;
+        workspace->height = height;
+        workspace->sample_size = sizeof(FloatT);
+        return pad_depth_image(depth_image, width, height, padded);
+    }
+
+    copy_depth_image_to_padded(depth_image, width, height, padded);
+    return padded_depth_image_origin(padded, width);
+}
+
+/* Common to infer_labels() and infer_labels_top_k(), given a state with its
+ * forest, dimensions and output initialized
+ */
+template<typename FloatT>
+static void
+run_infer_labels(InferLabelsState* state, FloatT* depth_image,
+                 struct gm_thread_pool* pool,
+                 const InferLabelsOptions* options)
+{
+    int width = state->width;
+    int height = state->height;
+
+    InferLabelsOptions defaults = {};
+    if (!options)
+    {
+        options = &defaults;
+    }
+
+    InferLabelsWorkspace scratch = {};
+    state->depth_image = (void*)
+        get_padded_depth_image(depth_image, width, height, options, &scratch);
+    state->traversal = options->traversal;
+    state->cascade_confidence = options->cascade_confidence;
+    state->compiled = find_compiled_forest(state->forest, state->n_trees);
+    set_max_depth(state, options->max_depth);
+
+    int n_threads = state->n_stripes;
+
+    std::vector<uint32_t> accumulators;
+    init_accumulators(state, n_threads, accumulators);
+
+    /* NB: each pixel clears its own output table, so no thread touches the
+     * output of pixels that belong to another thread's tiles.
+     */
+    switch (options->schedule)
+    {
+    case INFER_SCHEDULE_STRIDED:
+        thread_pool_run(pool, n_threads,
+                        infer_labels_stripe_cb<FloatT>, state);
+        break;
+    case INFER_SCHEDULE_ROWS: {
+        /* By default aim for a few bands per thread so that work stealing
+         * has something to balance with
+         */
+        int band_height = options->tile_height;
+        if (band_height <= 0)
+        {
+            band_height = std::max(1, height / (n_threads * 4));
+        }
+        thread_pool_run_tiles(pool, width, height, 0, band_height,
+                              infer_labels_tile_cb<FloatT>, state);
+        break;
+    }
+    case INFER_SCHEDULE_TILES:
+    default:
+        thread_pool_run_tiles(pool, width, height,
+                              options->tile_width > 0 ?
+                              options->tile_width : INFER_DEFAULT_TILE_WIDTH,
+                              options->tile_height > 0 ?
+                              options->tile_height : INFER_DEFAULT_TILE_HEIGHT,
+                              infer_labels_tile_cb<FloatT>, state);
+        break;
+    }
+
+    xfree(scratch.padded);
+}
+
+static inline int
+get_argmax_label(const float* pr_table, int n_labels)
+{
+    int label = 0;
+    for (int n = 1; n < n_labels; ++n)
+    {
+        if (pr_table[n] > pr_table[label])
+        {
+            label = n;
+        }
+    }
+    return label;
+}
+
+/* Implements InferLabelsOptions::coarse_scale for infer_labels() by first
+ * evaluating a grid of every scale'th pixel, which gives exactly the labels
+ * of a downsampled image with u,v offsets scaled to match but without
+ * needing to resample the depth image.
+ *
+ * Every other pixel then takes the labels of its grid pixel unless the
+ * labels of the neighbouring grid pixels disagree (or the pixel isn't
+ * background/foreground like its grid pixel), in which case it's evaluated
+ * in full too.
+ */
+template<typename FloatT>
+static void
+infer_labels_coarse_to_fine(RDTree** forest, int n_trees, FloatT* depth_image,
+                            int width, int height, float* output_pr,
+                            struct gm_thread_pool* pool,
+                            const InferLabelsOptions* options)
+{
+    int n_labels = (int)forest[0]->header.n_labels;
+    int scale = options->coarse_scale;
+    int grid_width = (width + scale - 1) / scale;
+    int grid_height = (height + scale - 1) / scale;
+
+    InferLabelsOptions sparse_options = *options;
+    sparse_options.coarse_scale = 0;
+
+    std::vector<int> pixels;
+    pixels.reserve(grid_width * grid_height);
+    for (int y = 0; y < height; y += scale)
+    {
+        for (int x = 0; x < width; x += scale)
+        {
+            pixels.push_back(y * width + x);
+        }
+    }
+
+    /* Both passes sample the same padded copy of the depth image */
+    InferLabelsWorkspace scratch = {};
+    FloatT* padded = get_padded_depth_image(depth_image, width, height,
+                                            options, &scratch);
+
+    std::vector<float> pr_tables(pixels.size() * n_labels);
+    infer_labels_sparse_padded(forest, n_trees, padded, width, height,
+                               pixels.data(), (int)pixels.size(),
+                               pr_tables.data(), pool, &sparse_options);
+
+    std::vector<uint8_t> grid_labels(pixels.size());
+    for (int i = 0; i < (int)pixels.size(); ++i)
+    {
+        grid_labels[i] = get_argmax_label(&pr_tables[i * n_labels], n_labels);
+    }
+
+    // Fill in the pixels that can take their grid pixel's labels
+    std::vector<int> boundary;
+    for (int y = 0; y < height; ++y)
+    {
+        int gy = y / scale;
+        int gy0 = std::max(0, gy - 1);
+        int gy1 = std::min(grid_height - 1, gy + 1);
+
+        for (int x = 0; x < width; ++x)
+        {
+            int gx = x / scale;
+            int grid_idx = gy * grid_width + gx;
+            int label = grid_labels[grid_idx];
+            int off = y * width + x;
+
+            bool fg = depth_to_float(depth_image[off]) < HUGE_DEPTH;
+            bool grid_fg = depth_to_float(depth_image[pixels[grid_idx]]) <
+                HUGE_DEPTH;
+            bool reuse = (fg == grid_fg);
+
+            int gx0 = std::max(0, gx - 1);
+            int gx1 = std::min(grid_width - 1, gx + 1);
+            for (int ny = gy0; ny <= gy1 && reuse; ++ny)
+            {
+                for (int nx = gx0; nx <= gx1 && reuse; ++nx)
+                {
+                    reuse = grid_labels[ny * grid_width + nx] == label;
+                }
+            }
+
+            if (reuse || off == pixels[grid_idx])
+            {
+                memcpy(&output_pr[off * n_labels],
+                       &pr_tables[grid_idx * n_labels],
+                       n_labels * sizeof(float));
+            }
+            else
+            {
+                boundary.push_back(off);
+            }
+        }
+    }
+
+    pr_tables.resize(boundary.size() * n_labels);
+    infer_labels_sparse_padded(forest, n_trees, padded, width, height,
+                               boundary.data(), (int)boundary.size(),
+                               pr_tables.data(), pool, &sparse_options);
+    xfree(scratch.padded);
+    for (int i = 0; i < (int)boundary.size(); ++i)
+    {
+        memcpy(&output_pr[boundary[i] * n_labels],
+               &pr_tables[i * n_labels],
+               n_labels * sizeof(float));
+    }
+}
+
+template<typename FloatT>
+float*
+infer_labels(RDTree** forest, int n_trees, FloatT* depth_image,
+             int width, int height, float* out_labels,
+             struct gm_thread_pool* pool,
+             const InferLabelsOptions* options)
+{
+    int n_labels = (int)forest[0]->header.n_labels;
+    size_t output_size = width * height * n_labels * sizeof(float);
+    float* output_pr = out_labels ? out_labels : (float*)xmalloc(output_size);
+
+    if (options && options->coarse_scale > 1)
+    {
+        infer_labels_coarse_to_fine(forest, n_trees, depth_image,
+                                    width, height, output_pr, pool, options);
+        return output_pr;
+    }
+
+    InferLabelsState state = {};
+    state.forest = forest;
+    state.n_trees = n_trees;
+    state.width = width;
+    state.height = height;
+    state.n_labels = n_labels;
+    state.n_stripes = thread_pool_get_n_threads(pool);
+    state.output = output_pr;
+    run_infer_labels(&state, depth_image, pool, options);
+
+    return output_pr;
+}
+
+template float*
+infer_labels<half>(RDTree**, int, half*, int, int, float*,
+                   struct gm_thread_pool*, const InferLabelsOptions*);
+template float*
+infer_labels<float>(RDTree**, int, float*, int, int, float*,
+                    struct gm_thread_pool*, const InferLabelsOptions*);
+
+template<typename FloatT>
+InferLabelPr*
+infer_labels_top_k(RDTree** forest, int n_trees, FloatT* depth_image,
+                   int width, int height, int top_k, InferLabelPr* out_labels,
+                   struct gm_thread_pool* pool,
+                   const InferLabelsOptions* options)
+{
+    int n_labels = (int)forest[0]->header.n_labels;
+    top_k = std::max(1, std::min(top_k, std::min(n_labels, INFER_MAX_TOP_K)));
+    InferLabelPr* output = out_labels ? out_labels : (InferLabelPr*)
+        xmalloc(width * height * top_k * sizeof(InferLabelPr));
+
+    InferLabelsState state = {};
+    state.forest = forest;
+    state.n_trees = n_trees;
+    state.width = width;
+    state.height = height;
+    state.n_labels = n_labels;
+    state.n_stripes = thread_pool_get_n_threads(pool);
+    std::vector<float> scratch;
+    init_top_k_output(&state, top_k, output, scratch);
+    run_infer_labels(&state, depth_image, pool, options);
+
+    return output;
+}
+
+template InferLabelPr*
+infer_labels_top_k<half>(RDTree**, int, half*, int, int, int, InferLabelPr*,
+                         struct gm_thread_pool*, const InferLabelsOptions*);
+template InferLabelPr*
+infer_labels_top_k<float>(RDTree**, int, float*, int, int, int, InferLabelPr*,
+                          struct gm_thread_pool*, const InferLabelsOptions*);
+
+template<typename FloatT>
+static void
+infer_labels_sparse_cb(int chunk, int thread, void* userdata)
+{
+    InferLabelsState* data = (InferLabelsState*)userdata;
+    int start = chunk * INFER_SPARSE_CHUNK_SIZE;
+    int end = std::min(start + INFER_SPARSE_CHUNK_SIZE, data->n_pixels);
+
+    for (int i = start; i < end; i++)
+    {
+        int x = data->pixels[i] % data->width;
+        int y = data->pixels[i] / data->width;
+        float* out_pr_table = get_pixel_pr_table(data, i, thread, 0);
+
+        if (data->traversal == INFER_TRAVERSAL_INTERLEAVED)
+        {
+            infer_labels_pixel_interleaved<FloatT>(data, x, y, out_pr_table,
+                                                   thread);
+        }
+        else
+        {
+            infer_labels_pixel<FloatT>(data, x, y, out_pr_table, thread);
+        }
+        store_pixel_pr_table<FloatT>(data, i, out_pr_table);
+    }
+}
+
+/* Common to infer_labels_sparse() and infer_labels_sparse_top_k(), given
+ * a state with its forest, dimensions, pixels and output initialized and a
+ * padded copy of the depth image (see get_padded_depth_image())
+ */
+template<typename FloatT>
+static void
+run_infer_labels_sparse(InferLabelsState* state, FloatT* padded_depth_image,
+                        struct gm_thread_pool* pool,
+                        const InferLabelsOptions* options)
+{
+    int n_pixels = state->n_pixels;
+
+    InferLabelsOptions defaults = {};
+    if (!options)
+    {
+        options = &defaults;
+    }
+
+    state->depth_image = (void*)padded_depth_image;
+    state->traversal = options->traversal;
+    state->cascade_confidence = options->cascade_confidence;
+    state->compiled = find_compiled_forest(state->forest, state->n_trees);
+    set_max_depth(state, options->max_depth);
+
+    std::vector<uint32_t> accumulators;
+    init_accumulators(state, state->n_stripes, accumulators);
+
+    /* NB: the pixels have no spatial ordering we can rely on so the
+     * schedule and tile size options don't apply and we simply split the
+     * list into fixed size chunks.
+     */
+    int n_chunks = (n_pixels + INFER_SPARSE_CHUNK_SIZE - 1) /
+        INFER_SPARSE_CHUNK_SIZE;
+    thread_pool_run(pool, n_chunks, infer_labels_sparse_cb<FloatT>, state);
+}
+
+/* infer_labels_sparse() for an already padded depth image, so that
+ * infer_labels_coarse_to_fine() only has to pad the image once
+ */
+template<typename FloatT>
+static void
+infer_labels_sparse_padded(RDTree** forest, int n_trees,
+                           FloatT* padded_depth_image, int width, int height,
+                           const int* pixels, int n_pixels, float* output_pr,
+                           struct gm_thread_pool* pool,
+                           const InferLabelsOptions* options)
+{
+    int n_labels = (int)forest[0]->header.n_labels;
+
+    InferLabelsState state = {};
+    state.forest = forest;
+    state.n_trees = n_trees;
+    state.width = width;
+    state.height = height;
+    state.n_labels = n_labels;
+    state.n_stripes = thread_pool_get_n_threads(pool);
+    state.output = output_pr;
+    state.pixels = pixels;
+    state.n_pixels = n_pixels;
+    run_infer_labels_sparse(&state, padded_depth_image, pool, options);
+}
+
+template<typename FloatT>
+float*
+infer_labels_sparse(RDTree** forest, int n_trees, FloatT* depth_image,
+                    int width, int height,
+                    const int* pixels, int n_pixels,
+                    float* out_labels,
+                    struct gm_thread_pool* pool,
+                    const InferLabelsOptions* options)
+{
+    int n_labels = (int)forest[0]->header.n_labels;
+    size_t output_size = n_pixels * n_labels * sizeof(float);
+    float* output_pr = out_labels ? out_labels : (float*)xmalloc(output_size);
+
+    InferLabelsWorkspace scratch = {};
+    FloatT* padded = get_padded_depth_image(depth_image, width, height,
+                                            options, &scratch);
+    infer_labels_sparse_padded(forest, n_trees, padded, width, height,
+                               pixels, n_pixels, output_pr, pool, options);
+    xfree(scratch.padded);
+
+    return output_pr;
+}
+
+template float*
+infer_labels_sparse<half>(RDTree**, int, half*, int, int, const int*, int,
+                          float*, struct gm_thread_pool*,
+                          const InferLabelsOptions*);
+template float*
+infer_labels_sparse<float>(RDTree**, int, float*, int, int, const int*, int,
+                           float*, struct gm_thread_pool*,
+                           const InferLabelsOptions*);
+
+template<typename FloatT>
+InferLabelPr*
+infer_labels_sparse_top_k(RDTree** forest, int n_trees, FloatT* depth_image,
+                          int width, int height,
+                          const int* pixels, int n_pixels, int top_k,
+                          InferLabelPr* out_labels,
+                          struct gm_thread_pool* pool,
+                          const InferLabelsOptions* options)
+{
+    int n_labels = (int)forest[0]->header.n_labels;
+    top_k = std::max(1, std::min(top_k, std::min(n_labels, INFER_MAX_TOP_K)));
+    InferLabelPr* output = out_labels ? out_labels : (InferLabelPr*)
+        xmalloc(n_pixels * top_k * sizeof(InferLabelPr));
+
+    InferLabelsState state = {};
+    state.forest = forest;
+    state.n_trees = n_trees;
+    state.width = width;
+    state.height = height;
+    state.n_labels = n_labels;
+    state.n_stripes = thread_pool_get_n_threads(pool);
+    state.pixels = pixels;
+    state.n_pixels = n_pixels;
+    std::vector<float> scratch;
+    init_top_k_output(&state, top_k, output, scratch);
+
+    InferLabelsWorkspace padding_scratch = {};
+    FloatT* padded = get_padded_depth_image(depth_image, width, height,
+                                            options, &padding_scratch);
+    run_infer_labels_sparse(&state, padded, pool, options);
+    xfree(padding_scratch.padded);
+
+    return output;
+}
+
+template InferLabelPr*
+infer_labels_sparse_top_k<half>(RDTree**, int, half*, int, int,
+                                const int*, int, int, InferLabelPr*,
+                                struct gm_thread_pool*,
+                                const InferLabelsOptions*);
+template InferLabelPr*
+infer_labels_sparse_top_k<float>(RDTree**, int, float*, int, int,
+                                 const int*, int, int, InferLabelPr*,
+                                 struct gm_thread_pool*,
+                                 const InferLabelsOptions*);
+
+void
+expand_top_k_labels(const InferLabelPr* labels, int n_pixels, int top_k,
+                    int n_labels, float* out_pr_tables)
+{
+    memset(out_pr_tables, 0, (size_t)n_pixels * n_labels * sizeof(float));
+    for (int i = 0; i < n_pixels; ++i)
+    {
+        float* pr_table = &out_pr_tables[i * n_labels];
+        for (int k = 0; k < top_k; ++k)
+        {
+            const InferLabelPr& entry = labels[i * top_k + k];
+            pr_table[entry.label] += entry.pr / 255.f;
+        }
+    }
+}
+
+float
+get_max_uv_offset(RDTree** forest, int n_trees)
+{
+    float max_offset = 0.f;
+    for (int i = 0; i < n_trees; ++i)
+    {
+        RDTree* tree = forest[i];
+        for (uint32_t n = 0; n < tree->n_nodes; ++n)
+        {
+            UVPair uv;
+            if (tree->compact_nodes)
+            {
+                if (tree->compact_nodes[n].idx & RDT_COMPACT_LEAF_BIT)
+                {
+                    continue;
+                }
+                uv = unpack_compact_uv(&tree->compact_nodes[n]);
+            }
+            else
+            {
+                if (tree->nodes[n].label_pr_idx)
+                {
+                    continue;
+                }
+                uv = tree->nodes[n].uv;
+            }
+            for (int c = 0; c < 4; ++c)
+            {
+                max_offset = std::max(max_offset, fabsf(uv[c]));
+            }
+        }
+    }
+    return max_offset;
+}
+
+struct gm_joint_map*
+gm_joint_map_new(struct gm_logger* log, JSON_Value* joint_map, char** err)
+{
+    JSON_Array* entries = json_array(joint_map);
+    if (!entries)
+    {
+        gm_throw(log, err, "Expected joint map to be an array of joints");
+        return NULL;
+    }
+
+    int n_joints = json_array_get_count(entries);
+    if (n_joints > GM_JOINT_MAP_MAX_JOINTS)
+    {
+        gm_throw(log, err, "Joint map has %d joints, but at most %d are "
+                 "supported", n_joints, GM_JOINT_MAP_MAX_JOINTS);
+        return NULL;
+    }
+
+    int n_mapped = 0;
+    for (int j = 0; j < n_joints; j++)
+    {
+        JSON_Object* entry = json_array_get_object(entries, j);
+        JSON_Array* labels = json_object_get_array(entry, "labels");
+        if (!labels)
+        {
+            gm_throw(log, err, "Joint %d of joint map has no labels", j);
+            return NULL;
+        }
+        n_mapped += json_array_get_count(labels);
+    }
+
+    struct gm_joint_map* map =
+        (struct gm_joint_map*)xcalloc(1, sizeof(struct gm_joint_map));
+    map->n_joints = n_joints;
+    map->label_offsets = (int*)xmalloc((n_joints + 1) * sizeof(int));
+    map->labels = (uint8_t*)xmalloc(std::max(n_mapped, 1));
+
+    int n = 0;
+    for (int j = 0; j < n_joints; j++)
+    {
+        JSON_Object* entry = json_array_get_object(entries, j);
+        JSON_Array* labels = json_object_get_array(entry, "labels");
+
+        map->label_offsets[j] = n;
+        for (int l = 0; l < (int)json_array_get_count(labels); l++)
+        {
+            int label = (int)json_array_get_number(labels, l);
+            if (label < 0 || label > UINT8_MAX)
+            {
+                gm_throw(log, err, "Joint %d of joint map has out of range "
+                         "label %d", j, label);
+                gm_joint_map_free(map);
+                return NULL;
+            }
+            map->labels[n++] = label;
+            map->n_labels = std::max(map->n_labels, label + 1);
+        }
+    }
+    map->label_offsets[n_joints] = n;
+
+    map->label_joints =
+        (uint64_t*)xcalloc(std::max(map->n_labels, 1), sizeof(uint64_t));
+    for (int j = 0; j < n_joints; j++)
+    {
+        for (n = map->label_offsets[j]; n < map->label_offsets[j + 1]; n++)
+        {
+            map->label_joints[map->labels[n]] |= (uint64_t)1 << j;
+        }
+    }
+
+    return map;
+}
+
+void
+gm_joint_map_free(struct gm_joint_map* map)
+{
+    if (!map)
+    {
+        return;
+    }
+
+    xfree(map->label_offsets);
+    xfree(map->labels);
+    xfree(map->label_joints);
+    xfree(map);
+}
+
+/* Label probability lookups, so the joint inference code can read either
+ * full probability tables or the output of infer_labels_top_k()
+ */
+typedef struct {
+    const float* pr_table;
+    int n_labels;
+
+    inline float
+    get(int pixel, int label) const
+    {
+        return pr_table[pixel * n_labels + label];
+    }
+
+    /* Sums the probabilities of each joint's labels into out_prs */
+    inline void
+    get_joints(int pixel, const struct gm_joint_map* map, float* out_prs) const
+    {
+        const float* prs = &pr_table[pixel * n_labels];
+        for (int j = 0; j < map->n_joints; j++)
+        {
+            float pr = 0.f;
+            for (int n = map->label_offsets[j];
+                 n < map->label_offsets[j + 1]; n++)
+            {
+                pr += prs[map->labels[n]];
+            }
+            out_prs[j] = pr;
+        }
+    }
+} DenseLabelPrs;
+
+typedef struct {
+    const InferLabelPr* labels;
+    int top_k;
+
+    inline float
+    get(int pixel, int label) const
+    {
+        const InferLabelPr* entries = &labels[pixel * top_k];
+        for (int k = 0; k < top_k; ++k)
+        {
+            if (entries[k].label == label)
+            {
+                return entries[k].pr * (1.f / 255.f);
+            }
+        }
+        return 0.f;
+    }
+
+    /* Only the top_k labels can contribute, so these are scattered to
+     * their joints instead of searching for every label of every joint
+     */
+    inline void
+    get_joints(int pixel, const struct gm_joint_map* map, float* out_prs) const
+    {
+        for (int j = 0; j < map->n_joints; j++)
+        {
+            out_prs[j] = 0.f;
+        }
+
+        const InferLabelPr* entries = &labels[pixel * top_k];
+        for (int k = 0; k < top_k; ++k)
+        {
+            if (entries[k].label >= map->n_labels)
+            {
+                continue;
+            }
+            float pr = entries[k].pr * (1.f / 255.f);
+            for (uint64_t joints = map->label_joints[entries[k].label];
+                 joints; joints &= joints - 1)
+            {
+                out_prs[__builtin_ctzll(joints)] += pr;
+            }
+        }
+    }
+} TopKLabelPrs;
+
+/* Reads the tables written by infer_labels_sparse() or
+ * infer_labels_sparse_top_k() through a map from each pixel to its table.
+ * Pixels without a table (-1) weren't evaluated and have no probability
+ * for any label. Their probabilities read as -1 so that they never pass a
+ * joint's threshold, since their weights aren't written.
+ */
+template<typename TablesT>
+struct SparseLabelPrs {
+    TablesT tables;
+    const int* rows;
+
+    inline float
+    get(int pixel, int label) const
+    {
+        int row = rows[pixel];
+        return row < 0 ? -1.f : tables.get(row, label);
+    }
+
+    inline void
+    get_joints(int pixel, const struct gm_joint_map* map, float* out_prs) const
+    {
+        int row = rows[pixel];
+        if (row < 0)
+        {
+            for (int j = 0; j < map->n_joints; j++)
+            {
+                out_prs[j] = 0.f;
+            }
+            return;
+        }
+        tables.get_joints(row, map, out_prs);
+    }
+};
+
+typedef struct {
+    void* depth_image;
+    const void* label_prs;
+    int width;
+    const struct gm_joint_map* map;
+    float* weights;
+} PixelWeightsState;
+
+template<typename FloatT, typename LabelPrsT>
+static void
+calc_pixel_weights_cb(int x0, int y0, int x1, int y1,
+                      int thread, void* userdata)
+{
+    PixelWeightsState* data = (PixelWeightsState*)userdata;
+    FloatT* depth_image = (FloatT*)data->depth_image;
+    const LabelPrsT& label_prs = *(const LabelPrsT*)data->label_prs;
+    const struct gm_joint_map* map = data->map;
+    int n_joints = map->n_joints;
+
+    float depth_row[x1 - x0];
+
+    for (int y = y0; y < y1; y++)
+    {
+        int pixel_idx = y * data->width + x0;
+        int weight_idx = pixel_idx * n_joints;
+        depth_to_float_n(&depth_image[pixel_idx], depth_row, x1 - x0);
+        for (int x = x0; x < x1; x++, pixel_idx++)
+        {
+            float depth = depth_row[x - x0];
+            float depth_2 = depth * depth;
+
+            float* weights = &data->weights[weight_idx];
+            label_prs.get_joints(pixel_idx, map, weights);
+            for (int j = 0; j < n_joints; j++)
+            {
+                weights[j] *= depth_2;
+            }
+            weight_idx += n_joints;
+        }
+    }
+}
+
+template<typename FloatT, typename LabelPrsT>
+static float*
+calc_pixel_weights_common(FloatT* depth_image, const LabelPrsT& label_prs,
+                          int width, int height,
+                          const struct gm_joint_map* joint_map,
+                          float* weights, struct gm_thread_pool* pool)
+{
+    int n_joints = joint_map->n_joints;
+
+    if (!weights)
+    {
+        weights = (float*)xmalloc(width * height * n_joints * sizeof(float));
+    }
+
+    PixelWeightsState state = {
+        (void*)depth_image, (const void*)&label_prs, width, joint_map, weights
+    };
+
+    // Full-width bands of a few rows keep each thread writing to a
+    // contiguous range of the weights buffer
+    thread_pool_run_tiles(pool, width, height, 0, 4,
+                          calc_pixel_weights_cb<FloatT, LabelPrsT>, &state);
+
+    return weights;
+}
+
+template<typename FloatT>
+float*
+calc_pixel_weights(FloatT* depth_image, float* pr_table,
+                   int width, int height, int n_labels,
+                   const struct gm_joint_map* joint_map, float* weights,
+                   struct gm_thread_pool* pool)
+{
+    DenseLabelPrs label_prs = { pr_table, n_labels };
+    return calc_pixel_weights_common(depth_image, label_prs, width, height,
+                                     joint_map, weights, pool);
+}
+
+template<typename FloatT>
+float*
+calc_pixel_weights(FloatT* depth_image, const InferLabelPr* labels, int top_k,
+                   int width, int height,
+                   const struct gm_joint_map* joint_map, float* weights,
+                   struct gm_thread_pool* pool)
+{
+    TopKLabelPrs label_prs = { labels, top_k };
+    return calc_pixel_weights_common(depth_image, label_prs, width, height,
+                                     joint_map, weights, pool);
+}
+
+template float*
+calc_pixel_weights<half>(half*, float*, int, int, int,
+                         const struct gm_joint_map*, float*,
+                         struct gm_thread_pool*);
+template float*
+calc_pixel_weights<float>(float*, float*, int, int, int,
+                          const struct gm_joint_map*, float*,
+                          struct gm_thread_pool*);
+template float*
+calc_pixel_weights<half>(half*, const InferLabelPr*, int, int, int,
+                         const struct gm_joint_map*, float*,
+                         struct gm_thread_pool*);
+template float*
+calc_pixel_weights<float>(float*, const InferLabelPr*, int, int, int,
+                          const struct gm_joint_map*, float*,
+                          struct gm_thread_pool*);
+
+typedef struct {
+    void* depth_image;
+    const void* label_prs;
+    const int* pixels;
+    int n_pixels;
+    const struct gm_joint_map* map;
+    float* weights;
+} SparsePixelWeightsState;
+
+/* Pixels per work item of calc_pixel_weights_sparse() */
+#define SPARSE_WEIGHTS_CHUNK 256
+
+template<typename FloatT, typename LabelPrsT>
+static void
+calc_sparse_pixel_weights_cb(int chunk, int thread, void* userdata)
+{
+    SparsePixelWeightsState* data = (SparsePixelWeightsState*)userdata;
+    FloatT* depth_image = (FloatT*)data->depth_image;
+    const LabelPrsT& label_prs = *(const LabelPrsT*)data->label_prs;
+    const struct gm_joint_map* map = data->map;
+    int n_joints = map->n_joints;
+
+    int begin = chunk * SPARSE_WEIGHTS_CHUNK;
+    int end = std::min(begin + SPARSE_WEIGHTS_CHUNK, data->n_pixels);
+    for (int i = begin; i < end; i++)
+    {
+        int pixel = data->pixels[i];
+        float depth = depth_to_float(depth_image[pixel]);
+        float depth_2 = depth * depth;
+
+        float* weights = &data->weights[pixel * n_joints];
+        label_prs.get_joints(i, map, weights);
+        for (int j = 0; j < n_joints; j++)
+        {
+            weights[j] *= depth_2;
+        }
+    }
+}
+
+template<typename FloatT, typename LabelPrsT>
+static float*
+calc_pixel_weights_sparse_common(FloatT* depth_image,
+                                 const LabelPrsT& label_prs,
+                                 const int* pixels, int n_pixels,
+                                 int width, int height,
+                                 const struct gm_joint_map* joint_map,
+                                 float* weights,
+                                 struct gm_thread_pool* pool)
+{
+    int n_joints = joint_map->n_joints;
+
+    if (!weights)
+    {
+        weights = (float*)xmalloc(width * height * n_joints * sizeof(float));
+    }
+
+    SparsePixelWeightsState state = {
+        (void*)depth_image, (const void*)&label_prs, pixels, n_pixels,
+        joint_map, weights
+    };
+    int n_chunks = (n_pixels + SPARSE_WEIGHTS_CHUNK - 1) /
+        SPARSE_WEIGHTS_CHUNK;
+    thread_pool_run(pool, n_chunks,
+                    calc_sparse_pixel_weights_cb<FloatT, LabelPrsT>, &state);
+
+    return weights;
+}
+
+template<typename FloatT>
+float*
+calc_pixel_weights_sparse(FloatT* depth_image, float* pr_table,
+                          const int* pixels, int n_pixels,
+                          int width, int height, int n_labels,
+                          const struct gm_joint_map* joint_map,
+                          float* weights, struct gm_thread_pool* pool)
+{
+    DenseLabelPrs label_prs = { pr_table, n_labels };
+    return calc_pixel_weights_sparse_common(depth_image, label_prs,
+                                            pixels, n_pixels, width, height,
+                                            joint_map, weights, pool);
+}
+
+template<typename FloatT>
+float*
+calc_pixel_weights_sparse(FloatT* depth_image, const InferLabelPr* labels,
+                          int top_k, const int* pixels, int n_pixels,
+                          int width, int height,
+                          const struct gm_joint_map* joint_map,
+                          float* weights, struct gm_thread_pool* pool)
+{
+    TopKLabelPrs label_prs = { labels, top_k };
+    return calc_pixel_weights_sparse_common(depth_image, label_prs,
+                                            pixels, n_pixels, width, height,
+                                            joint_map, weights, pool);
+}
+
+template float*
+calc_pixel_weights_sparse<half>(half*, float*, const int*, int, int, int, int,
+                                const struct gm_joint_map*, float*,
+                                struct gm_thread_pool*);
+template float*
+calc_pixel_weights_sparse<float>(float*, float*, const int*, int, int, int,
+                                 int, const struct gm_joint_map*, float*,
+                                 struct gm_thread_pool*);
+template float*
+calc_pixel_weights_sparse<half>(half*, const InferLabelPr*, int, const int*,
+                                int, int, int, const struct gm_joint_map*,
+                                float*, struct gm_thread_pool*);
+template float*
+calc_pixel_weights_sparse<float>(float*, const InferLabelPr*, int,
+                                 const int*, int, int, int,
+                                 const struct gm_joint_map*, float*,
+                                 struct gm_thread_pool*);
+
+template<typename FloatT>
+float*
+infer_labels_with_weights(RDTree** forest, int n_trees, FloatT* depth_image,
+                          int width, int height,
+                          const struct gm_joint_map* joint_map,
+                          float* out_weights, float* out_labels,
+                          struct gm_thread_pool* pool,
+                          const InferLabelsOptions* options)
+{
+    int n_labels = (int)forest[0]->header.n_labels;
+    int n_joints = joint_map->n_joints;
+
+    float* weights = out_weights ? out_weights : (float*)
+        xmalloc(width * height * n_joints * sizeof(float));
+
+    /* Coarse to fine inference copies tables between pixels after they've
+     * been evaluated, so the weights are calculated in a second pass
+     */
+    if (options && options->coarse_scale > 1)
+    {
+        float* pr_table = infer_labels(forest, n_trees, depth_image,
+                                       width, height, out_labels,
+                                       pool, options);
+        calc_pixel_weights(depth_image, pr_table, width, height, n_labels,
+                           joint_map, weights, pool);
+        if (!out_labels)
+        {
+            xfree(pr_table);
+        }
+        return weights;
+    }
+
+    InferLabelsState state = {};
+    state.forest = forest;
+    state.n_trees = n_trees;
+    state.width = width;
+    state.height = height;
+    state.n_labels = n_labels;
+    state.n_stripes = thread_pool_get_n_threads(pool);
+    state.output = out_labels;
+    state.joint_map = joint_map;
+    state.weights = weights;
+
+    std::vector<float> scratch;
+    if (!out_labels)
+    {
+        scratch.resize(state.n_stripes * INFER_BATCH_SIZE * n_labels);
+        state.scratch = scratch.data();
+    }
+
+    run_infer_labels(&state, depth_image, pool, options);
+
+    return weights;
+}
+
+template float*
+infer_labels_with_weights<half>(RDTree**, int, half*, int, int,
+                                const struct gm_joint_map*,
+                                float*, float*, struct gm_thread_pool*,
+                                const InferLabelsOptions*);
+template float*
+infer_labels_with_weights<float>(RDTree**, int, float*, int, int,
+                                 const struct gm_joint_map*,
+                                 float*, float*, struct gm_thread_pool*,
+                                 const InferLabelsOptions*);
+
+typedef vector(float, MEAN_SHIFT_BATCH_SIZE) ShiftFloat;
+typedef vector(int32_t, MEAN_SHIFT_BATCH_SIZE) ShiftInt;
+
+/* The points of a single joint binned into a uniform grid, with cells no
+ * smaller than the mean-shift cutoff distance so the neighbours of any point
+ * are found within the 3x3x3 cells around it. The points are copied in cell
+ * order as separate x/y/z/weight arrays so that each row of cells can be
+ * evaluated as one contiguous run of vectors.
+ */
+typedef struct {
+    float* x;
+    float* y;
+    float* z;
+    float* w;
+    int* cell;
+    int* cell_start;
+
+    float origin[3];
+    float inv_cell_size;
+    int dims[3];
+    float cutoff2;
+} MeanShiftGrid;
+
+static void
+init_mean_shift_grid(MeanShiftGrid* grid, int max_points)
+{
+    // Padded so that the last batch of a run can always be loaded whole
+    int len = max_points + MEAN_SHIFT_BATCH_SIZE;
+    grid->x = (float*)xcalloc(len, sizeof(float));
+    grid->y = (float*)xcalloc(len, sizeof(float));
+    grid->z = (float*)xcalloc(len, sizeof(float));
+    grid->w = (float*)xcalloc(len, sizeof(float));
+    grid->cell = (int*)xmalloc(std::max(max_points, 1) * sizeof(int));
+    grid->cell_start = (int*)xmalloc((MEAN_SHIFT_MAX_CELLS + 1) * sizeof(int));
+}
+
+static void
+free_mean_shift_grid(MeanShiftGrid* grid)
+{
+    xfree(grid->x);
+    xfree(grid->y);
+    xfree(grid->z);
+    xfree(grid->w);
+    xfree(grid->cell);
+    xfree(grid->cell_start);
+}
+
+static inline int
+mean_shift_grid_coord(MeanShiftGrid* grid, const float* point, int axis)
+{
+    int c = (int)((point[axis] - grid->origin[axis]) * grid->inv_cell_size);
+    return std::min(std::max(c, 0), grid->dims[axis] - 1);
+}
+
+static void
+build_mean_shift_grid(MeanShiftGrid* grid, const float* points,
+                      const float* weights, int n_points, float cutoff)
+{
+    float min[3] = { points[0], points[1], points[2] };
+    float max[3] = { points[0], points[1], points[2] };
+    for (int p = 1; p < n_points; p++)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            min[a] = std::min(min[a], points[p * 3 + a]);
+            max[a] = std::max(max[a], points[p * 3 + a]);
+        }
+    }
+
+    float cell_size = cutoff;
+    for (;;)
+    {
+        int n_cells = 1;
+        for (int a = 0; a < 3; a++)
+        {
+            grid->dims[a] = (int)((max[a] - min[a]) / cell_size) + 1;
+            n_cells *= grid->dims[a];
+        }
+        if (n_cells <= MEAN_SHIFT_MAX_CELLS)
+        {
+            break;
+        }
+        cell_size *= 2.f;
+    }
+
+    memcpy(grid->origin, min, sizeof(min));
+    grid->inv_cell_size = 1.f / cell_size;
+    grid->cutoff2 = cutoff * cutoff;
+
+    // Counting sort of the points by cell
+    int n_cells = grid->dims[0] * grid->dims[1] * grid->dims[2];
+    memset(grid->cell_start, 0, (n_cells + 1) * sizeof(int));
+    for (int p = 0; p < n_points; p++)
+    {
+        const float* point = &points[p * 3];
+        int cell = (mean_shift_grid_coord(grid, point, 2) * grid->dims[1] +
+                    mean_shift_grid_coord(grid, point, 1)) * grid->dims[0] +
+                   mean_shift_grid_coord(grid, point, 0);
+        grid->cell[p] = cell;
+        grid->cell_start[cell + 1]++;
+    }
+    for (int c = 0; c < n_cells; c++)
+    {
+        grid->cell_start[c + 1] += grid->cell_start[c];
+    }
+    for (int p = 0; p < n_points; p++)
+    {
+        int i = grid->cell_start[grid->cell[p]]++;
+        grid->x[i] = points[p * 3];
+        grid->y[i] = points[p * 3 + 1];
+        grid->z[i] = points[p * 3 + 2];
+        grid->w[i] = weights[p];
+    }
+    // Each start was advanced to the next cell's start while filling
+    memmove(grid->cell_start + 1, grid->cell_start, n_cells * sizeof(int));
+    grid->cell_start[0] = 0;
+}
+
+/* expf() for x in [-87, 0], following the Cephes range reduction with a
+ * relative error around 1e-7 */
+static inline ShiftFloat
+shift_expf(ShiftFloat x)
+{
+    ShiftFloat fn = x * (float)M_LOG2E + 0.5f;
+    ShiftInt n = __builtin_convertvector(fn, ShiftInt);
+    n += (ShiftInt)(__builtin_convertvector(n, ShiftFloat) > fn);
+    ShiftFloat nf = __builtin_convertvector(n, ShiftFloat);
+
+    ShiftFloat r = x - nf * 0.693359375f + nf * 2.12194440e-4f;
+    ShiftFloat p = r * 1.9875691500e-4f + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * r * r + r + 1.f;
+
+    return p * (ShiftFloat)((n + 127) << 23);
+}
+
+/* Calculates the next mean-shift position of x, returning false if no point
+ * within the cutoff distance has any weight */
+static bool
+mean_shift_point(MeanShiftGrid* grid, const float* x, float bandwidth,
+                 float* out)
+{
+    float scale = -0.5f / (bandwidth * bandwidth);
+    ShiftFloat numerator[3] = { 0, };
+    ShiftFloat denominator = { 0, };
+    ShiftInt lanes;
+    for (int l = 0; l < MEAN_SHIFT_BATCH_SIZE; ++l)
+    {
+        lanes[l] = l;
+    }
+
+    int c[3];
+    for (int a = 0; a < 3; a++)
+    {
+        c[a] = mean_shift_grid_coord(grid, x, a);
+    }
+    int x0 = std::max(c[0] - 1, 0);
+    int x1 = std::min(c[0] + 1, grid->dims[0] - 1);
+
+    for (int cz = std::max(c[2] - 1, 0);
+         cz <= std::min(c[2] + 1, grid->dims[2] - 1); cz++)
+    {
+        for (int cy = std::max(c[1] - 1, 0);
+             cy <= std::min(c[1] + 1, grid->dims[1] - 1); cy++)
+        {
+            // Neighbouring cells along x are contiguous
+            int row = (cz * grid->dims[1] + cy) * grid->dims[0];
+            int begin = grid->cell_start[row + x0];
+            int end = grid->cell_start[row + x1 + 1];
+
+            for (int i = begin; i < end; i += MEAN_SHIFT_BATCH_SIZE)
+            {
+                ShiftFloat px, py, pz, pw;
+                memcpy(&px, &grid->x[i], sizeof(px));
+                memcpy(&py, &grid->y[i], sizeof(py));
+                memcpy(&pz, &grid->z[i], sizeof(pz));
+                memcpy(&pw, &grid->w[i], sizeof(pw));
+
+                ShiftFloat dx = px - x[0];
+                ShiftFloat dy = py - x[1];
+                ShiftFloat dz = pz - x[2];
+                ShiftFloat d2 = dx * dx + dy * dy + dz * dz;
+
+                ShiftInt in_range = (d2 < grid->cutoff2) & (lanes < end - i);
+                d2 = in_range ? d2 : 0.f;
+
+                // The gaussian's normalisation cancels out in the mean
+                ShiftFloat weight = pw * shift_expf(d2 * scale);
+                weight = (ShiftFloat)((ShiftInt)weight & in_range);
+
+                numerator[0] += weight * px;
+                numerator[1] += weight * py;
+                numerator[2] += weight * pz;
+                denominator += weight;
+            }
+        }
+    }
+
+    float sum[4] = { 0, };
+    for (int l = 0; l < MEAN_SHIFT_BATCH_SIZE; ++l)
+    {
+        sum[0] += numerator[0][l];
+        sum[1] += numerator[1][l];
+        sum[2] += numerator[2][l];
+        sum[3] += denominator[l];
+    }
+    if (!(sum[3] > 0.f))
+    {
+        return false;
+    }
+
+    out[0] = sum[0] / sum[3];
+    out[1] = sum[1] / sum[3];
+    out[2] = sum[2] / sum[3];
+    return true;
+}
+
+/* A run of pixels on one scan-line for infer_joints_fast() */
+typedef struct {
+    int y;
+    int left;
+    int right;
+    int parent;
+
+    // Running sums over the segment, then over the cluster for roots
+    int n_points;
+    int x_sum;
+    int y_sum;
+    float confidence;
+} ScanlineSegment;
+
+struct InferJointsWorkspace {
+    int width;
+    int height;
+    int n_joints;
+
+    float* weights;
+
+    /* Scratch for infer_joints(), allocated on first use: the candidate
+     * points and their densities for each joint, and a mean-shift grid for
+     * each thread
+     */
+    float* points;
+    float* density;
+    int* n_points;
+    MeanShiftGrid* grids;
+    int n_grids;
+
+    /* Per-thread scratch for infer_joints_fast() and infer_joints_seeded(),
+     * allocated on first use and reused for each joint: the scan-line
+     * segments, and the position and weight of each point near a seed
+     */
+    ScanlineSegment* segments;
+    int n_segment_threads;
+    float* seed_points;
+    int n_seed_point_threads;
+
+    InferredJoints result;
+};
+
+InferJointsWorkspace*
+infer_joints_workspace_new(int width, int height, int n_joints,
+                           int max_candidates)
+{
+    InferJointsWorkspace* workspace = (InferJointsWorkspace*)
+        xcalloc(1, sizeof(InferJointsWorkspace));
+
+    if (max_candidates <= 0)
+    {
+        max_candidates = INFER_DEFAULT_MAX_JOINT_CANDIDATES;
+    }
+
+    workspace->width = width;
+    workspace->height = height;
+    workspace->n_joints = n_joints;
+    workspace->weights = (float*)
+        xmalloc(width * height * n_joints * sizeof(float));
+
+    InferredJoints* result = &workspace->result;
+    result->n_joints = n_joints;
+    result->max_candidates = max_candidates;
+    result->n_candidates = (int*)xcalloc(n_joints, sizeof(int));
+    result->candidates = (Joint*)
+        xcalloc(n_joints * max_candidates, sizeof(Joint));
+
+    return workspace;
+}
+
+void
+infer_joints_workspace_free(InferJointsWorkspace* workspace)
+{
+    for (int i = 0; i < workspace->n_grids; i++)
+    {
+        free_mean_shift_grid(&workspace->grids[i]);
+    }
+    xfree(workspace->grids);
+    if (workspace->points)
+    {
+        xfree(workspace->n_points);
+        xfree(workspace->density);
+        xfree(workspace->points);
+    }
+    xfree(workspace->segments);
+    xfree(workspace->seed_points);
+    xfree(workspace->result.candidates);
+    xfree(workspace->result.n_candidates);
+    xfree(workspace->weights);
+    xfree(workspace);
+}
+
+float*
+infer_joints_workspace_get_weights(InferJointsWorkspace* workspace)
+{
+    return workspace->weights;
+}
+
+static InferredJoints*
+begin_inferred_joints(InferJointsWorkspace* workspace, int width, int height,
+                      int n_joints)
+{
+    /* The workspace has to be created for the same size of image and joint
+     * map as it's used with
+     */
+    assert(workspace->width == width &&
+           workspace->height == height &&
+           workspace->n_joints == n_joints);
+
+    InferredJoints* result = &workspace->result;
+    memset(result->n_candidates, 0, n_joints * sizeof(int));
+    return result;
+}
+
+/* Makes sure there is a mean-shift grid for each of n_threads threads */
+static void
+reserve_mean_shift_grids(InferJointsWorkspace* workspace, int n_threads,
+                         int max_points)
+{
+    if (workspace->n_grids >= n_threads)
+    {
+        return;
+    }
+
+    workspace->grids = (MeanShiftGrid*)
+        xrealloc(workspace->grids, n_threads * sizeof(MeanShiftGrid));
+    for (int i = workspace->n_grids; i < n_threads; i++)
+    {
+        init_mean_shift_grid(&workspace->grids[i], max_points);
+    }
+    workspace->n_grids = n_threads;
+}
+
+/* Inserts a candidate for the given joint, keeping candidates ordered most
+ * confident first (and in the order they were added for equal confidence)
+ * and dropping the least confident once the joint is full.
+ */
+static void
+add_joint_candidate(InferredJoints* result, int joint, const Joint& candidate)
+{
+    Joint* candidates = &result->candidates[joint * result->max_candidates];
+    int n = result->n_candidates[joint];
+
+    if (n == result->max_candidates)
+    {
+        if (candidate.confidence <= candidates[n - 1].confidence)
+        {
+            return;
+        }
+        n--;
+    }
+    else
+    {
+        result->n_candidates[joint]++;
+    }
+
+    for (; n > 0 && candidate.confidence > candidates[n - 1].confidence; n--)
+    {
+        candidates[n] = candidates[n - 1];
+    }
+    candidates[n] = candidate;
+}
+
+/* Union-find lookup of the cluster that a scan-line segment belongs to, with
+ * path halving */
+static inline int
+find_segment_root(ScanlineSegment* segments, int i)
+{
+    while (segments[i].parent != i)
+    {
+        segments[i].parent = segments[segments[i].parent].parent;
+        i = segments[i].parent;
+    }
+    return i;
+}
+
+/* Whether any of a joint's labels pass its threshold at the given pixel */
+template<typename LabelPrsT>
+static inline bool
+joint_threshold_passed(const LabelPrsT& label_prs, int pixel,
+                       const uint8_t* joint_labels, int labels_begin,
+                       int labels_end, float threshold)
+{
+    for (int n = labels_begin; n < labels_end; ++n)
+    {
+        if (label_prs.get(pixel, (int)joint_labels[n]) >= threshold)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Grows an allocation of per-thread scratch, of size bytes per thread, if
+ * it was made for fewer than n_threads threads
+ */
+static void*
+reserve_thread_scratch(void* scratch, int* n_allocated, int n_threads,
+                       size_t size)
+{
+    if (*n_allocated < n_threads)
+    {
+        xfree(scratch);
+        scratch = xmalloc(n_threads * size);
+        *n_allocated = n_threads;
+    }
+    return scratch;
+}
+
+/* Segments are separated by at least one pixel */
+static inline int
+max_scanline_segments(int width, int height)
+{
+    return ((width + 1) / 2) * height;
+}
+
+/* infer_joints_fast() for the j'th joint, adding a candidate for each
+ * connected cluster of pixels that pass the joint's threshold
+ */
+template<typename FloatT, typename LabelPrsT>
+static void
+find_joint_clusters(FloatT* depth_image, const LabelPrsT& label_prs,
+                    float* weights, int width, int height,
+                    const struct gm_joint_map* joint_map, int j,
+                    float tan_half_hfov, float tan_half_vfov,
+                    JIParam* params, ScanlineSegment* segments,
+                    InferredJoints* result)
+{
+    int n_joints = joint_map->n_joints;
+    float half_width = width / 2.f;
+    float half_height = height / 2.f;
+
+    // Plan: Scan along each scan-line and record segments of pixels that
+    //       pass the threshold. Each segment is unioned with the segments it
+    //       touches on the previous scan-line, so after a single sweep the
+    //       union-find roots identify the connected clusters. The segments'
+    //       pixel sums are then accumulated into their roots, from which we
+    //       can calculate the confidence and projected center-point of each
+    //       cluster.
+    //
+    //       TODO: Let this take a distance so that clusters don't need to be
+    //             perfectly contiguous?
+    //       TODO: Figure out a way to divide clusters that are only loosely
+    //             connected?
+    int n_segments = 0;
+    int prev_row = 0;
+    const uint8_t* joint_labels = joint_map->labels;
+    int labels_begin = joint_map->label_offsets[j];
+    int labels_end = joint_map->label_offsets[j + 1];
+    float threshold = params[j].threshold;
+
+    for (int y = 0; y < height; ++y)
+    {
+        int row = n_segments;
+        int idx = y * width;
+        ScanlineSegment* segment = NULL;
+
+        for (int x = 0; x < width; ++x)
+        {
+            if (!joint_threshold_passed(label_prs, idx + x, joint_labels,
+                                        labels_begin, labels_end, threshold))
+            {
+                segment = NULL;
+                continue;
+            }
+
+            if (!segment)
+            {
+                segment = &segments[n_segments];
+                *segment = { y, x, x, n_segments, 0, 0, 0, 0.f };
+                n_segments++;
+            }
+
+            segment->right = x;
+            segment->n_points++;
+            segment->x_sum += x;
+            segment->y_sum += y;
+            segment->confidence += weights[(idx + x) * n_joints + j];
+        }
+
+        // Union each new segment with those it touches on the previous
+        // scan-line. Both rows are sorted, so one merge-like pass is
+        // enough.
+        for (int c = row, p = prev_row; c < n_segments && p < row;)
+        {
+            if (segments[p].right < segments[c].left)
+            {
+                ++p;
+                continue;
+            }
+            if (segments[c].right < segments[p].left)
+            {
+                ++c;
+                continue;
+            }
+
+            // Link the older root under the newer one, so that each
+            // root is the last segment of its cluster
+            int a = find_segment_root(segments, p);
+            int b = find_segment_root(segments, c);
+            if (a != b)
+            {
+                segments[std::min(a, b)].parent = std::max(a, b);
+            }
+
+            if (segments[p].right < segments[c].right)
+            {
+                ++p;
+            }
+            else
+            {
+                ++c;
+            }
+        }
+
+        prev_row = row;
+    }
+
+    // Accumulate the segment sums into their roots
+    for (int i = 0; i < n_segments; ++i)
+    {
+        int root = find_segment_root(segments, i);
+        if (root != i)
+        {
+            segments[root].n_points += segments[i].n_points;
+            segments[root].x_sum += segments[i].x_sum;
+            segments[root].y_sum += segments[i].y_sum;
+            segments[root].confidence += segments[i].confidence;
+        }
+    }
+
+    // Clusters are added newest first, like the scan-line lists that
+    // this replaced, so ties in confidence are ordered as before
+    for (int i = n_segments - 1; i >= 0; --i)
+    {
+        ScanlineSegment& cluster = segments[i];
+        if (cluster.parent != i)
         {
-            out_pr_table[n] /= (float)data->n_trees;
+            continue;
         }
-    }
 
-    if (data->n_threads > 1)
-    {
-        pthread_exit(NULL);
-    }
+        Joint joint;
+        joint.confidence = cluster.confidence;
 
-    return NULL;
+        // Calculate the center-point of the cluster
+        int x = (int)roundf(cluster.x_sum / (float)cluster.n_points);
+        int y = (int)roundf(cluster.y_sum / (float)cluster.n_points);
+
+        // Reproject and offset point
+        float s = (x / half_width) - 1.f;
+        float t = -((y / half_height) - 1.f);
+        float depth = depth_to_float(depth_image[y * width + x]);
+        joint.x = (tan_half_hfov * depth) * s;
+        joint.y = (tan_half_vfov * depth) * t;
+        joint.z = depth + params[j].offset;
+
+        add_joint_candidate(result, j, joint);
+    }
 }
 
-template<typename FloatT>
-float*
-infer_labels(RDTree** forest, int n_trees, FloatT* depth_image,
-             int width, int height, float* out_labels,
-             bool use_threads)
+/* Mean-shift for the j'th joint starting from its seed, over only the points
+ * within seed_radius of the seed. Adds a single candidate and returns true,
+ * or returns false if the seed has lost support, with no points above the
+ * joint's threshold within reach of the kernel.
+ */
+template<typename FloatT, typename LabelPrsT>
+static bool
+find_seeded_joint(FloatT* depth_image, const LabelPrsT& label_prs,
+                  float* weights, int width, int height,
+                  const struct gm_joint_map* joint_map, int j,
+                  float tan_half_hfov, float tan_half_vfov,
+                  JIParam* params, const Joint& seed, float seed_radius,
+                  float* points, InferredJoints* result)
 {
-    int n_labels = (int)forest[0]->header.n_labels;
-    size_t output_size = width * height * n_labels * sizeof(float);
-    float* output_pr = out_labels ? out_labels : (float*)xmalloc(output_size);
-    memset(output_pr, 0, output_size);
+    int n_joints = joint_map->n_joints;
+    const uint8_t* joint_labels = joint_map->labels;
+    int labels_begin = joint_map->label_offsets[j];
+    int labels_end = joint_map->label_offsets[j + 1];
+    float threshold = params[j].threshold;
+    float bandwidth = params[j].bandwidth;
+    float offset = params[j].offset;
+
+    float half_width = width / 2.f;
+    float half_height = height / 2.f;
 
-    int n_threads = std::thread::hardware_concurrency();
-    if (!use_threads || n_threads <= 1)
+    // Seeds are offset like the joints they came from, so undo that to get
+    // back to the surface the joint was found on
+    float seed_x = seed.x;
+    float seed_y = seed.y;
+    float seed_z = seed.z - offset;
+    float near_z = seed_z - seed_radius;
+    if (!(near_z > 0.f))
     {
-        InferThreadData data = { 1, 1, forest, n_trees, (void*)depth_image, width, height, output_pr};
-        infer_labels_thread<FloatT>((void*)(&data));
+        return false;
     }
-    else
+
+    // Bound the pixels that can be within seed_radius of the seed. A point
+    // (dx, dy, dz) from the seed projects |dx - s * tan_half_hfov * dz| /
+    // (tan_half_hfov * z) from the seed's s coordinate (and likewise for t),
+    // which is largest for the nearest points.
+    float seed_s = seed_x / (tan_half_hfov * seed_z);
+    float seed_t = seed_y / (tan_half_vfov * seed_z);
+    float reach_s = seed_radius * (1.f + fabsf(seed_s) * tan_half_hfov) /
+        (tan_half_hfov * near_z);
+    float reach_t = seed_radius * (1.f + fabsf(seed_t) * tan_half_vfov) /
+        (tan_half_vfov * near_z);
+
+    float fx0 = std::max((seed_s - reach_s + 1.f) * half_width, 0.f);
+    float fx1 = std::min((seed_s + reach_s + 1.f) * half_width,
+                         width - 1.f);
+    float fy0 = std::max((1.f - seed_t - reach_t) * half_height, 0.f);
+    float fy1 = std::min((1.f - seed_t + reach_t) * half_height,
+                         height - 1.f);
+    if (!(fx0 <= fx1 && fy0 <= fy1))
     {
-        pthread_t threads[n_threads];
-        InferThreadData data[n_threads];
+        return false;
+    }
+    int x0 = (int)fx0, x1 = (int)ceilf(fx1);
+    int y0 = (int)fy0, y1 = (int)ceilf(fy1);
 
-        for (int i = 0; i < n_threads; ++i)
+    // Gather the points near the seed that pass the threshold
+    float radius2 = seed_radius * seed_radius;
+    int n_points = 0;
+    for (int y = y0; y <= y1; y++)
+    {
+        float t = -((y / half_height) - 1.f);
+        for (int x = x0; x <= x1; x++)
         {
-            data[i] = { i, n_threads, forest, n_trees,
-                (void*)depth_image, width, height, output_pr };
-            if (pthread_create(&threads[i], NULL, infer_labels_thread<FloatT>,
-                               (void*)(&data[i])) != 0)
+            int idx = y * width + x;
+            float depth = depth_to_float(depth_image[idx]);
+            if (!std::isnormal(depth) || depth >= HUGE_DEPTH)
             {
-                fprintf(stderr,
-                        "Error creating thread, results will be incomplete.\n");
-                n_threads = i;
-                break;
+                continue;
             }
-        }
 
-        for (int i = 0; i < n_threads; ++i)
-        {
-            if (pthread_join(threads[i], NULL) != 0)
+            if (!joint_threshold_passed(label_prs, idx, joint_labels,
+                                        labels_begin, labels_end, threshold))
             {
-                fprintf(stderr, "Error joining thread, trying to continue...\n");
+                continue;
             }
-        }
-    }
 
-    return output_pr;
-}
+            float s = (x / half_width) - 1.f;
+            float* point = &points[n_points * 4];
+            point[0] = (tan_half_hfov * depth) * s;
+            point[1] = (tan_half_vfov * depth) * t;
+            point[2] = depth;
+
+            float dx = point[0] - seed_x;
+            float dy = point[1] - seed_y;
+            float dz = point[2] - seed_z;
+            if (dx * dx + dy * dy + dz * dz > radius2)
+            {
+                continue;
+            }
 
-template float*
-infer_labels<half>(RDTree**, int, half*, int, int, float*,
-                   bool);
-template float*
-infer_labels<float>(RDTree**, int, float*, int, int, float*,
-                    bool);
+            point[3] = weights[idx * n_joints + j];
+            n_points++;
+        }
+    }
 
-/* We don't want to be making lots of function calls or dereferencing
- * lots of pointers while accessing the joint map within inner loops
- * so this lets us temporarily unpack the label mappings into a
- * tight array of JointMapEntries.
- */
-static inline void
-unpack_joint_map(JSON_Value *joint_map, JointMapEntry *map, int n_joints)
-{
-    for (int i = 0; i < n_joints; i++)
+    // Shift from the seed to the nearest mode
+    float scale = -0.5f / (bandwidth * bandwidth);
+    float cutoff = bandwidth * MEAN_SHIFT_CUTOFF;
+    float cutoff2 = cutoff * cutoff;
+    float mode[3] = { seed_x, seed_y, seed_z };
+    for (int s = 0; s < N_SHIFTS; s++)
     {
-        JSON_Object *entry = json_array_get_object(json_array(joint_map), i);
-        JSON_Array *labels = json_object_get_array(entry, "labels");
-        int n_labels = json_array_get_count(labels);
+        float sum[4] = { 0, };
+        for (int p = 0; p < n_points; p++)
+        {
+            const float* point = &points[p * 4];
+            float dx = point[0] - mode[0];
+            float dy = point[1] - mode[1];
+            float dz = point[2] - mode[2];
+            float d2 = dx * dx + dy * dy + dz * dz;
+            if (d2 >= cutoff2)
+            {
+                continue;
+            }
+
+            float weight = point[3] * expf(d2 * scale);
+            sum[0] += weight * point[0];
+            sum[1] += weight * point[1];
+            sum[2] += weight * point[2];
+            sum[3] += weight;
+        }
+        if (!(sum[3] > 0.f))
+        {
+            return false;
+        }
 
-        if (n_labels > (int)ARRAY_LEN(map[0].labels))
+        float next[3] = { sum[0] / sum[3], sum[1] / sum[3], sum[2] / sum[3] };
+        bool moved = fabs(next[0] - mode[0]) >= SHIFT_THRESHOLD ||
+                     fabs(next[1] - mode[1]) >= SHIFT_THRESHOLD ||
+                     fabs(next[2] - mode[2]) >= SHIFT_THRESHOLD;
+        mode[0] = next[0];
+        mode[1] = next[1];
+        mode[2] = next[2];
+        if (!moved)
         {
-            fprintf(stderr, "Didn't expect joint to be mapped to > 2 labels\n");
-            exit(1);
+            break;
         }
+    }
 
-        map[i].n_labels = n_labels;
-        for (int n = 0; n < n_labels; n++)
+    // Like infer_joints(), the confidence is the density of the mode's
+    // points, here taken as those within the kernel's reach
+    Joint joint = { mode[0], mode[1], mode[2] + offset, 0.f };
+    for (int p = 0; p < n_points; p++)
+    {
+        const float* point = &points[p * 4];
+        float dx = point[0] - mode[0];
+        float dy = point[1] - mode[1];
+        float dz = point[2] - mode[2];
+        if (dx * dx + dy * dy + dz * dz < cutoff2)
         {
-            map[i].labels[n] = json_array_get_number(labels, n);
+            joint.confidence += point[3];
         }
     }
+    if (!(joint.confidence > 0.f))
+    {
+        return false;
+    }
+
+    add_joint_candidate(result, j, joint);
+    return true;
 }
 
-template<typename FloatT>
-float*
-calc_pixel_weights(FloatT* depth_image, float* pr_table,
-                   int width, int height, int n_labels,
-                   JSON_Value* joint_map, float* weights)
+typedef struct {
+    void* depth_image;
+    const void* label_prs;
+    float* weights;
+    int width;
+    int height;
+    const struct gm_joint_map* joint_map;
+    float tan_half_hfov;
+    float tan_half_vfov;
+    JIParam* params;
+    const Joint* seeds;
+    float seed_radius;
+    InferJointsWorkspace* workspace;
+} FindJointsState;
+
+/* Finds the j'th joint for infer_joints_fast() or infer_joints_seeded().
+ * Only the joint's own candidates are written, so joints can be found
+ * concurrently with the same results in any order.
+ */
+template<typename FloatT, typename LabelPrsT>
+static void
+find_joint_cb(int j, int thread, void* userdata)
 {
-    int n_joints = json_array_get_count(json_array(joint_map));
-
-    JointMapEntry map[n_joints];
-    unpack_joint_map(joint_map, map, n_joints);
+    FindJointsState* data = (FindJointsState*)userdata;
+    FloatT* depth_image = (FloatT*)data->depth_image;
+    const LabelPrsT& label_prs = *(const LabelPrsT*)data->label_prs;
+    InferJointsWorkspace* workspace = data->workspace;
+    int width = data->width;
+    int height = data->height;
 
-    if (!weights)
+    if (data->seeds && data->seeds[j].confidence > 0.f)
     {
-        weights = (float*)xmalloc(width * height * n_joints * sizeof(float));
+        float* points = &workspace->seed_points[thread * width * height * 4];
+        if (find_seeded_joint(depth_image, label_prs, data->weights,
+                              width, height, data->joint_map, j,
+                              data->tan_half_hfov, data->tan_half_vfov,
+                              data->params, data->seeds[j],
+                              data->seed_radius, points, &workspace->result))
+        {
+            return;
+        }
     }
 
-    for (int y = 0, weight_idx = 0, pixel_idx = 0; y < height; y++)
-    {
-        for (int x = 0; x < width; x++, pixel_idx++)
-        {
-            float depth = (float)depth_image[pixel_idx];
-            float depth_2 = depth * depth;
+    ScanlineSegment* segments = &workspace->segments[
+        thread * max_scanline_segments(width, height)];
+    find_joint_clusters(depth_image, label_prs, data->weights, width, height,
+                        data->joint_map, j,
+                        data->tan_half_hfov, data->tan_half_vfov,
+                        data->params, segments, &workspace->result);
+}
 
-            for (int j = 0; j < n_joints; j++, weight_idx++)
-            {
-                float pr = 0.f;
-                for (int n = 0; n < map[j].n_labels; n++)
-                {
-                    int label = (int)map[j].labels[n];
-                    pr += pr_table[(pixel_idx * n_labels) + label];
-                }
-                weights[weight_idx] = pr * depth_2;
-            }
-        }
+template<typename FloatT, typename LabelPrsT>
+static const InferredJoints*
+infer_joints_seeded_common(FloatT* depth_image, const LabelPrsT& label_prs,
+                           float* weights, int width, int height,
+                           const struct gm_joint_map* joint_map,
+                           float vfov, JIParam* params,
+                           const Joint* seeds, float seed_radius,
+                           InferJointsWorkspace* workspace,
+                           struct gm_thread_pool* pool)
+{
+    int n_joints = joint_map->n_joints;
+
+    InferredJoints* result = begin_inferred_joints(workspace, width, height,
+                                                   n_joints);
+
+    int n_threads = thread_pool_get_n_threads(pool);
+    workspace->segments = (ScanlineSegment*)
+        reserve_thread_scratch(workspace->segments,
+                               &workspace->n_segment_threads, n_threads,
+                               max_scanline_segments(width, height) *
+                               sizeof(ScanlineSegment));
+    if (seeds)
+    {
+        workspace->seed_points = (float*)
+            reserve_thread_scratch(workspace->seed_points,
+                                   &workspace->n_seed_point_threads,
+                                   n_threads,
+                                   width * height * 4 * sizeof(float));
     }
 
-    return weights;
+    // Variables for reprojection of 2d point + depth
+    float half_width = width / 2.f;
+    float half_height = height / 2.f;
+    float aspect = half_width / half_height;
+
+    float vfov_rad = vfov * M_PI / 180.f;
+    float tan_half_vfov = tanf(vfov_rad / 2.f);
+    float tan_half_hfov = tan_half_vfov * aspect;
+    //float hfov = atanf(tan_half_hfov) * 2.f;
+
+    FindJointsState state = {
+        (void*)depth_image, (const void*)&label_prs, weights, width, height,
+        joint_map, tan_half_hfov, tan_half_vfov, params, seeds, seed_radius,
+        workspace
+    };
+    thread_pool_run(pool, n_joints, find_joint_cb<FloatT, LabelPrsT>, &state);
+
+    return result;
 }
 
-template float*
-calc_pixel_weights<half>(half*, float*, int, int, int,
-                         JSON_Value*, float*);
-template float*
-calc_pixel_weights<float>(float*, float*, int, int, int,
-                          JSON_Value*, float*);
+template<typename FloatT>
+const InferredJoints*
+infer_joints_seeded(FloatT* depth_image, float* pr_table, float* weights,
+                    int width, int height, int n_labels,
+                    const struct gm_joint_map* joint_map,
+                    float vfov, JIParam* params,
+                    const Joint* seeds, float seed_radius,
+                    InferJointsWorkspace* workspace,
+                    struct gm_thread_pool* pool)
+{
+    DenseLabelPrs label_prs = { pr_table, n_labels };
+    return infer_joints_seeded_common(depth_image, label_prs, weights,
+                                      width, height, joint_map, vfov, params,
+                                      seeds, seed_radius, workspace, pool);
+}
+
+template<typename FloatT>
+const InferredJoints*
+infer_joints_seeded(FloatT* depth_image, const InferLabelPr* labels, int top_k,
+                    float* weights, int width, int height,
+                    const struct gm_joint_map* joint_map,
+                    float vfov, JIParam* params,
+                    const Joint* seeds, float seed_radius,
+                    InferJointsWorkspace* workspace,
+                    struct gm_thread_pool* pool)
+{
+    TopKLabelPrs label_prs = { labels, top_k };
+    return infer_joints_seeded_common(depth_image, label_prs, weights,
+                                      width, height, joint_map, vfov, params,
+                                      seeds, seed_radius, workspace, pool);
+}
+
+template const InferredJoints*
+infer_joints_seeded<half>(half*, float*, float*, int, int, int,
+                          const struct gm_joint_map*, float, JIParam*,
+                          const Joint*, float, InferJointsWorkspace*,
+                          struct gm_thread_pool*);
+
+template const InferredJoints*
+infer_joints_seeded<float>(float*, float*, float*, int, int, int,
+                           const struct gm_joint_map*, float, JIParam*,
+                           const Joint*, float, InferJointsWorkspace*,
+                           struct gm_thread_pool*);
+
+template const InferredJoints*
+infer_joints_seeded<half>(half*, const InferLabelPr*, int, float*, int, int,
+                          const struct gm_joint_map*, float, JIParam*,
+                          const Joint*, float, InferJointsWorkspace*,
+                          struct gm_thread_pool*);
+
+template const InferredJoints*
+infer_joints_seeded<float>(float*, const InferLabelPr*, int, float*, int,
+                           int, const struct gm_joint_map*, float, JIParam*,
+                           const Joint*, float, InferJointsWorkspace*,
+                           struct gm_thread_pool*);
 
-static int
-compare_joints(LList* a, LList* b, void* userdata)
+template<typename FloatT>
+const InferredJoints*
+infer_joints_seeded(FloatT* depth_image, float* pr_table,
+                    const int* pixel_rows, float* weights,
+                    int width, int height, int n_labels,
+                    const struct gm_joint_map* joint_map,
+                    float vfov, JIParam* params,
+                    const Joint* seeds, float seed_radius,
+                    InferJointsWorkspace* workspace,
+                    struct gm_thread_pool* pool)
+{
+    SparseLabelPrs<DenseLabelPrs> label_prs = {
+        { pr_table, n_labels }, pixel_rows
+    };
+    return infer_joints_seeded_common(depth_image, label_prs, weights,
+                                      width, height, joint_map, vfov, params,
+                                      seeds, seed_radius, workspace, pool);
+}
+
+template<typename FloatT>
+const InferredJoints*
+infer_joints_seeded(FloatT* depth_image, const InferLabelPr* labels, int top_k,
+                    const int* pixel_rows, float* weights,
+                    int width, int height,
+                    const struct gm_joint_map* joint_map,
+                    float vfov, JIParam* params,
+                    const Joint* seeds, float seed_radius,
+                    InferJointsWorkspace* workspace,
+                    struct gm_thread_pool* pool)
 {
-    Joint* ja = (Joint*)a->data;
-    Joint* jb = (Joint*)b->data;
-    return ja->confidence - jb->confidence;
+    SparseLabelPrs<TopKLabelPrs> label_prs = {
+        { labels, top_k }, pixel_rows
+    };
+    return infer_joints_seeded_common(depth_image, label_prs, weights,
+                                      width, height, joint_map, vfov, params,
+                                      seeds, seed_radius, workspace, pool);
 }
 
+template const InferredJoints*
+infer_joints_seeded<half>(half*, float*, const int*, float*, int, int, int,
+                          const struct gm_joint_map*, float, JIParam*,
+                          const Joint*, float, InferJointsWorkspace*,
+                          struct gm_thread_pool*);
+
+template const InferredJoints*
+infer_joints_seeded<float>(float*, float*, const int*, float*, int, int, int,
+                           const struct gm_joint_map*, float, JIParam*,
+                           const Joint*, float, InferJointsWorkspace*,
+                           struct gm_thread_pool*);
+
+template const InferredJoints*
+infer_joints_seeded<half>(half*, const InferLabelPr*, int, const int*, float*,
+                          int, int, const struct gm_joint_map*, float,
+                          JIParam*, const Joint*, float,
+                          InferJointsWorkspace*, struct gm_thread_pool*);
+
+template const InferredJoints*
+infer_joints_seeded<float>(float*, const InferLabelPr*, int, const int*,
+                           float*, int, int, const struct gm_joint_map*,
+                           float, JIParam*, const Joint*, float,
+                           InferJointsWorkspace*, struct gm_thread_pool*);
+
 template<typename FloatT>
-InferredJoints*
+const InferredJoints*
 infer_joints_fast(FloatT* depth_image, float* pr_table, float* weights,
                   int width, int height, int n_labels,
-                  JSON_Value* joint_map, float vfov, JIParam* params)
-{
-    int n_joints = json_array_get_count(json_array(joint_map));
-    JointMapEntry map[n_joints];
-    unpack_joint_map(joint_map, map, n_joints);
-
-    // Plan: For each scan-line, scan along and record clusters on 1 dimension.
-    //       For each scanline segment, check to see if it intersects with any
-    //       segment on neighbouring scanlines, then join the lists together.
-    //       Finally, we should have a list of lists of clusters, which we
-    //       can then calculate confidence for, then when we have the highest
-    //       confidence for each label, we can project the points and calculate
-    //       the center-point.
-    //
-    //       TODO: Let this take a distance so that clusters don't need to be
-    //             perfectly contiguous?
-    //       TODO: Figure out a way to divide clusters that are only loosely
-    //             connected?
-    typedef struct {
-        int y;
-        int left;
-        int right;
-    } ScanlineSegment;
-
-    typedef std::forward_list<ScanlineSegment> Cluster;
-    typedef std::move_iterator<typename Cluster::iterator> ClusterMoveIterator;
+                  const struct gm_joint_map* joint_map,
+                  float vfov, JIParam* params,
+                  InferJointsWorkspace* workspace,
+                  struct gm_thread_pool* pool)
+{
+    DenseLabelPrs label_prs = { pr_table, n_labels };
+    return infer_joints_seeded_common(depth_image, label_prs, weights,
+                                      width, height, joint_map, vfov, params,
+                                      (const Joint*)NULL, 0.f, workspace,
+                                      pool);
+}
 
-    typename std::list<Cluster> clusters[n_joints];
+template<typename FloatT>
+const InferredJoints*
+infer_joints_fast(FloatT* depth_image, const InferLabelPr* labels, int top_k,
+                  float* weights, int width, int height,
+                  const struct gm_joint_map* joint_map,
+                  float vfov, JIParam* params,
+                  InferJointsWorkspace* workspace,
+                  struct gm_thread_pool* pool)
+{
+    TopKLabelPrs label_prs = { labels, top_k };
+    return infer_joints_seeded_common(depth_image, label_prs, weights,
+                                      width, height, joint_map, vfov, params,
+                                      (const Joint*)NULL, 0.f, workspace,
+                                      pool);
+}
 
-    // Collect clusters across scanlines
-    ScanlineSegment* last_segment[n_joints];
-    for (int y = 0; y < height; ++y)
-    {
-        memset(last_segment, 0, sizeof(ScanlineSegment*) * n_joints);
-        for (int x = 0; x < width; ++x)
-        {
-            for (int j = 0; j < n_joints; ++j)
-            {
-                bool threshold_passed = false;
-                for (int n = 0; n < map[j].n_labels; ++n)
-                {
-                    int label = (int)map[j].labels[n];
-                    float label_pr = pr_table[(y * width + x) * n_labels + label];
-                    if (label_pr >= params[j].threshold)
-                    {
-                        threshold_passed = true;
-                        break;
-                    }
-                }
+template const InferredJoints*
+infer_joints_fast<half>(half*, float*, float*, int, int, int,
+                        const struct gm_joint_map*, float, JIParam*,
+                        InferJointsWorkspace*, struct gm_thread_pool*);
 
-                if (threshold_passed)
-                {
-                    // Check to see if this pixel can be added to an existing
-                    // cluster.
-                    if (last_segment[j])
-                    {
-                        last_segment[j]->right = x;
-                    }
-                    else
-                    {
-                        clusters[j].emplace_front();
-                        clusters[j].front().push_front({ y, x, x });
-                        last_segment[j] = &clusters[j].front().front();
-                    }
-                }
-                else
-                {
-                    last_segment[j] = nullptr;
-                }
-            }
-        }
-    }
+template const InferredJoints*
+infer_joints_fast<float>(float*, float*, float*, int, int, int,
+                         const struct gm_joint_map*, float, JIParam*,
+                         InferJointsWorkspace*, struct gm_thread_pool*);
 
-    // Now iteratively connect the scanline clusters
-    for (int j = 0; j < n_joints; j++)
-    {
-        for (typename std::list<Cluster>::iterator it = clusters[j].begin();
-             it != clusters[j].end(); ++it)
-        {
-            Cluster& parent = *it;
-            for (typename std::list<Cluster>::iterator it2 = clusters[j].begin();
-                 it2 != clusters[j].end();)
-            {
-                Cluster& candidate = *it2;
-                if (it == it2)
-                {
-                    ++it2;
-                    continue;
-                }
+template const InferredJoints*
+infer_joints_fast<half>(half*, const InferLabelPr*, int, float*, int, int,
+                        const struct gm_joint_map*, float, JIParam*,
+                        InferJointsWorkspace*, struct gm_thread_pool*);
 
-                // If this scanline segment connects to the cluster being
-                // checked, remove it from the cluster list, add it to the
-                // checked cluster and break out.
-                bool local_change = false;
-                for (typename Cluster::iterator p_it = parent.begin();
-                     p_it != parent.end() && !local_change; ++p_it)
-                {
-                    ScanlineSegment& p_segment = *p_it;
-                    for (typename Cluster::iterator c_it = candidate.begin();
-                         c_it != candidate.end(); ++c_it)
-                    {
-                        ScanlineSegment& c_segment = *c_it;
-                        // Check if these two scanline cluster segments touch
-                        if ((abs(c_segment.y - p_segment.y) == 1) &&
-                            (c_segment.left <= p_segment.right) &&
-                            (c_segment.right >= p_segment.left))
-                        {
-                            parent.insert_after(
-                                parent.before_begin(),
-                                ClusterMoveIterator(candidate.begin()),
-                                ClusterMoveIterator(candidate.end()));
-                            it2 = clusters[j].erase(it2);
-                            local_change = true;
-                            break;
-                        }
-                    }
-                }
+template const InferredJoints*
+infer_joints_fast<float>(float*, const InferLabelPr*, int, float*, int, int,
+                         const struct gm_joint_map*, float, JIParam*,
+                         InferJointsWorkspace*, struct gm_thread_pool*);
 
-                if (!local_change)
-                {
-                    ++it2;
-                }
-            }
-        }
+typedef struct {
+    float* points;
+    float* density;
+    int* n_pixels;
+    int n_pixels_per_joint;
+    int too_many_pixels;
+    JIParam* params;
+    MeanShiftGrid* grids;
+    InferredJoints* result;
+} MeanShiftJointsState;
+
+/* Runs mean-shift over the points gathered for the j'th joint, using the
+ * calling thread's grid. Only the joint's own points and candidates are
+ * touched, so joints can be processed concurrently.
+ */
+static void
+mean_shift_joint_cb(int j, int thread, void* userdata)
+{
+    MeanShiftJointsState* data = (MeanShiftJointsState*)userdata;
+    float* points = data->points;
+    float* density = data->density;
+    int* n_pixels = data->n_pixels;
+    JIParam* params = data->params;
+    MeanShiftGrid* grid = &data->grids[thread];
+    InferredJoints* result = data->result;
+
+    if (n_pixels[j] == 0 || n_pixels[j] > data->too_many_pixels)
+    {
+        return;
     }
 
-    // clusters now contains the boundaries per scanline segment of each cluster
-    // of joint labels, which we can now use to calculate the highest confidence
-    // cluster and the projected cluster centroid.
+    float bandwidth = params[j].bandwidth;
+    float offset = params[j].offset;
 
-    // Variables for reprojection of 2d point + depth
-    float half_width = width / 2.f;
-    float half_height = height / 2.f;
-    float aspect = half_width / half_height;
+    int joint_idx = j * data->n_pixels_per_joint;
+    float* joint_points = &points[joint_idx * 3];
+    float* joint_density = &density[joint_idx];
+    int n_points = n_pixels[j];
 
-    float vfov_rad = vfov * M_PI / 180.f;
-    float tan_half_vfov = tanf(vfov_rad / 2.f);
-    float tan_half_hfov = tan_half_vfov * aspect;
-    //float hfov = atanf(tan_half_hfov) * 2.f;
+    for (int s = 0; s < N_SHIFTS; s++)
+    {
+        build_mean_shift_grid(grid, joint_points, joint_density,
+                              n_points, bandwidth * MEAN_SHIFT_CUTOFF);
+
+        bool moved = false;
+        for (int p = 0; p < n_points; p++)
+        {
+            float* x = &joint_points[p * 3];
+            float nx[3];
+            if (!mean_shift_point(grid, x, bandwidth, nx))
+            {
+                continue;
+            }
 
-    //float root_2pi = sqrtf(2.f * M_PI);
+            if (!moved &&
+                (fabs(nx[0] - x[0]) >= SHIFT_THRESHOLD ||
+                 fabs(nx[1] - x[1]) >= SHIFT_THRESHOLD ||
+                 fabs(nx[2] - x[2]) >= SHIFT_THRESHOLD))
+            {
+                moved = true;
+            }
 
-    // Allocate/clear joints structure
-    InferredJoints* result = (InferredJoints*)xmalloc(sizeof(InferredJoints));
-    result->n_joints = n_joints;
-    result->joints = (LList**)xcalloc(n_joints, sizeof(LList*));
+            // The grid holds a copy of the points so they can be updated
+            // in place without affecting the rest of this iteration
+            x[0] = nx[0];
+            x[1] = nx[1];
+            x[2] = nx[2];
+        }
 
-    for (int j = 0; j < n_joints; j++)
-    {
-        for (typename std::list<Cluster>::iterator it =
-             clusters[j].begin(); it != clusters[j].end(); ++it)
+        if (!moved || s == N_SHIFTS - 1)
         {
-            Cluster& cluster = *it;
-            Joint* joint = (Joint*)xmalloc(sizeof(Joint));
+            // Calculate the confidence of all modes found
+            float* last_point = &points[joint_idx * 3];
+            Joint joint = {
+                last_point[0], last_point[1], last_point[2] + offset, 0
+            };
 
-            // Calculate the center-point and confidence of the cluster
-            int n_points = 0;
-            int x = 0;
-            int y = 0;
-            joint->confidence = 0.f;
-            for (typename Cluster::iterator s_it = cluster.begin();
-                 s_it != cluster.end(); ++s_it)
+            //int unique_points = 1;
+
+            for (int p = 0; p < n_pixels[j]; p++)
             {
-                ScanlineSegment& segment = *s_it;
-                int idx = segment.y * width;
-                for (int i = segment.left; i <= segment.right; i++, n_points++)
+                float* point = &points[(joint_idx + p) * 3];
+                if (fabs(point[0]-last_point[0]) >= SHIFT_THRESHOLD ||
+                    fabs(point[1]-last_point[1]) >= SHIFT_THRESHOLD ||
+                    fabs(point[2]-last_point[2]) >= SHIFT_THRESHOLD)
                 {
-                    x += i;
-                    y += segment.y;
-                    joint->confidence += weights[(idx + i) * n_joints + j];
+                    //unique_points++;
+                    add_joint_candidate(result, j, joint);
+                    last_point = point;
+                    joint = {
+                        last_point[0], last_point[1],
+                        last_point[2] + offset, 0
+                    };
                 }
+                joint.confidence += density[joint_idx + p];
             }
+            add_joint_candidate(result, j, joint);
 
-            x = (int)roundf(x / (float)n_points);
-            y = (int)roundf(y / (float)n_points);
-
-            // Reproject and offset point
-            float s = (x / half_width) - 1.f;
-            float t = -((y / half_height) - 1.f);
-            float depth = (float)depth_image[y * width + x];
-            joint->x = (tan_half_hfov * depth) * s;
-            joint->y = (tan_half_vfov * depth) * t;
-            joint->z = depth + params[j].offset;
-
-            // Add the joint to the list
-            result->joints[j] = llist_insert_before(result->joints[j],
-                                                    llist_new(joint));
+            break;
         }
-
-        llist_sort(result->joints[j], compare_joints, NULL);
     }
-
-    return result;
 }
 
-template InferredJoints*
-infer_joints_fast<half>(half*, float*, float*, int, int, int,
-                        JSON_Value*, float, JIParam*);
-
-template InferredJoints*
-infer_joints_fast<float>(float*, float*, float*, int, int, int,
-                         JSON_Value*, float, JIParam*);
-
 template<typename FloatT>
-InferredJoints*
+const InferredJoints*
 infer_joints(FloatT* depth_image, float* pr_table, float* weights,
              int width, int height,
-             int n_labels, JSON_Value* joint_map,
-             float vfov, JIParam* params)
+             int n_labels, const struct gm_joint_map* joint_map,
+             float vfov, JIParam* params,
+             InferJointsWorkspace* workspace,
+             struct gm_thread_pool* pool)
 {
-    int n_joints = json_array_get_count(json_array(joint_map));
+    int n_joints = joint_map->n_joints;
+    const int* label_offsets = joint_map->label_offsets;
+    const uint8_t* joint_labels = joint_map->labels;
 
-    JointMapEntry map[n_joints];
-    unpack_joint_map(joint_map, map, n_joints);
+    InferredJoints* result = begin_inferred_joints(workspace, width, height,
+                                                   n_joints);
+
+    int too_many_pixels = (width * height) / 2;
+
+    if (!workspace->points)
+    {
+        int n_pixels = width * height;
+        workspace->points = (float*)
+            xmalloc(n_joints * n_pixels * 3 * sizeof(float));
+        workspace->density = (float*)
+            xmalloc(n_joints * n_pixels * sizeof(float));
+        workspace->n_points = (int*)xmalloc(n_joints * sizeof(int));
+    }
 
     // Use mean-shift to find the inferred joint positions, set them back into
     // the body using the given offset, and return the results
-    int* n_pixels = (int*)xcalloc(n_joints, sizeof(int));
-    size_t points_size = n_joints * width * height * 3 * sizeof(float);
-    float* points = (float*)xmalloc(points_size);
-    float* density = (float*)xmalloc(points_size);
+    int* n_pixels = workspace->n_points;
+    float* points = workspace->points;
+    float* density = workspace->density;
+    memset(n_pixels, 0, n_joints * sizeof(int));
 
     // Variables for reprojection of 2d point + depth
     float half_width = width / 2.f;
@@ -520,10 +3094,6 @@ infer_joints(FloatT* depth_image, float* pr_table, float* weights,
     float tan_half_hfov = tan_half_vfov * aspect;
     //float hfov = atanf(tan_half_hfov) * 2;
 
-    float root_2pi = sqrtf(2 * M_PI);
-
-    int too_many_pixels = (width * height) / 2;
-
     // Gather pixels above the given threshold
     for (int y = 0, idx = 0; y < height; y++)
     {
@@ -531,7 +3101,7 @@ infer_joints(FloatT* depth_image, float* pr_table, float* weights,
         for (int x = 0; x < width; x++, idx++)
         {
             float s = (x / half_width) - 1.f;
-            float depth = (float)depth_image[idx];
+            float depth = depth_to_float(depth_image[idx]);
             if (!std::isnormal(depth) || depth >= HUGE_DEPTH)
             {
                 continue;
@@ -542,9 +3112,9 @@ infer_joints(FloatT* depth_image, float* pr_table, float* weights,
                 float threshold = params[j].threshold;
                 int joint_idx = j * width * height;
 
-                for (int n = 0; n < map[j].n_labels; n++)
+                for (int n = label_offsets[j]; n < label_offsets[j + 1]; n++)
                 {
-                    int label = (int)map[j].labels[n];
+                    int label = (int)joint_labels[n];
                     float label_pr = pr_table[(idx * n_labels) + label];
                     if (label_pr >= threshold)
                     {
@@ -568,132 +3138,28 @@ infer_joints(FloatT* depth_image, float* pr_table, float* weights,
         }
     }
 
-    InferredJoints* result = (InferredJoints*)xmalloc(sizeof(InferredJoints));
-    result->n_joints = n_joints;
-    result->joints = (LList**)xcalloc(n_joints, sizeof(LList*));
+    reserve_mean_shift_grids(workspace, thread_pool_get_n_threads(pool),
+                             too_many_pixels);
 
     // Means shift to find joint modes
-    for (int j = 0; j < n_joints; j++)
-    {
-        if (n_pixels[j] == 0 || n_pixels[j] > too_many_pixels)
-        {
-            continue;
-        }
-
-        float bandwidth = params[j].bandwidth;
-        float offset = params[j].offset;
-
-        int joint_idx = j * width * height;
-        for (int s = 0; s < N_SHIFTS; s++)
-        {
-            float new_points[n_pixels[j] * 3];
-            bool moved = false;
-            for (int p = 0; p < n_pixels[j]; p++)
-            {
-                float* x = &points[(joint_idx + p) * 3];
-                float* nx = &new_points[p * 3];
-                float numerator[3] = { 0.f, };
-                float denominator = 0.f;
-                for (int n = 0; n < n_pixels[j]; n++)
-                {
-                    float* xi = &points[(joint_idx + n) * 3];
-                    float distance = sqrtf(pow(x[0] - xi[0], 2.f) +
-                                           pow(x[1] - xi[1], 2.f) +
-                                           pow(x[2] - xi[2], 2.f));
-
-                    // Weighted gaussian kernel
-                    float weight = density[joint_idx + n] *
-                        (1.f / (bandwidth * root_2pi)) *
-                        expf(-0.5f * pow(distance / bandwidth, 2.f));
-
-                    numerator[0] += weight * xi[0];
-                    numerator[1] += weight * xi[1];
-                    numerator[2] += weight * xi[2];
-
-                    denominator += weight;
-                }
-
-                nx[0] = numerator[0] / denominator;
-                nx[1] = numerator[1] / denominator;
-                nx[2] = numerator[2] / denominator;
-
-                if (!moved &&
-                    (fabs(nx[0] - x[0]) >= SHIFT_THRESHOLD ||
-                     fabs(nx[1] - x[1]) >= SHIFT_THRESHOLD ||
-                     fabs(nx[2] - x[2]) >= SHIFT_THRESHOLD))
-                {
-                    moved = true;
-                }
-            }
-
-            memcpy((void*)&points[joint_idx * 3], (void*)new_points,
-                   n_pixels[j] * 3 * sizeof(float));
-
-            if (!moved || s == N_SHIFTS - 1)
-            {
-                // Calculate the confidence of all modes found
-                float* last_point = &points[joint_idx * 3];
-                Joint* joint = (Joint*)xmalloc(sizeof(Joint));
-                joint->x = last_point[0];
-                joint->y = last_point[1];
-                joint->z = last_point[2] + offset;
-                joint->confidence = 0;
-                result->joints[j] = llist_new(joint);
-
-                //int unique_points = 1;
-
-                for (int p = 0; p < n_pixels[j]; p++)
-                {
-                    float* point = &points[(joint_idx + p) * 3];
-                    if (fabs(point[0]-last_point[0]) >= SHIFT_THRESHOLD ||
-                        fabs(point[1]-last_point[1]) >= SHIFT_THRESHOLD ||
-                        fabs(point[2]-last_point[2]) >= SHIFT_THRESHOLD)
-                    {
-                        //unique_points++;
-                        last_point = point;
-                        joint = (Joint*)xmalloc(sizeof(Joint));
-                        joint->x = last_point[0];
-                        joint->y = last_point[1];
-                        joint->z = last_point[2] + offset;
-                        joint->confidence = 0;
-                        result->joints[j] = llist_insert_before(result->joints[j],
-                                                                llist_new(joint));
-                    }
-                    joint->confidence += density[joint_idx + p];
-                }
-
-                llist_sort(result->joints[j], compare_joints, NULL);
-
-                break;
-            }
-        }
-    }
-
-    xfree(density);
-    xfree(points);
-    xfree(n_pixels);
+    MeanShiftJointsState state = {
+        points, density, n_pixels, width * height, too_many_pixels, params,
+        workspace->grids, result
+    };
+    thread_pool_run(pool, n_joints, mean_shift_joint_cb, &state);
 
     return result;
 }
 
-template InferredJoints*
+template const InferredJoints*
 infer_joints<half>(half*, float*, float*, int, int, int,
-                   JSON_Value*, float, JIParam*);
+                   const struct gm_joint_map*, float, JIParam*,
+                   InferJointsWorkspace*, struct gm_thread_pool*);
 
-template InferredJoints*
+template const InferredJoints*
 infer_joints<float>(float*, float*, float*, int, int, int,
-                    JSON_Value*, float, JIParam*);
-
-void
-free_joints(InferredJoints* joints)
-{
-    for (int i = 0; i < joints->n_joints; i++)
-    {
-        llist_free(joints->joints[i], llist_free_cb, NULL);
-    }
-    xfree(joints->joints);
-    xfree(joints);
-}
+                    const struct gm_joint_map*, float, JIParam*,
+                    InferJointsWorkspace*, struct gm_thread_pool*);
 
 template<typename FloatT>
 float*
@@ -711,14 +3177,17 @@ reproject(FloatT* depth_image, int width, int height,
     float* point_cloud = out_cloud ? out_cloud :
         (float*)xmalloc(width * height * 3 * sizeof(float));
 
+    float depth_row[width];
+
     *n_points = 0;
     int ty = -1;
     for (int y = 0, idx = 0; y < height; y++)
     {
         float t;
+        depth_to_float_n(&depth_image[idx], depth_row, width);
         for (int x = 0; x < width; x++, idx++)
         {
-            float depth = (float)depth_image[idx];
+            float depth = depth_row[x];
             if (!std::isnormal(depth) || depth > threshold)
             {
                 continue;
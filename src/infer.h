@@ -34,6 +34,98 @@
 
 #define HUGE_DEPTH 1000.f
 
+struct gm_thread_pool;
+
+/* How infer_labels() divides pixels between threads */
+enum infer_schedule {
+    /* Each work item is a rectangular tile of pixels (the default) */
+    INFER_SCHEDULE_TILES,
+    /* Each work item is a band of complete rows */
+    INFER_SCHEDULE_ROWS,
+    /* Pixels are interleaved between threads, one at a time */
+    INFER_SCHEDULE_STRIDED,
+};
+
+/* How infer_labels() walks each tree */
+enum infer_traversal {
+    /* Each pixel walks from the root to a leaf independently */
+    INFER_TRAVERSAL_SCALAR,
+    /* Batches of horizontally adjacent pixels are advanced one level at a
+     * time using SIMD gathers and comparisons. Ignored with
+     * INFER_SCHEDULE_STRIDED.
+     */
+    INFER_TRAVERSAL_BATCHED,
+    /* Each pixel walks all trees in lockstep, prefetching the next nodes
+     * and depth samples of every tree before evaluating any of them
+     */
+    INFER_TRAVERSAL_INTERLEAVED,
+};
+
+#define INFER_DEFAULT_TILE_WIDTH 32
+#define INFER_DEFAULT_TILE_HEIGHT 16
+
+/* Scratch memory that can be kept between calls to the infer_labels*()
+ * functions (via InferLabelsOptions::workspace) so that label inference
+ * doesn't allocate per frame. Currently this holds the copy of the depth
+ * image with a border of background depth that's sampled by inference,
+ * whose border is only written when the image size changes. A workspace
+ * mustn't be used by concurrent calls.
+ */
+typedef struct InferLabelsWorkspace InferLabelsWorkspace;
+
+InferLabelsWorkspace* infer_labels_workspace_new(void);
+
+void infer_labels_workspace_free(InferLabelsWorkspace* workspace);
+
+/* Zero initialized options give the default behaviour */
+typedef struct {
+    enum infer_schedule schedule;
+
+    /* Tile size for INFER_SCHEDULE_TILES, or the band height for
+     * INFER_SCHEDULE_ROWS (tile_width is ignored). Zero picks a default.
+     */
+    int tile_width;
+    int tile_height;
+
+    enum infer_traversal traversal;
+
+    /* If non-zero, only the first tree is evaluated for pixels where the
+     * maximum label probability of the first tree's distribution is at
+     * least this confident, and similarly the remaining trees are only
+     * evaluated until the running distribution reaches this confidence.
+     */
+    float cascade_confidence;
+
+    /* If greater than one, infer_labels() first only evaluates every
+     * coarse_scale'th pixel horizontally and vertically (equivalent to
+     * evaluating a downsampled image with scaled u,v offsets), then copies
+     * those labels to the remaining pixels except near boundaries where
+     * neighbouring coarse labels disagree, which are evaluated in full.
+     */
+    int coarse_scale;
+
+    /* If non-zero, trees are only walked this many levels deep, after which
+     * the label distribution of the split node that's been reached is used
+     * as if it were a leaf. This needs trees trained with split node
+     * distributions (which compact trees don't keep), and otherwise trees
+     * are walked to a leaf as usual.
+     */
+    int max_depth;
+
+    /* If non-NULL, scratch memory is kept here between calls instead of
+     * being allocated for each call
+     */
+    InferLabelsWorkspace* workspace;
+} InferLabelsOptions;
+
+/* Compact label output, see infer_labels_top_k() */
+typedef struct {
+    uint8_t label;
+    uint8_t pr;     // Probability, scaled to [0,255]
+} InferLabelPr;
+
+#define INFER_MAX_TOP_K 8
+
 typedef struct {
     float x;
     float y;
@@ -41,11 +133,69 @@ typedef struct {
     float confidence;
 } Joint;
 
+/* The most joints a joint map may have, see gm_joint_map::label_joints */
+#define GM_JOINT_MAP_MAX_JOINTS 64
+
+/* A joint map (as loaded from joint-map.json) compiled into flat tables so
+ * that the inner loops of joint inference can look up the labels of each
+ * joint, and the joints of each label, without walking the JSON. The labels
+ * of joint j are labels[label_offsets[j]] to labels[label_offsets[j + 1] - 1]
+ * and bit j of label_joints[label] is set if the label maps to joint j.
+ */
+struct gm_joint_map {
+    int         n_joints;
+    int         n_labels;       // One more than the greatest mapped label
+    int*        label_offsets;  // n_joints + 1 offsets into labels
+    uint8_t*    labels;
+    uint64_t*   label_joints;   // n_labels joint bitmasks
+};
+
+struct gm_joint_map* gm_joint_map_new(struct gm_logger* log,
+                                      JSON_Value* joint_map,
+                                      char** err);
+
+void gm_joint_map_free(struct gm_joint_map* map);
+
+/* The candidate positions found for each joint, most confident first, with
+ * the candidates for joint j starting at candidates[j * max_candidates]
+ */
 typedef struct {
     int     n_joints;
-    LList** joints;
+    int     max_candidates;
+    int*    n_candidates;
+    Joint*  candidates;
 } InferredJoints;
 
+static inline const Joint*
+inferred_joint_candidates(const InferredJoints* joints, int joint)
+{
+    return &joints->candidates[joint * joints->max_candidates];
+}
+
+#define INFER_DEFAULT_MAX_JOINT_CANDIDATES 32
+
+/* Scratch and result storage for infer_joints() and infer_joints_fast() so
+ * that joint inference doesn't allocate per frame. A workspace is sized for
+ * one image size and joint map, and the results of each call remain valid
+ * until the next call with the same workspace.
+ */
+typedef struct InferJointsWorkspace InferJointsWorkspace;
+
+/* Only the max_candidates most confident candidates of each joint are kept,
+ * or INFER_DEFAULT_MAX_JOINT_CANDIDATES if max_candidates is zero
+ */
+InferJointsWorkspace* infer_joints_workspace_new(int width,
+                                                 int height,
+                                                 int n_joints,
+                                                 int max_candidates);
+
+void infer_joints_workspace_free(InferJointsWorkspace* workspace);
+
+/* A width * height * n_joints buffer for the pixel weights, see
+ * calc_pixel_weights()
+ */
+float* infer_joints_workspace_get_weights(InferJointsWorkspace* workspace);
+
 template<typename FloatT>
 float* infer_labels(RDTree** forest,
                     int n_trees,
@@ -53,7 +203,70 @@ float* infer_labels(RDTree** forest,
                     int width,
                     int height,
                     float* out_labels = NULL,
-                    bool use_threads = false);
+                    struct gm_thread_pool* pool = NULL,
+                    const InferLabelsOptions* options = NULL);
+
+/* Like infer_labels() but only evaluates the given list of pixels (as
+ * offsets into the depth image), writing n_pixels compact probability
+ * tables in the same order as the list.
+ *
+ * The batched traversal and schedule options don't apply here.
+ */
+template<typename FloatT>
+float* infer_labels_sparse(RDTree** forest,
+                           int n_trees,
+                           FloatT* depth_image,
+                           int width,
+                           int height,
+                           const int* pixels,
+                           int n_pixels,
+                           float* out_labels = NULL,
+                           struct gm_thread_pool* pool = NULL,
+                           const InferLabelsOptions* options = NULL);
+
+/* Like infer_labels() but instead of full probability tables writes the
+ * top_k most likely labels for each pixel, most likely first, where top_k
+ * is between 1 (just the argmax label and its confidence) and
+ * INFER_MAX_TOP_K. Probability outside of the top_k labels is dropped.
+ */
+template<typename FloatT>
+InferLabelPr* infer_labels_top_k(RDTree** forest,
+                                 int n_trees,
+                                 FloatT* depth_image,
+                                 int width,
+                                 int height,
+                                 int top_k,
+                                 InferLabelPr* out_labels = NULL,
+                                 struct gm_thread_pool* pool = NULL,
+                                 const InferLabelsOptions* options = NULL);
+
+/* The top_k equivalent of infer_labels_sparse() */
+template<typename FloatT>
+InferLabelPr* infer_labels_sparse_top_k(RDTree** forest,
+                                        int n_trees,
+                                        FloatT* depth_image,
+                                        int width,
+                                        int height,
+                                        const int* pixels,
+                                        int n_pixels,
+                                        int top_k,
+                                        InferLabelPr* out_labels = NULL,
+                                        struct gm_thread_pool* pool = NULL,
+                                        const InferLabelsOptions* options =
+                                            NULL);
+
+/* Expands top_k labels back into full probability tables */
+void expand_top_k_labels(const InferLabelPr* labels,
+                         int n_pixels,
+                         int top_k,
+                         int n_labels,
+                         float* out_pr_tables);
+
+/* Returns the largest absolute u or v offset component of any split node in
+ * the forest, so that every depth sample taken for a pixel at depth d is
+ * within ceil(max_offset / d) pixels of it, horizontally and vertically
+ */
+float get_max_uv_offset(RDTree** forest, int n_trees);
 
 template<typename FloatT>
 float* calc_pixel_weights(FloatT* depth_image,
@@ -61,32 +274,190 @@ float* calc_pixel_weights(FloatT* depth_image,
                           int width,
                           int height,
                           int n_labels,
-                          JSON_Value* joint_map,
-                          float* out_weights = NULL);
-
-template<typename FloatT>
-InferredJoints* infer_joints_fast(FloatT* depth_image,
-                                  float* pr_table,
-                                  float* weights,
-                                  int width,
-                                  int height,
-                                  int n_labels,
-                                  JSON_Value* joint_map,
-                                  float vfov,
-                                  JIParam* params);
-
-template<typename FloatT>
-InferredJoints* infer_joints(FloatT* depth_image,
-                             float* pr_table,
-                             float* weights,
-                             int width,
-                             int height,
-                             int n_labels,
-                             JSON_Value* joint_map,
-                             float vfov,
-                             JIParam* params);
-
-void free_joints(InferredJoints* joints);
+                          const struct gm_joint_map* joint_map,
+                          float* out_weights = NULL,
+                          struct gm_thread_pool* pool = NULL);
+
+/* Like calc_pixel_weights() but reads the output of infer_labels_top_k() */
+template<typename FloatT>
+float* calc_pixel_weights(FloatT* depth_image,
+                          const InferLabelPr* labels,
+                          int top_k,
+                          int width,
+                          int height,
+                          const struct gm_joint_map* joint_map,
+                          float* out_weights = NULL,
+                          struct gm_thread_pool* pool = NULL);
+
+/* Like calc_pixel_weights() but reads the n_pixels tables written by
+ * infer_labels_sparse() for the given list of pixels, and only writes the
+ * weights of those pixels.
+ */
+template<typename FloatT>
+float* calc_pixel_weights_sparse(FloatT* depth_image,
+                                 float* pr_table,
+                                 const int* pixels,
+                                 int n_pixels,
+                                 int width,
+                                 int height,
+                                 int n_labels,
+                                 const struct gm_joint_map* joint_map,
+                                 float* out_weights = NULL,
+                                 struct gm_thread_pool* pool = NULL);
+
+/* The infer_labels_sparse_top_k() equivalent of calc_pixel_weights_sparse() */
+template<typename FloatT>
+float* calc_pixel_weights_sparse(FloatT* depth_image,
+                                 const InferLabelPr* labels,
+                                 int top_k,
+                                 const int* pixels,
+                                 int n_pixels,
+                                 int width,
+                                 int height,
+                                 const struct gm_joint_map* joint_map,
+                                 float* out_weights = NULL,
+                                 struct gm_thread_pool* pool = NULL);
+
+/* Equivalent to infer_labels() followed by calc_pixel_weights(), except
+ * that each pixel's weights are calculated while its probability table is
+ * still in cache instead of in a second pass over the whole image. The
+ * probability tables are only written if out_labels is non-NULL.
+ *
+ * Returns the weights, allocated if out_weights is NULL.
+ */
+template<typename FloatT>
+float* infer_labels_with_weights(RDTree** forest,
+                                 int n_trees,
+                                 FloatT* depth_image,
+                                 int width,
+                                 int height,
+                                 const struct gm_joint_map* joint_map,
+                                 float* out_weights = NULL,
+                                 float* out_labels = NULL,
+                                 struct gm_thread_pool* pool = NULL,
+                                 const InferLabelsOptions* options = NULL);
+
+/* Each joint is searched for independently, so if a pool is given the
+ * joints are spread across its threads. The results don't depend on the
+ * number of threads.
+ */
+template<typename FloatT>
+const InferredJoints* infer_joints_fast(FloatT* depth_image,
+                                        float* pr_table,
+                                        float* weights,
+                                        int width,
+                                        int height,
+                                        int n_labels,
+                                        const struct gm_joint_map* joint_map,
+                                        float vfov,
+                                        JIParam* params,
+                                        InferJointsWorkspace* workspace,
+                                        struct gm_thread_pool* pool = NULL);
+
+/* Like infer_joints_fast() but reads the output of infer_labels_top_k() */
+template<typename FloatT>
+const InferredJoints* infer_joints_fast(FloatT* depth_image,
+                                        const InferLabelPr* labels,
+                                        int top_k,
+                                        float* weights,
+                                        int width,
+                                        int height,
+                                        const struct gm_joint_map* joint_map,
+                                        float vfov,
+                                        JIParam* params,
+                                        InferJointsWorkspace* workspace,
+                                        struct gm_thread_pool* pool = NULL);
+
+/* Like infer_joints_fast() but for tracking, where the position of each
+ * joint with a seed (such as the joints of the previous frame's skeleton,
+ * with a confidence greater than zero) is found by a few mean-shift
+ * iterations from the seed over only the pixels within seed_radius of it,
+ * giving a single candidate. Joints without a seed, or whose seed has no
+ * pixels passing the joint's threshold nearby, are searched for over the
+ * whole image as by infer_joints_fast(). seeds may be NULL.
+ */
+template<typename FloatT>
+const InferredJoints* infer_joints_seeded(FloatT* depth_image,
+                                          float* pr_table,
+                                          float* weights,
+                                          int width,
+                                          int height,
+                                          int n_labels,
+                                          const struct gm_joint_map* joint_map,
+                                          float vfov,
+                                          JIParam* params,
+                                          const Joint* seeds,
+                                          float seed_radius,
+                                          InferJointsWorkspace* workspace,
+                                          struct gm_thread_pool* pool = NULL);
+
+/* Like infer_joints_seeded() but reads the output of infer_labels_top_k() */
+template<typename FloatT>
+const InferredJoints* infer_joints_seeded(FloatT* depth_image,
+                                          const InferLabelPr* labels,
+                                          int top_k,
+                                          float* weights,
+                                          int width,
+                                          int height,
+                                          const struct gm_joint_map* joint_map,
+                                          float vfov,
+                                          JIParam* params,
+                                          const Joint* seeds,
+                                          float seed_radius,
+                                          InferJointsWorkspace* workspace,
+                                          struct gm_thread_pool* pool = NULL);
+
+/* Like infer_joints_seeded() but reads the tables written by
+ * infer_labels_sparse(), where pixel_rows maps each pixel of the image to
+ * its table, or -1 if it wasn't evaluated. Pixels that weren't evaluated
+ * don't belong to any joint, so only the weights of evaluated pixels (see
+ * calc_pixel_weights_sparse()) are used.
+ */
+template<typename FloatT>
+const InferredJoints* infer_joints_seeded(FloatT* depth_image,
+                                          float* pr_table,
+                                          const int* pixel_rows,
+                                          float* weights,
+                                          int width,
+                                          int height,
+                                          int n_labels,
+                                          const struct gm_joint_map* joint_map,
+                                          float vfov,
+                                          JIParam* params,
+                                          const Joint* seeds,
+                                          float seed_radius,
+                                          InferJointsWorkspace* workspace,
+                                          struct gm_thread_pool* pool = NULL);
+
+/* The infer_labels_sparse_top_k() equivalent of the above */
+template<typename FloatT>
+const InferredJoints* infer_joints_seeded(FloatT* depth_image,
+                                          const InferLabelPr* labels,
+                                          int top_k,
+                                          const int* pixel_rows,
+                                          float* weights,
+                                          int width,
+                                          int height,
+                                          const struct gm_joint_map* joint_map,
+                                          float vfov,
+                                          JIParam* params,
+                                          const Joint* seeds,
+                                          float seed_radius,
+                                          InferJointsWorkspace* workspace,
+                                          struct gm_thread_pool* pool = NULL);
+
+template<typename FloatT>
+const InferredJoints* infer_joints(FloatT* depth_image,
+                                   float* pr_table,
+                                   float* weights,
+                                   int width,
+                                   int height,
+                                   int n_labels,
+                                   const struct gm_joint_map* joint_map,
+                                   float vfov,
+                                   JIParam* params,
+                                   InferJointsWorkspace* workspace,
+                                   struct gm_thread_pool* pool = NULL);
 
 template<typename FloatT>
 float* reproject(FloatT* depth_image,
@@ -0,0 +1,353 @@
+/*
+ * Copyright (C) 2017 Glimp IP Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* The batched label inference traversal (INFER_TRAVERSAL_BATCHED), which is
+ * only included by infer.cc.
+ *
+ * This is deliberately included more than once: for the portable build of
+ * the traversal and, where the compiler supports it, again for a build
+ * targeting AVX2 that infer.cc dispatches to at runtime. INFER_BATCH_AVX2
+ * must be defined to 1 where the AVX2 intrinsics may be used, since GCC
+ * doesn't define __AVX2__ within a '#pragma GCC target' region for C++.
+ */
+
+typedef vector(float, INFER_BATCH_SIZE) BatchFloat;
+typedef vector(int32_t, INFER_BATCH_SIZE) BatchInt;
+
+/* The coordinates and depth of each pixel of a batch */
+typedef struct {
+    BatchFloat x;
+    BatchFloat y;
+    BatchFloat depth;
+} BatchPixels;
+
+/* The fields of the current node for each pixel of a batch */
+typedef struct {
+    BatchFloat uv[4];
+    BatchFloat t;
+    BatchInt idx;
+    BatchInt left_idx;      // Only for full nodes
+    BatchInt split_pr_idx;  // Only for full nodes
+} BatchNodes;
+
+static inline bool
+batch_any(const BatchInt& mask)
+{
+#if INFER_BATCH_AVX2
+    return !_mm256_testz_si256((__m256i)mask, (__m256i)mask);
+#else
+    int32_t any = 0;
+    for (int l = 0; l < INFER_BATCH_SIZE; ++l)
+    {
+        any |= mask[l];
+    }
+    return any != 0;
+#endif
+}
+
+/* See unpack_compact_uv() */
+static inline BatchFloat
+unpack_batch_halves(const BatchInt& h)
+{
+    BatchInt bits = ((h & 0x7fff) << 13) | ((h & 0x8000) << 16);
+    return (BatchFloat)bits * 0x1p112f;
+}
+
+static inline void
+gather_batch_nodes(RDTree* tree, const BatchInt& ids, BatchNodes* nodes)
+{
+    if (tree->compact_nodes)
+    {
+        BatchInt uv01, uv23;
+#if INFER_BATCH_AVX2
+        const int* base = (const int*)tree->compact_nodes;
+        BatchInt offsets = ids * (int)(sizeof(RDTCompactNode) / sizeof(int));
+        uv01 = (BatchInt)_mm256_i32gather_epi32(base, (__m256i)offsets, 4);
+        uv23 = (BatchInt)_mm256_i32gather_epi32(base, (__m256i)(offsets + 1), 4);
+        nodes->t = (BatchFloat)_mm256_i32gather_ps((const float*)base,
+                                                   (__m256i)(offsets + 2), 4);
+        nodes->idx = (BatchInt)_mm256_i32gather_epi32(base,
+                                                      (__m256i)(offsets + 3), 4);
+#else
+        for (int l = 0; l < INFER_BATCH_SIZE; ++l)
+        {
+            RDTCompactNode* node = &tree->compact_nodes[ids[l]];
+            uv01[l] = node->uv[0] | (node->uv[1] << 16);
+            uv23[l] = node->uv[2] | (node->uv[3] << 16);
+            nodes->t[l] = node->t;
+            nodes->idx[l] = node->idx;
+        }
+#endif
+        nodes->uv[0] = unpack_batch_halves(uv01 & 0xffff);
+        nodes->uv[1] = unpack_batch_halves((uv01 >> 16) & 0xffff);
+        nodes->uv[2] = unpack_batch_halves(uv23 & 0xffff);
+        nodes->uv[3] = unpack_batch_halves((uv23 >> 16) & 0xffff);
+    }
+    else
+    {
+#if INFER_BATCH_AVX2
+        const float* base = (const float*)tree->nodes;
+        BatchInt offsets = ids * (int)(sizeof(Node) / sizeof(float));
+        for (int i = 0; i < 4; ++i)
+        {
+            nodes->uv[i] = (BatchFloat)_mm256_i32gather_ps(
+                base, (__m256i)(offsets + i), 4);
+        }
+        nodes->t = (BatchFloat)_mm256_i32gather_ps(
+            base, (__m256i)(offsets + 4), 4);
+        nodes->idx = (BatchInt)_mm256_i32gather_epi32(
+            (const int*)base, (__m256i)(offsets + 5), 4);
+        nodes->left_idx = (BatchInt)_mm256_i32gather_epi32(
+            (const int*)base, (__m256i)(offsets + 6), 4);
+        nodes->split_pr_idx = (BatchInt)_mm256_i32gather_epi32(
+            (const int*)base, (__m256i)(offsets + 7), 4);
+#else
+        for (int l = 0; l < INFER_BATCH_SIZE; ++l)
+        {
+            Node* node = &tree->nodes[ids[l]];
+            for (int i = 0; i < 4; ++i)
+            {
+                nodes->uv[i][l] = node->uv[i];
+            }
+            nodes->t[l] = node->t;
+            nodes->idx[l] = node->label_pr_idx;
+            nodes->left_idx[l] = node->left_idx;
+            nodes->split_pr_idx[l] = node->split_pr_idx;
+        }
+#endif
+    }
+}
+
+static inline BatchInt
+batch_nodes_are_leaves(RDTree* tree, BatchNodes* nodes)
+{
+    if (tree->compact_nodes)
+    {
+        return (nodes->idx & (int32_t)RDT_COMPACT_LEAF_BIT) != 0;
+    }
+    else
+    {
+        return nodes->idx != 0;
+    }
+}
+
+template<typename FloatT>
+static inline BatchFloat
+gather_batch_depth(FloatT* depth_image, const BatchInt& offsets)
+{
+    BatchFloat depth;
+    for (int l = 0; l < INFER_BATCH_SIZE; ++l)
+    {
+        depth[l] = depth_to_float(depth_image[offsets[l]]);
+    }
+    return depth;
+}
+
+#if INFER_BATCH_AVX2
+template<>
+inline BatchFloat
+gather_batch_depth<float>(float* depth_image, const BatchInt& offsets)
+{
+    return (BatchFloat)_mm256_i32gather_ps(depth_image, (__m256i)offsets, 4);
+}
+#endif
+
+static inline BatchInt
+clamp_batch_coords(const BatchInt& coords, int extent)
+{
+    BatchInt min = coords < -DEPTH_IMAGE_PADDING ?
+        -DEPTH_IMAGE_PADDING : coords;
+    return min > extent - 1 + DEPTH_IMAGE_PADDING ?
+        extent - 1 + DEPTH_IMAGE_PADDING : min;
+}
+
+/* A vectorized equivalent of sample_uv_padded() which must give identical
+ * results for each lane.
+ */
+template<typename FloatT>
+static inline BatchFloat
+sample_batch_uv(FloatT* depth_image, int width, int height,
+                BatchPixels* pixels, BatchNodes* nodes)
+{
+    BatchFloat px = pixels->x;
+    BatchFloat py = pixels->y;
+    BatchFloat depth = pixels->depth;
+
+    BatchInt ux = __builtin_convertvector(px + nodes->uv[0] / depth, BatchInt);
+    BatchInt uy = __builtin_convertvector(py + nodes->uv[1] / depth, BatchInt);
+    BatchInt vx = __builtin_convertvector(px + nodes->uv[2] / depth, BatchInt);
+    BatchInt vy = __builtin_convertvector(py + nodes->uv[3] / depth, BatchInt);
+
+    ux = clamp_batch_coords(ux, width);
+    uy = clamp_batch_coords(uy, height);
+    vx = clamp_batch_coords(vx, width);
+    vy = clamp_batch_coords(vy, height);
+
+    int stride = padded_depth_image_stride(width);
+    BatchFloat upixel = gather_batch_depth(depth_image, uy * stride + ux);
+    BatchFloat vpixel = gather_batch_depth(depth_image, vy * stride + vx);
+
+    return upixel - vpixel;
+}
+
+/* Evaluates up to INFER_BATCH_SIZE horizontally adjacent pixels together,
+ * advancing all of them one tree level at a time so that node fields and
+ * depth samples can be fetched with gathers and child indices computed
+ * with vector comparisons instead of a data-dependent branch per pixel.
+ *
+ * Pixels that reach a leaf early (or are background) are masked out until
+ * the whole batch is finished with the current tree.
+ */
+template<typename FloatT>
+static void
+infer_labels_batch(InferLabelsState* data, int x0, int y, int n_pixels,
+                   int thread)
+{
+    FloatT* depth_image = (FloatT*)data->depth_image;
+    int n_labels = data->forest[0]->header.n_labels;
+    int width = data->width;
+
+    float* out_pr_tables[INFER_BATCH_SIZE];
+    uint32_t* accs[INFER_BATCH_SIZE];
+    int n_evaluated[INFER_BATCH_SIZE];
+    BatchPixels pixels;
+    BatchInt foreground;
+
+    for (int l = 0; l < INFER_BATCH_SIZE; ++l)
+    {
+        pixels.x[l] = x0 + l;
+        pixels.y[l] = y;
+        pixels.depth[l] = 1.f;
+        foreground[l] = 0;
+        n_evaluated[l] = data->n_trees;
+        if (l >= n_pixels)
+        {
+            continue;
+        }
+
+        int off = y * width + x0 + l;
+        out_pr_tables[l] = get_pixel_pr_table(data, off, thread, l);
+        accs[l] = data->accumulators ?
+            &data->accumulators[(thread * INFER_BATCH_SIZE + l) * n_labels] :
+            NULL;
+        pixels.depth[l] = depth_to_float(depth_image[
+            y * padded_depth_image_stride(width) + x0 + l]);
+        if (begin_pixel(data, pixels.depth[l], out_pr_tables[l], accs[l]))
+        {
+            foreground[l] = -1;
+        }
+    }
+
+    if (!batch_any(foreground))
+    {
+        for (int l = 0; l < n_pixels; ++l)
+        {
+            store_pixel_pr_table<FloatT>(data, y * width + x0 + l,
+                                         out_pr_tables[l]);
+        }
+        return;
+    }
+
+    /* Lanes drop out of this as soon as they are confident when cascading */
+    BatchInt evaluating = foreground;
+
+    for (int i = 0; i < data->n_trees && batch_any(evaluating); ++i)
+    {
+        RDTree* tree = data->forest[i];
+        BatchInt ids = {};
+        BatchNodes nodes = {};
+
+        /* Split node tables for lanes that stopped at max_depth */
+        BatchInt split_pr_idx = {};
+
+        gather_batch_nodes(tree, ids, &nodes);
+        BatchInt active = evaluating & ~batch_nodes_are_leaves(tree, &nodes);
+        for (int level = 0; batch_any(active); ++level)
+        {
+            if (level == data->max_depth && !tree->compact_nodes)
+            {
+                BatchInt stop = active & (nodes.split_pr_idx != 0);
+                split_pr_idx = stop ? nodes.split_pr_idx : split_pr_idx;
+                active &= ~stop;
+                if (!batch_any(active))
+                {
+                    break;
+                }
+            }
+
+            BatchFloat value = sample_batch_uv(depth_image, width, data->height,
+                                               &pixels, &nodes);
+
+            /* -1 where we take the left child, else 0 */
+            BatchInt left = value < nodes.t;
+            BatchInt next;
+            if (tree->compact_nodes)
+            {
+                next = nodes.idx + 1 + left;
+            }
+            else
+            {
+                next = nodes.left_idx + 1 + left;
+            }
+            ids = active ? next : ids;
+
+            gather_batch_nodes(tree, ids, &nodes);
+            active &= ~batch_nodes_are_leaves(tree, &nodes);
+        }
+
+        BatchInt leaf_idx;
+        if (tree->compact_nodes)
+        {
+            leaf_idx = nodes.idx & (int32_t)~RDT_COMPACT_LEAF_BIT;
+        }
+        else
+        {
+            leaf_idx = (split_pr_idx ? split_pr_idx : nodes.idx) - 1;
+        }
+
+        for (int l = 0; l < n_pixels; ++l)
+        {
+            if (evaluating[l])
+            {
+                accumulate_leaf_table(data, tree, leaf_idx[l],
+                                      out_pr_tables[l], accs[l]);
+                if (pixel_is_confident(data, out_pr_tables[l], accs[l], i + 1))
+                {
+                    n_evaluated[l] = i + 1;
+                    evaluating[l] = 0;
+                }
+            }
+        }
+    }
+
+    for (int l = 0; l < n_pixels; ++l)
+    {
+        if (foreground[l])
+        {
+            end_pixel(data, out_pr_tables[l], accs[l], n_evaluated[l]);
+        }
+        store_pixel_pr_table<FloatT>(data, y * width + x0 + l,
+                                     out_pr_tables[l]);
+    }
+}
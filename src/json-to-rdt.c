@@ -112,9 +112,12 @@ main(int argc, char **argv)
         return 1;
     }
 
-    RDTree *tree = rdt_tree_load_from_file(log, argv[optind], NULL);
-    if (!tree)
+    char *err = NULL;
+    RDTree *tree = rdt_tree_load_from_json_file(log, argv[optind], &err);
+    if (!tree) {
+        fprintf(stderr, "Failed to load %s: %s\n", argv[optind], err);
         return 1;
+    }
 
     return rdt_tree_save(tree, argv[optind+1]) ? 0 : 1;
 }
@@ -164,16 +164,24 @@ JointMap::JointMap(char* aJointMap, char* aJointInferenceParams)
   mParams = read_jip(aJointInferenceParams);
   if (mParams)
     {
-      mJointMap = json_parse_file(aJointMap);
+      char* err = NULL;
+      JSON_Value* joint_map = json_parse_file(aJointMap);
+      mJointMap = joint_map ? gm_joint_map_new(NULL, joint_map, &err) : NULL;
       if (mJointMap)
         {
           mValid = true;
         }
       else
         {
-          fprintf(stderr, "Error reading joint map\n");
+          fprintf(stderr, "Error reading joint map%s%s\n",
+                  err ? ": " : "", err ? err : "");
+          free(err);
           free_jip(mParams);
         }
+      if (joint_map)
+        {
+          json_value_free(joint_map);
+        }
     }
   else
     {
@@ -186,7 +194,7 @@ JointMap::~JointMap()
   if (mValid)
     {
       mValid = false;
-      json_value_free(mJointMap);
+      gm_joint_map_free(mJointMap);
       free_jip(mParams);
     }
 }
@@ -204,36 +212,42 @@ JointMap::inferJoints(Forest* aForest, DepthImage* aDepthImage,
   int width, height, n_labels;
   aForest->inferLabels(aDepthImage, &pr_table, &width, &height, &n_labels);
 
+  InferJointsWorkspace* workspace =
+    infer_joints_workspace_new(width, height, mJointMap->n_joints, 0);
+
   float* weights = calc_pixel_weights(aDepthImage->mDepthImage,
                                       pr_table, width, height, n_labels,
-                                      mJointMap);
+                                      mJointMap,
+                                      infer_joints_workspace_get_weights(
+                                        workspace));
 
-  InferredJoints* result =
+  const InferredJoints* result =
     infer_joints(aDepthImage->mDepthImage, pr_table, weights,
                  aDepthImage->mWidth, aDepthImage->mHeight,
                  aForest->mForest[0]->header.n_labels,
                  mJointMap,
                  aForest->mForest[0]->header.fov,
-                 mParams->joint_params);
+                 mParams->joint_params,
+                 workspace);
 
-  xfree(weights);
   xfree(pr_table);
 
   // TODO: Create an object equivalent of InferredJoints for bindings
   *aJoints = (float*)xcalloc(result->n_joints, sizeof(float) * 3);
   for (int i = 0; i < result->n_joints; i++)
     {
-      if (!result->joints[i])
+      if (!result->n_candidates[i])
         {
           continue;
         }
 
-      (*aJoints)[i * 3] = ((Joint*)result->joints[i]->data)->x;
-      (*aJoints)[i * 3 + 1] = ((Joint*)result->joints[i]->data)->y;
-      (*aJoints)[i * 3 + 2] = ((Joint*)result->joints[i]->data)->z;
+      const Joint* joint = inferred_joint_candidates(result, i);
+      (*aJoints)[i * 3] = joint->x;
+      (*aJoints)[i * 3 + 1] = joint->y;
+      (*aJoints)[i * 3 + 2] = joint->z;
     }
 
-  free_joints(result);
+  infer_joints_workspace_free(workspace);
 
   *aOutNJoints = mParams->header.n_joints;
   *aOutNDims = 3;
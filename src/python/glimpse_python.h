@@ -91,7 +91,7 @@ namespace Glimpse
     private:
       bool mValid;
       JIParams* mParams;
-      JSON_Value* mJointMap;
+      struct gm_joint_map* mJointMap;
 
     public:
       JointMap(char* aJointMap, char* aJointInferenceParams);
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2017 Glimp IP Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <getopt.h>
+
+#include <glimpse_log.h>
+
+#include "rdt_tree.h"
+
+static void
+usage(void)
+{
+    printf(
+"Usage rdt-compact [options] <in.rdt|in.json> <out.rdt>\n"
+"\n"
+"    -q,--quantize=FORMAT       Also quantize leaf label probability tables\n"
+"                               (FORMAT = u8 or u16)\n"
+"    -h,--help                  Display this help\n\n"
+"\n"
+"This tool converts a randomised decision tree, either in the binary RDT\n"
+"format or the JSON representation output by the train_rdt tool, into an RDT\n"
+"file using the compact, inference-only node format.\n"
+"\n"
+"Compact nodes are 16 bytes instead of 32 bytes, with U and V vectors stored\n"
+"as half-floats.\n"
+"\n"
+"Nodes are stored in a van Emde Boas order, where each subtree of a few levels\n"
+"is contiguous, so a walk from the root to a leaf of a deep tree touches a\n"
+"handful of pages instead of one page per level.\n"
+"\n"
+"Quantized tables store each probability as an 8 or 16 bit fixed point value\n"
+"which can be accumulated with integer arithmetic during inference.\n"
+"\n"
+"Note: The conversion is lossy and compact trees can't be used to continue\n"
+"      training or be converted back to JSON.\n"
+    );
+}
+
+int
+main(int argc, char **argv)
+{
+    struct gm_logger *log = gm_logger_new(NULL, NULL);
+    int opt;
+    int table_format = RDT_TABLE_FORMAT_FLOAT;
+    const char *short_options="+q:h";
+    const struct option long_options[] = {
+        {"quantize",        required_argument,  0, 'q'},
+        {"help",            no_argument,        0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, short_options, long_options, NULL))
+           != -1)
+    {
+        switch (opt) {
+            case 'q':
+                if (strcmp(optarg, "u8") == 0)
+                    table_format = RDT_TABLE_FORMAT_U8;
+                else if (strcmp(optarg, "u16") == 0)
+                    table_format = RDT_TABLE_FORMAT_U16;
+                else {
+                    fprintf(stderr, "Unknown table format '%s'\n", optarg);
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'h':
+                usage();
+                return 0;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage();
+        return 1;
+    }
+
+    const char *in_file = argv[optind];
+    const char *out_file = argv[optind + 1];
+    char *err = NULL;
+
+    RDTree *tree;
+    int len = strlen(in_file);
+    if (len > 5 && strcmp(in_file + len - 5, ".json") == 0)
+        tree = rdt_tree_load_from_json_file(log, in_file, &err);
+    else
+        tree = rdt_tree_load_from_file(log, in_file, &err);
+    if (!tree) {
+        fprintf(stderr, "Failed to load %s: %s\n", in_file, err);
+        return 1;
+    }
+
+    size_t full_size = rdt_tree_get_size(tree);
+
+    if (!rdt_tree_compact(log, tree, &err)) {
+        fprintf(stderr, "Failed to compact %s: %s\n", in_file, err);
+        return 1;
+    }
+
+    if (table_format != RDT_TABLE_FORMAT_FLOAT &&
+        !rdt_tree_quantize(log, tree, table_format, &err))
+    {
+        fprintf(stderr, "Failed to quantize %s: %s\n", in_file, err);
+        return 1;
+    }
+
+    printf("Compacted %s from %zu to %zu bytes\n",
+           in_file, full_size, rdt_tree_get_size(tree));
+
+    bool saved = rdt_tree_save(tree, out_file);
+    rdt_tree_destroy(tree);
+
+    return saved ? 0 : 1;
+}
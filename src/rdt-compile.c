@@ -0,0 +1,374 @@
+/*
+ * Copyright (C) 2017 Glimp IP Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <getopt.h>
+
+#include <glimpse_log.h>
+
+#include "rdt_tree.h"
+
+#define DEFAULT_LEVELS 6
+#define MAX_LEVELS 12
+
+/* The same conversion as unpack_compact_uv() in infer.cc, so the unrolled
+ * code gives exactly the same results as walking the compact nodes
+ */
+static float
+half_bits_to_float(uint16_t h)
+{
+    uint32_t bits = ((h & 0x7fff) << 13) | ((h & 0x8000) << 16);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value * 0x1p112f;
+}
+
+static bool
+is_leaf(RDTree* tree, uint32_t id)
+{
+    if (tree->compact_nodes)
+        return tree->compact_nodes[id].idx & RDT_COMPACT_LEAF_BIT;
+    else
+        return tree->nodes[id].label_pr_idx != 0;
+}
+
+static uint32_t
+get_left_child(RDTree* tree, uint32_t id)
+{
+    return tree->compact_nodes ?
+        tree->compact_nodes[id].idx : tree->nodes[id].left_idx;
+}
+
+static void
+indent(FILE* fp, int level)
+{
+    fprintf(fp, "%*s", 4 * (level + 1), "");
+}
+
+/* NB: %.9g is enough to exactly round-trip any float */
+static void
+emit_float(FILE* fp, float value)
+{
+    char buf[32];
+
+    if (isinf(value)) {
+        fprintf(fp, value < 0 ? "-INFINITY" : "INFINITY");
+        return;
+    }
+    if (isnan(value)) {
+        fprintf(fp, "NAN");
+        return;
+    }
+
+    snprintf(buf, sizeof(buf), "%.9g", value);
+    if (!strpbrk(buf, ".e"))
+        strcat(buf, ".0");
+    fprintf(fp, "%sf", buf);
+}
+
+static void
+emit_uv(FILE* fp, RDTree* tree, uint32_t id)
+{
+    fprintf(fp, "(UVPair){ ");
+    for (int i = 0; i < 4; i++) {
+        float value = tree->compact_nodes ?
+            half_bits_to_float(tree->compact_nodes[id].uv[i]) :
+            tree->nodes[id].uv[i];
+        emit_float(fp, value);
+        fprintf(fp, i < 3 ? ", " : " }");
+    }
+}
+
+static void
+emit_subtree(FILE* fp, RDTree* tree, uint32_t id, int level, int n_levels)
+{
+    if (level == n_levels || is_leaf(tree, id)) {
+        indent(fp, level);
+        fprintf(fp, "return %uu;\n", id);
+        return;
+    }
+
+    float t = tree->compact_nodes ?
+        tree->compact_nodes[id].t : tree->nodes[id].t;
+    uint32_t left = get_left_child(tree, id);
+
+    indent(fp, level);
+    fprintf(fp, "if (sample_uv_padded<FloatT>(depth_image, width, height, "
+            "pixel, depth,\n");
+    indent(fp, level);
+    fprintf(fp, "                             ");
+    emit_uv(fp, tree, id);
+    fprintf(fp, ") < ");
+    emit_float(fp, t);
+    fprintf(fp, ") {\n");
+    emit_subtree(fp, tree, left, level + 1, n_levels);
+    indent(fp, level);
+    fprintf(fp, "} else {\n");
+    emit_subtree(fp, tree, left + 1, level + 1, n_levels);
+    indent(fp, level);
+    fprintf(fp, "}\n");
+}
+
+static void
+emit_matched_nodes(FILE* fp, RDTree* tree, uint32_t id, int level,
+                   int n_levels)
+{
+    if (level == n_levels || is_leaf(tree, id))
+        return;
+
+    uint32_t left = get_left_child(tree, id);
+    if (tree->compact_nodes) {
+        RDTCompactNode* node = &tree->compact_nodes[id];
+        fprintf(fp, "        { %u, { %u, %u, %u, %u }, ", id,
+                node->uv[0], node->uv[1], node->uv[2], node->uv[3]);
+        emit_float(fp, node->t);
+        fprintf(fp, ", %uu },\n", node->idx);
+    } else {
+        Node* node = &tree->nodes[id];
+        fprintf(fp, "        { %u, { ", id);
+        for (int i = 0; i < 4; i++) {
+            emit_float(fp, node->uv[i]);
+            fprintf(fp, i < 3 ? ", " : " }, ");
+        }
+        emit_float(fp, node->t);
+        fprintf(fp, ", %uu },\n", node->left_idx);
+    }
+
+    emit_matched_nodes(fp, tree, left, level + 1, n_levels);
+    emit_matched_nodes(fp, tree, left + 1, level + 1, n_levels);
+}
+
+/* Emits a check that a loaded tree has the same structure, and the same
+ * split nodes within the unrolled levels, as the compiled tree
+ */
+static void
+emit_matches(FILE* fp, RDTree* tree, int index, int n_levels)
+{
+    bool compact = tree->compact_nodes != NULL;
+
+    fprintf(fp, "static bool\ntree_%d_matches(RDTree* tree)\n{\n", index);
+    fprintf(fp, "    static const struct {\n"
+                "        uint32_t id;\n");
+    if (compact) {
+        fprintf(fp, "        uint16_t uv[4];\n"
+                    "        float t;\n"
+                    "        uint32_t idx;\n");
+    } else {
+        fprintf(fp, "        float uv[4];\n"
+                    "        float t;\n"
+                    "        uint32_t left_idx;\n");
+    }
+    fprintf(fp, "    } nodes[] = {\n");
+    emit_matched_nodes(fp, tree, 0, 0, n_levels);
+    fprintf(fp, "    };\n\n");
+
+    fprintf(fp, "    if (tree->n_nodes != %uu || tree->header.depth != %u ||\n"
+                "        %stree->compact_nodes)\n"
+                "        return false;\n\n",
+            tree->n_nodes, tree->header.depth, compact ? "!" : "");
+
+    fprintf(fp, "    for (unsigned i = 0; i < sizeof(nodes) / sizeof(nodes[0]); "
+                "i++) {\n");
+    if (compact) {
+        fprintf(fp, "        RDTCompactNode* node = "
+                    "&tree->compact_nodes[nodes[i].id];\n"
+                    "        if (memcmp(node->uv, nodes[i].uv, "
+                    "sizeof(node->uv)) != 0 ||\n"
+                    "            node->t != nodes[i].t || "
+                    "node->idx != nodes[i].idx)\n"
+                    "            return false;\n");
+    } else {
+        fprintf(fp, "        Node* node = &tree->nodes[nodes[i].id];\n"
+                    "        if (node->label_pr_idx != 0 || "
+                    "node->t != nodes[i].t ||\n"
+                    "            node->left_idx != nodes[i].left_idx)\n"
+                    "            return false;\n"
+                    "        for (int j = 0; j < 4; j++) {\n"
+                    "            if (node->uv[j] != nodes[i].uv[j])\n"
+                    "                return false;\n"
+                    "        }\n");
+    }
+    fprintf(fp, "    }\n\n    return true;\n}\n\n");
+}
+
+static void
+emit_tree(FILE* fp, RDTree* tree, int index, int n_levels)
+{
+    emit_matches(fp, tree, index, n_levels);
+
+    fprintf(fp, "template<typename FloatT>\n"
+                "static inline uint32_t\n"
+                "tree_%d_eval(FloatT* depth_image, int width, int height,\n"
+                "            Int2D pixel, float depth)\n"
+                "{\n", index);
+    emit_subtree(fp, tree, 0, 0, n_levels);
+    fprintf(fp, "}\n\n");
+
+    fprintf(fp, "static uint32_t\n"
+                "tree_%d_eval_float(float* depth_image, int width, int height,\n"
+                "                  Int2D pixel, float depth)\n"
+                "{\n"
+                "    return tree_%d_eval<float>(depth_image, width, height,\n"
+                "                              pixel, depth);\n"
+                "}\n\n", index, index);
+    fprintf(fp, "static uint32_t\n"
+                "tree_%d_eval_half(half* depth_image, int width, int height,\n"
+                "                 Int2D pixel, float depth)\n"
+                "{\n"
+                "    return tree_%d_eval<half>(depth_image, width, height,\n"
+                "                             pixel, depth);\n"
+                "}\n\n", index, index);
+}
+
+static void
+usage(void)
+{
+    printf(
+"Usage rdt-compile [options] <out.cc> <tree0.rdt|tree0.json> [tree1...]\n"
+"\n"
+"    -l,--levels=N              Number of levels of each tree to unroll\n"
+"                               (default %d, max %d)\n"
+"    -c,--compact               Compile the trees in the compact node format\n"
+"    -h,--help                  Display this help\n\n"
+"\n"
+"This tool generates C++ source for a fixed forest with the top levels of\n"
+"each tree unrolled into straight-line code, with the u,v offsets and\n"
+"thresholds of each split baked in as constants. Inference continues by\n"
+"walking the tree as usual from the node reached after the unrolled levels.\n"
+"\n"
+"Build the generated source in with -Drdt_compiled_forest=<out.cc>. It's\n"
+"only used when the forest passed to infer_labels() matches the forest that\n"
+"was compiled (including whether the trees use the compact node format), and\n"
+"only by the scalar tree traversal.\n",
+    DEFAULT_LEVELS, MAX_LEVELS);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct gm_logger *log = gm_logger_new(NULL, NULL);
+    int opt;
+    int n_levels = DEFAULT_LEVELS;
+    bool compact = false;
+    const char *short_options="+l:ch";
+    const struct option long_options[] = {
+        {"levels",          required_argument,  0, 'l'},
+        {"compact",         no_argument,        0, 'c'},
+        {"help",            no_argument,        0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, short_options, long_options, NULL))
+           != -1)
+    {
+        switch (opt) {
+            case 'l':
+                n_levels = atoi(optarg);
+                if (n_levels < 1 || n_levels > MAX_LEVELS) {
+                    fprintf(stderr, "Levels must be between 1 and %d\n",
+                            MAX_LEVELS);
+                    return 1;
+                }
+                break;
+            case 'c':
+                compact = true;
+                break;
+            case 'h':
+                usage();
+                return 0;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (argc - optind < 2) {
+        usage();
+        return 1;
+    }
+
+    const char *out_file = argv[optind];
+    int n_trees = argc - optind - 1;
+    char *err = NULL;
+
+    FILE *fp = fopen(out_file, "w");
+    if (!fp) {
+        fprintf(stderr, "Failed to open %s for writing\n", out_file);
+        return 1;
+    }
+
+    fprintf(fp, "/* Generated by rdt-compile, do not edit */\n\n"
+                "#include <string.h>\n\n"
+                "#include \"rdt_compiled.h\"\n\n"
+                "using half_float::half;\n\n");
+
+    for (int i = 0; i < n_trees; i++) {
+        const char *in_file = argv[optind + 1 + i];
+        RDTree *tree;
+        int len = strlen(in_file);
+        if (len > 5 && strcmp(in_file + len - 5, ".json") == 0)
+            tree = rdt_tree_load_from_json_file(log, in_file, &err);
+        else
+            tree = rdt_tree_load_from_file(log, in_file, &err);
+        if (!tree) {
+            fprintf(stderr, "Failed to load %s: %s\n", in_file, err);
+            return 1;
+        }
+
+        if (compact && !tree->compact_nodes &&
+            !rdt_tree_compact(log, tree, &err))
+        {
+            fprintf(stderr, "Failed to compact %s: %s\n", in_file, err);
+            return 1;
+        }
+
+        fprintf(fp, "/* %s */\n\n", in_file);
+        emit_tree(fp, tree, i, n_levels);
+        rdt_tree_destroy(tree);
+    }
+
+    fprintf(fp, "static const RDTCompiledTree trees[] = {\n");
+    for (int i = 0; i < n_trees; i++) {
+        fprintf(fp, "    { tree_%d_matches, tree_%d_eval_float, "
+                "tree_%d_eval_half },\n", i, i, i);
+    }
+    fprintf(fp, "};\n\n");
+
+    fprintf(fp, "const RDTCompiledForest rdt_compiled_forest = {\n"
+                "    %d, %d, trees\n"
+                "};\n", n_trees, n_levels);
+
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "Failed to write %s\n", out_file);
+        return 1;
+    }
+
+    printf("Compiled %d trees, with %d levels unrolled, to %s\n",
+           n_trees, n_levels, out_file);
+
+    return 0;
+}
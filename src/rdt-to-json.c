@@ -25,6 +25,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <limits.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,7 +37,27 @@
 #include "rdt_tree.h"
 
 static JSON_Value*
-recursive_build_tree(RDTree* tree, Node* node, int depth, int id)
+build_pr_table_json(RDTree* tree, uint32_t pr_idx)
+{
+    JSON_Value* probs_val = json_value_init_array();
+    JSON_Array* probs = json_array(probs_val);
+
+    /* NB: pr_idx is a base-one index since index zero is reserved to
+     * indicate that the node has no table
+     */
+    float* pr_table = &tree->label_pr_tables[(pr_idx - 1) *
+        tree->header.n_labels];
+
+    for (int i = 0; i < tree->header.n_labels; i++)
+    {
+        json_array_append_number(probs, pr_table[i]);
+    }
+
+    return probs_val;
+}
+
+static JSON_Value*
+recursive_build_tree(RDTree* tree, Node* node, int depth)
 {
     JSON_Value* json_node_val = json_value_init_object();
     JSON_Object* json_node = json_object(json_node_val);
@@ -57,46 +78,33 @@ recursive_build_tree(RDTree* tree, Node* node, int depth, int id)
         json_array_append_number(v, node->uv[3]);
         json_object_set_value(json_node, "v", v_val);
 
+        if (node->split_pr_idx)
+        {
+            json_object_set_value(json_node, "q",
+                                  build_pr_table_json(tree,
+                                                      node->split_pr_idx));
+        }
+
         if (depth < (tree->header.depth - 1))
         {
-            /* NB: The nodes in .rdt files are in a packed array arranged in
-             * breadth-first, left then right child order with the root node at
-             * index zero.
-             *
-             * With this layout then given an index for any particular node
-             * ('id' here) then 2 * id + 1 is the index for the left child and
-             * 2 * id + 2 is the index for the right child...
+            /* NB: The right child always immediately follows the left
+             * child
              */
-            int left_id = id * 2 + 1;
-            Node* left_node = tree->nodes + left_id;
-            int right_id = id * 2 + 2;
-            Node* right_node = tree->nodes + right_id;
+            Node* left_node = tree->nodes + node->left_idx;
+            Node* right_node = left_node + 1;
 
             JSON_Value* left_json = recursive_build_tree(tree, left_node,
-                                                         depth + 1, left_id);
+                                                         depth + 1);
             json_object_set_value(json_node, "l", left_json);
             JSON_Value* right_json = recursive_build_tree(tree, right_node,
-                                                          depth + 1, right_id);
+                                                          depth + 1);
             json_object_set_value(json_node, "r", right_json);
         }
     }
-    else
+    else if (node->label_pr_idx != INT_MAX) // Return empty obj for untrained nodes
     {
-        JSON_Value* probs_val = json_value_init_array();
-        JSON_Array* probs = json_array(probs_val);
-
-        /* NB: node->label_pr_idx is a base-one index since index zero is
-         * reserved to indicate that the node is not a leaf node
-         */
-        float* pr_table = &tree->label_pr_tables[(node->label_pr_idx - 1) *
-            tree->header.n_labels];
-
-        for (int i = 0; i < tree->header.n_labels; i++)
-        {
-            json_array_append_number(probs, pr_table[i]);
-        }
-
-        json_object_set_value(json_node, "p", probs_val);
+        json_object_set_value(json_node, "p",
+                              build_pr_table_json(tree, node->label_pr_idx));
     }
 
     return json_node_val;
@@ -113,7 +121,7 @@ save_tree_json(RDTree* tree, const char* filename, bool pretty)
     json_object_set_number(json_object(root), "n_labels", tree->header.n_labels);
     json_object_set_number(json_object(root), "bg_label", tree->header.bg_label);
 
-    JSON_Value *nodes = recursive_build_tree(tree, tree->nodes, 0, 0);
+    JSON_Value *nodes = recursive_build_tree(tree, tree->nodes, 0);
 
     json_object_set_value(json_object(root), "root", nodes);
 
@@ -215,5 +223,15 @@ main(int argc, char **argv)
     if (!tree)
         return 1;
 
+    if (!tree->nodes) {
+        fprintf(stderr, "Can't convert a tree in the compact node format\n");
+        return 1;
+    }
+
+    if (!tree->label_pr_tables) {
+        fprintf(stderr, "Can't convert a tree with quantized tables\n");
+        return 1;
+    }
+
     return save_tree_json(tree, argv[optind+1], pretty) ? 0 : 1;
 }
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2017 Glimp IP Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "half.hpp"
+
+#include "rdt_tree.h"
+#include "utils.h"
+
+/* Evaluators for the top levels of the trees of a fixed forest, generated
+ * as straight-line code by the rdt-compile tool and built in with the
+ * rdt_compiled_forest Meson option.
+ *
+ * Each evaluator returns the index of the node reached after the unrolled
+ * levels (which may be a leaf), in the same node format as the tree that
+ * was compiled, so inference can continue walking the tree from there.
+ */
+typedef struct {
+    /* Checks that a loaded tree matches the tree that was compiled */
+    bool (*matches)(RDTree* tree);
+
+    uint32_t (*eval_float)(float* depth_image, int width, int height,
+                           Int2D pixel, float depth);
+    uint32_t (*eval_half)(half_float::half* depth_image, int width, int height,
+                          Int2D pixel, float depth);
+} RDTCompiledTree;
+
+typedef struct {
+    int n_trees;
+    int n_levels;
+    const RDTCompiledTree* trees;
+} RDTCompiledForest;
+
+/* Defined by the generated source, which is only built in (with
+ * USE_RDT_COMPILED defined) if the rdt_compiled_forest option is set
+ */
+extern const RDTCompiledForest rdt_compiled_forest;
+
+template<typename FloatT>
+inline uint32_t
+rdt_compiled_tree_eval(const RDTCompiledTree* tree, FloatT* depth_image,
+                       int width, int height, Int2D pixel, float depth);
+
+template<>
+inline uint32_t
+rdt_compiled_tree_eval<float>(const RDTCompiledTree* tree, float* depth_image,
+                              int width, int height, Int2D pixel, float depth)
+{
+    return tree->eval_float(depth_image, width, height, pixel, depth);
+}
+
+template<>
+inline uint32_t
+rdt_compiled_tree_eval<half_float::half>(const RDTCompiledTree* tree,
+                                         half_float::half* depth_image,
+                                         int width, int height,
+                                         Int2D pixel, float depth)
+{
+    return tree->eval_half(depth_image, width, height, pixel, depth);
+}
@@ -31,6 +31,11 @@
 #include <math.h>
 #include <cstddef>
 
+#include <algorithm>
+#include <vector>
+
+#include "half.hpp"
+
 #include "rdt_tree.h"
 #include "parson.h"
 #include "xalloc.h"
@@ -41,48 +46,98 @@ assert_rdt_abi()
     static_assert(sizeof(RDTHeader) == 11, "RDT ABI Breakage");
     static_assert(sizeof(Node) == 32,      "RDT ABI Breakage");
     static_assert(offsetof(Node, t) == 16, "RDT ABI Breakage");
+    static_assert(offsetof(Node, left_idx) == 24, "RDT ABI Breakage");
+    static_assert(offsetof(Node, split_pr_idx) == 28, "RDT ABI Breakage");
+    static_assert(sizeof(RDTExtHeader) == 16, "RDT ABI Breakage");
+    static_assert(sizeof(RDTCompactNode) == 16, "RDT ABI Breakage");
 }
 
-static int
-count_pr_tables(JSON_Object* node)
+static size_t
+get_table_element_size(int table_format)
 {
-    if (json_object_has_value(node, "p"))
+    switch (table_format)
     {
-        return 1;
+    case RDT_TABLE_FORMAT_FLOAT:
+        return sizeof(float);
+    case RDT_TABLE_FORMAT_U8:
+        return sizeof(uint8_t);
+    case RDT_TABLE_FORMAT_U16:
+        return sizeof(uint16_t);
+    default:
+        return 0;
     }
+}
 
-    return count_pr_tables(json_object_get_object(node, "l")) +
-        count_pr_tables(json_object_get_object(node, "r"));
+static bool
+json_node_is_split(JSON_Object* jnode)
+{
+    return json_object_get_array(jnode, "u") &&
+        json_object_get_array(jnode, "v");
 }
 
+/* NB: untrained nodes are represented as empty objects, and split nodes
+ * may have a label distribution "q", like the "p" of leaf nodes
+ */
 static void
-unpack_json_tree(JSON_Object* jnode, Node* nodes, int node_index,
-                 float* pr_tables, int* table_index, int n_labels)
+count_json_nodes(JSON_Object* jnode, int* n_nodes, int* n_pr_tables)
 {
-    Node* node = &nodes[node_index];
+    (*n_nodes)++;
 
     if (json_object_has_value(jnode, "p"))
     {
-        float* pr_table = &pr_tables[(*table_index) * n_labels];
-
-        JSON_Array* p = json_object_get_array(jnode, "p");
-        for (int i = 0; i < n_labels; i++)
+        (*n_pr_tables)++;
+    }
+    else if (json_node_is_split(jnode))
+    {
+        if (json_object_has_value(jnode, "q"))
         {
-            pr_table[i] = (float)json_array_get_number(p, i);
+            (*n_pr_tables)++;
         }
+        count_json_nodes(json_object_get_object(jnode, "l"),
+                         n_nodes, n_pr_tables);
+        count_json_nodes(json_object_get_object(jnode, "r"),
+                         n_nodes, n_pr_tables);
+    }
+}
 
+/* Returns the (1-based) index of the table */
+static int
+unpack_json_pr_table(JSON_Array* p, float* pr_tables, int* table_index,
+                     int n_labels)
+{
+    float* pr_table = &pr_tables[(*table_index) * n_labels];
+
+    for (int i = 0; i < n_labels; i++)
+    {
+        pr_table[i] = (float)json_array_get_number(p, i);
+    }
+
+    return ++(*table_index);
+}
+
+static void
+unpack_json_tree(JSON_Object* jnode, Node* nodes, int node_index,
+                 int* n_nodes, float* pr_tables, int* table_index,
+                 int n_labels)
+{
+    Node* node = &nodes[node_index];
+
+    if (json_object_has_value(jnode, "p"))
+    {
         // Write out probability table
-        node->label_pr_idx = ++(*table_index);
+        node->label_pr_idx =
+            unpack_json_pr_table(json_object_get_array(jnode, "p"),
+                                 pr_tables, table_index, n_labels);
         return;
     }
 
-    JSON_Array* u = json_object_get_array(jnode, "u");
-    JSON_Array* v = json_object_get_array(jnode, "v");
-
-    if (u == NULL || v == NULL) {
+    if (!json_node_is_split(jnode)) {
         return;
     }
 
+    JSON_Array* u = json_object_get_array(jnode, "u");
+    JSON_Array* v = json_object_get_array(jnode, "v");
+
     node->uv[0] = json_array_get_number(u, 0);
     node->uv[1] = json_array_get_number(u, 1);
     node->uv[2] = json_array_get_number(v, 0);
@@ -90,10 +145,66 @@ unpack_json_tree(JSON_Object* jnode, Node* nodes, int node_index,
     node->t = json_object_get_number(jnode, "t");
     node->label_pr_idx = 0;
 
+    if (json_object_has_value(jnode, "q"))
+    {
+        node->split_pr_idx =
+            unpack_json_pr_table(json_object_get_array(jnode, "q"),
+                                 pr_tables, table_index, n_labels);
+    }
+
+    /* Children are allocated in pairs so the right child immediately
+     * follows the left child
+     */
+    int left_index = *n_nodes;
+    node->left_idx = left_index;
+    *n_nodes += 2;
+
     unpack_json_tree(json_object_get_object(jnode, "l"), nodes,
-                     node_index * 2 + 1, pr_tables, table_index, n_labels);
+                     left_index, n_nodes, pr_tables, table_index, n_labels);
     unpack_json_tree(json_object_get_object(jnode, "r"), nodes,
-                     node_index * 2 + 2, pr_tables, table_index, n_labels);
+                     left_index + 1, n_nodes, pr_tables, table_index,
+                     n_labels);
+}
+
+/* Converts a complete, breadth-first array of nodes, where the children of
+ * node 'id' are at 2 * id + 1 and 2 * id + 2, to the sparse layout of only
+ * the nodes reachable from the root with explicit child indices
+ */
+static Node*
+unpack_full_nodes(const Node* full_nodes, uint32_t n_full_nodes,
+                  uint32_t* n_nodes)
+{
+    std::vector<uint32_t> src_ids;
+    src_ids.push_back(0);
+
+    std::vector<Node> nodes;
+    for (size_t i = 0; i < src_ids.size(); i++)
+    {
+        uint32_t id = src_ids[i];
+        Node node = full_nodes[id];
+
+        /* NB: these were alignment padding in the full format */
+        node.left_idx = 0;
+        node.split_pr_idx = 0;
+        if (node.label_pr_idx == 0)
+        {
+            if (2 * (uint64_t)id + 2 >= n_full_nodes)
+            {
+                return NULL;
+            }
+            node.left_idx = src_ids.size();
+            src_ids.push_back(2 * id + 1);
+            src_ids.push_back(2 * id + 2);
+        }
+
+        nodes.push_back(node);
+    }
+
+    Node* ret = (Node*)xmalloc(nodes.size() * sizeof(Node));
+    memcpy(ret, nodes.data(), nodes.size() * sizeof(Node));
+    *n_nodes = nodes.size();
+
+    return ret;
 }
 
 void
@@ -103,10 +214,18 @@ rdt_tree_destroy(RDTree* tree)
     {
         xfree(tree->nodes);
     }
+    if (tree->compact_nodes)
+    {
+        xfree(tree->compact_nodes);
+    }
     if (tree->label_pr_tables)
     {
         xfree(tree->label_pr_tables);
     }
+    if (tree->quantized_pr_tables)
+    {
+        xfree(tree->quantized_pr_tables);
+    }
     xfree(tree);
 }
 
@@ -144,13 +263,15 @@ rdt_tree_load_from_json(struct gm_logger* log,
     tree->header.bg_label = (uint8_t)json_object_get_number(json_tree, "bg_label");
     tree->header.fov = (float)json_object_get_number(json_tree, "vertical_fov");
 
-    // Count probability arrays
-    int n_pr_tables = root ? count_pr_tables(root) : 0;
+    // Count nodes and probability arrays
+    int n_nodes = 0;
+    int n_pr_tables = 0;
+    count_json_nodes(root, &n_nodes, &n_pr_tables);
     tree->n_pr_tables = n_pr_tables;
 
     // Allocate tree structure
-    int n_nodes = (1<<tree->header.depth) - 1;
-    tree->nodes = (Node*)xmalloc(n_nodes * sizeof(Node));
+    tree->n_nodes = n_nodes;
+    tree->nodes = (Node*)xcalloc(n_nodes, sizeof(Node));
 
     /* In case we don't have a complete tree we need to initialize label_pr_idx
      * to imply that the node has not been trained yet
@@ -162,8 +283,10 @@ rdt_tree_load_from_json(struct gm_logger* log,
         xmalloc(n_pr_tables * tree->header.n_labels * sizeof(float));
 
     // Copy over nodes and probability tables
+    int node_index = 1;
     int table_index = 0;
-    unpack_json_tree(root, tree->nodes, 0, tree->label_pr_tables, &table_index,
+    unpack_json_tree(root, tree->nodes, 0, &node_index,
+                     tree->label_pr_tables, &table_index,
                      tree->header.n_labels);
 
     return tree;
@@ -213,36 +336,110 @@ rdt_tree_load_from_buf(struct gm_logger* log,
         return NULL;
     }
 
-    if (tree->header.version != RDT_VERSION)
+    /* Version 4 trees only consist of a complete, breadth-first array of
+     * full nodes followed by the label probability tables
+     */
+    RDTExtHeader ext = {};
+    if (tree->header.version == 4)
+    {
+        ext.node_format = RDT_NODE_FORMAT_FULL;
+        ext.n_nodes = (1<<tree->header.depth) - 1;
+    }
+    else if (tree->header.version == RDT_VERSION)
+    {
+        if ((size_t)len < sizeof(RDTExtHeader))
+        {
+            fprintf(stderr, "Buffer too small to contain tree\n");
+            rdt_tree_destroy(tree);
+            return NULL;
+        }
+        memcpy(&ext, tree_buf, sizeof(RDTExtHeader));
+        tree_buf += sizeof(RDTExtHeader);
+        len -= sizeof(RDTExtHeader);
+    }
+    else
     {
-        fprintf(stderr, "Incompatible RDT version, expected %u, found %u\n",
+        fprintf(stderr, "Incompatible RDT version, expected <= %u, found %u\n",
                 RDT_VERSION, (unsigned)tree->header.version);
         rdt_tree_destroy(tree);
         return NULL;
     }
 
     // Read in the decision tree nodes
-    int n_nodes = (1<<tree->header.depth) - 1;
-    tree->nodes = (Node*)xmalloc(n_nodes * sizeof(Node));
-    if ((size_t)len < (sizeof(Node) * n_nodes))
+    size_t node_size;
+    switch (ext.node_format)
+    {
+    case RDT_NODE_FORMAT_FULL:
+        if (ext.n_nodes != (uint32_t)(1<<tree->header.depth) - 1)
+        {
+            fprintf(stderr, "Unexpected number of tree nodes\n");
+            rdt_tree_destroy(tree);
+            return NULL;
+        }
+        node_size = sizeof(Node);
+        break;
+    case RDT_NODE_FORMAT_SPARSE:
+        node_size = sizeof(Node);
+        break;
+    case RDT_NODE_FORMAT_COMPACT:
+        node_size = sizeof(RDTCompactNode);
+        break;
+    default:
+        fprintf(stderr, "Unknown RDT node format %u\n",
+                (unsigned)ext.node_format);
+        rdt_tree_destroy(tree);
+        return NULL;
+    }
+
+    tree->n_nodes = ext.n_nodes;
+    if ((size_t)len < (node_size * ext.n_nodes))
     {
         fprintf(stderr, "Error parsing tree nodes\n");
         rdt_tree_destroy(tree);
         return NULL;
     }
-    memcpy(tree->nodes, tree_buf, sizeof(Node) * n_nodes);
-    tree_buf += sizeof(Node) * n_nodes;
-    len -= sizeof(Node) * n_nodes;
+    void* nodes = xmalloc(node_size * ext.n_nodes);
+    memcpy(nodes, tree_buf, node_size * ext.n_nodes);
+    if (ext.node_format == RDT_NODE_FORMAT_COMPACT)
+    {
+        tree->compact_nodes = (RDTCompactNode*)nodes;
+    }
+    else if (ext.node_format == RDT_NODE_FORMAT_FULL)
+    {
+        tree->nodes = unpack_full_nodes((Node*)nodes, ext.n_nodes,
+                                        &tree->n_nodes);
+        xfree(nodes);
+        if (!tree->nodes)
+        {
+            fprintf(stderr, "Tree has split nodes without children\n");
+            rdt_tree_destroy(tree);
+            return NULL;
+        }
+    }
+    else
+    {
+        tree->nodes = (Node*)nodes;
+    }
+    tree_buf += node_size * ext.n_nodes;
+    len -= node_size * ext.n_nodes;
 
     // Read in the label probabilities
+    size_t element_size = get_table_element_size(ext.table_format);
+    if (!element_size)
+    {
+        fprintf(stderr, "Unknown RDT table format %u\n",
+                (unsigned)ext.table_format);
+        rdt_tree_destroy(tree);
+        return NULL;
+    }
     int label_bytes = len;
-    if (label_bytes % sizeof(float) != 0)
+    if (label_bytes % element_size != 0)
     {
         fprintf(stderr, "Unexpected size of label probability tables\n");
         rdt_tree_destroy(tree);
         return NULL;
     }
-    int n_prs = label_bytes / sizeof(float);
+    int n_prs = label_bytes / element_size;
     if (n_prs % tree->header.n_labels != 0)
     {
         fprintf(stderr, "Unexpected number of label probabilities\n");
@@ -250,11 +447,61 @@ rdt_tree_load_from_buf(struct gm_logger* log,
         return NULL;
     }
     int n_tables = n_prs / tree->header.n_labels;
+    if (tree->header.version >= 5 && (uint32_t)n_tables != ext.n_pr_tables)
+    {
+        fprintf(stderr, "Unexpected number of label probability tables\n");
+        rdt_tree_destroy(tree);
+        return NULL;
+    }
 
     tree->n_pr_tables = n_tables;
-    tree->label_pr_tables = (float*)xmalloc(label_bytes);
-    memcpy(tree->label_pr_tables, tree_buf,
-           sizeof(float) * tree->header.n_labels * n_tables);
+    tree->table_format = ext.table_format;
+    tree->table_scale = ext.table_scale;
+    void* tables = xmalloc(label_bytes);
+    memcpy(tables, tree_buf, element_size * tree->header.n_labels * n_tables);
+    if (ext.table_format == RDT_TABLE_FORMAT_FLOAT)
+    {
+        tree->label_pr_tables = (float*)tables;
+    }
+    else
+    {
+        tree->quantized_pr_tables = tables;
+    }
+
+    /* Make sure we can trust the child indices of nodes and the table
+     * indices of compact nodes without checking them during inference
+     */
+    if (tree->nodes)
+    {
+        for (uint32_t i = 0; i < tree->n_nodes; i++)
+        {
+            Node* node = &tree->nodes[i];
+            if (node->label_pr_idx == 0 &&
+                (node->left_idx <= i || node->left_idx >= tree->n_nodes - 1 ||
+                 node->split_pr_idx > tree->n_pr_tables))
+            {
+                fprintf(stderr, "Invalid index in tree node %u\n", i);
+                rdt_tree_destroy(tree);
+                return NULL;
+            }
+        }
+    }
+    else
+    {
+        for (uint32_t i = 0; i < tree->n_nodes; i++)
+        {
+            uint32_t idx = tree->compact_nodes[i].idx;
+            bool valid = (idx & RDT_COMPACT_LEAF_BIT) ?
+                (idx & ~RDT_COMPACT_LEAF_BIT) < tree->n_pr_tables :
+                (idx > i && idx + 1 < tree->n_nodes);
+            if (!valid)
+            {
+                fprintf(stderr, "Invalid index in compact tree node %u\n", i);
+                rdt_tree_destroy(tree);
+                return NULL;
+            }
+        }
+    }
 
     return tree;
 }
@@ -298,7 +545,10 @@ rdt_tree_load_from_file(struct gm_logger* log,
 bool
 rdt_tree_save(RDTree* tree, const char* filename)
 {
+    RDTHeader header;
+    RDTExtHeader ext = {};
     int n_nodes;
+    size_t n_written;
     bool success;
     FILE* output;
 
@@ -309,20 +559,46 @@ rdt_tree_save(RDTree* tree, const char* filename)
     }
 
     success = false;
-    if (fwrite(&tree->header, sizeof(RDTHeader), 1, output) != 1)
+    header = tree->header;
+    header.version = RDT_VERSION;
+    if (fwrite(&header, sizeof(RDTHeader), 1, output) != 1)
     {
         fprintf(stderr, "Error writing header\n");
         goto save_tree_close;
     }
 
-    n_nodes = (1<<tree->header.depth) - 1;
-    if (fwrite(tree->nodes, sizeof(Node), n_nodes, output) != (size_t)n_nodes)
+    ext.node_format = tree->compact_nodes ?
+        RDT_NODE_FORMAT_COMPACT : RDT_NODE_FORMAT_SPARSE;
+    ext.table_format = tree->table_format;
+    ext.table_scale = tree->table_scale;
+    ext.n_nodes = tree->n_nodes;
+    ext.n_pr_tables = tree->n_pr_tables;
+    if (fwrite(&ext, sizeof(RDTExtHeader), 1, output) != 1)
+    {
+        fprintf(stderr, "Error writing header\n");
+        goto save_tree_close;
+    }
+
+    n_nodes = tree->n_nodes;
+    if (tree->compact_nodes)
+    {
+        n_written = fwrite(tree->compact_nodes, sizeof(RDTCompactNode),
+                           n_nodes, output);
+    }
+    else
+    {
+        n_written = fwrite(tree->nodes, sizeof(Node), n_nodes, output);
+    }
+    if (n_written != (size_t)n_nodes)
     {
         fprintf(stderr, "Error writing tree nodes\n");
         goto save_tree_close;
     }
 
-    if (fwrite(tree->label_pr_tables, sizeof(float) * tree->header.n_labels,
+    if (fwrite(tree->label_pr_tables ?
+               tree->label_pr_tables : tree->quantized_pr_tables,
+               get_table_element_size(tree->table_format) *
+               tree->header.n_labels,
                tree->n_pr_tables, output) != (size_t)tree->n_pr_tables)
     {
         fprintf(stderr, "Error writing tree probability tables\n");
@@ -341,6 +617,260 @@ save_tree_close:
     return success;
 }
 
+/* Appends the sibling pairs (each identified by the id of its left node)
+ * that are 'depth' levels below the given pair
+ */
+static void
+collect_descendant_pairs(RDTree* tree, uint32_t pair, int depth,
+                         std::vector<uint32_t>& pairs)
+{
+    if (depth == 0)
+    {
+        pairs.push_back(pair);
+        return;
+    }
+
+    for (uint32_t id = pair; id < pair + 2; id++)
+    {
+        Node* node = &tree->nodes[id];
+        if (node->label_pr_idx == 0)
+        {
+            collect_descendant_pairs(tree, node->left_idx, depth - 1, pairs);
+        }
+    }
+}
+
+/* Appends the sibling pairs of the (at most) 'height' levels of pairs rooted
+ * at the given pair in van Emde Boas order: the top half of the levels are
+ * laid out recursively, followed by each of the subtrees hanging below them.
+ *
+ * Whatever the size of a cache line or page, a walk from the root then only
+ * crosses into a new block about once per log2(block size) levels, instead
+ * of once per level below the first few levels with a breadth-first order.
+ */
+static void
+layout_pairs_veb(RDTree* tree, uint32_t pair, int height,
+                 std::vector<uint32_t>& order)
+{
+    if (height == 1)
+    {
+        order.push_back(pair);
+        return;
+    }
+
+    int top_height = height / 2;
+    layout_pairs_veb(tree, pair, top_height, order);
+
+    std::vector<uint32_t> bottom;
+    collect_descendant_pairs(tree, pair, top_height, bottom);
+    for (uint32_t bottom_pair : bottom)
+    {
+        layout_pairs_veb(tree, bottom_pair, height - top_height, order);
+    }
+}
+
+bool
+rdt_tree_compact(struct gm_logger* log,
+                 RDTree* tree,
+                 char** err)
+{
+    if (tree->compact_nodes)
+    {
+        return true;
+    }
+
+    /* Check every node reachable from the root can be compacted and find
+     * the number of levels of sibling pairs below the root
+     */
+    int n_pair_levels = 0;
+    std::vector<std::pair<uint32_t, int>> stack;
+    stack.push_back(std::make_pair(0u, 0));
+    while (!stack.empty())
+    {
+        uint32_t id = stack.back().first;
+        int level = stack.back().second;
+        Node* node = &tree->nodes[id];
+        stack.pop_back();
+
+        if (node->label_pr_idx == INT_MAX)
+        {
+            gm_throw(log, err, "Can't compact tree with untrained node %u\n",
+                     id);
+            return false;
+        }
+
+        if (node->label_pr_idx == 0)
+        {
+            uint32_t left_idx = node->left_idx;
+            if (left_idx <= id || left_idx >= tree->n_nodes - 1)
+            {
+                gm_throw(log, err, "Internal node %u has no children\n", id);
+                return false;
+            }
+
+            n_pair_levels = std::max(n_pair_levels, level + 1);
+            stack.push_back(std::make_pair(left_idx, level + 1));
+            stack.push_back(std::make_pair(left_idx + 1, level + 1));
+        }
+    }
+
+    /* The right child always immediately follows the left child, so the
+     * nodes are laid out as sibling pairs following the root node.
+     */
+    std::vector<uint32_t> pair_order;
+    if (n_pair_levels)
+    {
+        layout_pairs_veb(tree, tree->nodes[0].left_idx, n_pair_levels,
+                         pair_order);
+    }
+
+    std::vector<uint32_t> src_ids;
+    src_ids.reserve(1 + pair_order.size() * 2);
+    src_ids.push_back(0);
+    for (uint32_t pair : pair_order)
+    {
+        src_ids.push_back(pair);
+        src_ids.push_back(pair + 1);
+    }
+
+    std::vector<uint32_t> new_ids(tree->n_nodes);
+    for (size_t i = 0; i < src_ids.size(); i++)
+    {
+        new_ids[src_ids[i]] = i;
+    }
+
+    /* Only the leaf tables are kept (without any split node tables) */
+    size_t table_size = get_table_element_size(tree->table_format) *
+        tree->header.n_labels;
+    uint8_t* src_tables = (uint8_t*)(tree->label_pr_tables ?
+        (void*)tree->label_pr_tables : tree->quantized_pr_tables);
+    uint8_t* leaf_tables = (uint8_t*)xmalloc(tree->n_pr_tables * table_size);
+    uint32_t n_leaf_tables = 0;
+
+    std::vector<RDTCompactNode> compact(src_ids.size());
+    for (size_t i = 0; i < src_ids.size(); i++)
+    {
+        uint32_t id = src_ids[i];
+        Node* node = &tree->nodes[id];
+        RDTCompactNode& out = compact[i];
+
+        if (node->label_pr_idx)
+        {
+            memcpy(leaf_tables + n_leaf_tables * table_size,
+                   src_tables + (node->label_pr_idx - 1) * table_size,
+                   table_size);
+            out.idx = RDT_COMPACT_LEAF_BIT | n_leaf_tables++;
+        }
+        else
+        {
+            out.idx = new_ids[node->left_idx];
+
+            for (int n = 0; n < 4; n++)
+            {
+                out.uv[n] = half_float::detail::
+                    float2half<std::round_to_nearest>(node->uv[n]);
+            }
+            out.t = node->t;
+        }
+    }
+
+    tree->compact_nodes = (RDTCompactNode*)
+        xmalloc(compact.size() * sizeof(RDTCompactNode));
+    memcpy(tree->compact_nodes, compact.data(),
+           compact.size() * sizeof(RDTCompactNode));
+    tree->n_nodes = compact.size();
+
+    xfree(tree->nodes);
+    tree->nodes = NULL;
+
+    xfree(src_tables);
+    if (tree->label_pr_tables)
+    {
+        tree->label_pr_tables = (float*)leaf_tables;
+    }
+    else
+    {
+        tree->quantized_pr_tables = leaf_tables;
+    }
+    tree->n_pr_tables = n_leaf_tables;
+
+    return true;
+}
+
+bool
+rdt_tree_quantize(struct gm_logger* log,
+                  RDTree* tree,
+                  int table_format,
+                  char** err)
+{
+    if (tree->table_format == table_format)
+    {
+        return true;
+    }
+
+    if (!tree->label_pr_tables)
+    {
+        gm_throw(log, err, "Can't re-quantize a quantized tree\n");
+        return false;
+    }
+
+    uint32_t max_value;
+    switch (table_format)
+    {
+    case RDT_TABLE_FORMAT_U8:
+        max_value = UINT8_MAX;
+        break;
+    case RDT_TABLE_FORMAT_U16:
+        max_value = UINT16_MAX;
+        break;
+    default:
+        gm_throw(log, err, "Unsupported table format %d\n", table_format);
+        return false;
+    }
+
+    /* Probabilities are in [0,1] so we use the same scale for all trees,
+     * which means the quantized values from each tree of a forest can be
+     * summed together as integers.
+     */
+    float scale = 1.f / max_value;
+
+    size_t n_values = (size_t)tree->n_pr_tables * tree->header.n_labels;
+    void* tables = xmalloc(n_values * get_table_element_size(table_format));
+    for (size_t i = 0; i < n_values; i++)
+    {
+        float value = roundf(tree->label_pr_tables[i] / scale);
+        uint32_t q = (uint32_t)std::min(std::max(value, 0.f),
+                                        (float)max_value);
+        if (table_format == RDT_TABLE_FORMAT_U8)
+        {
+            ((uint8_t*)tables)[i] = q;
+        }
+        else
+        {
+            ((uint16_t*)tables)[i] = q;
+        }
+    }
+
+    xfree(tree->label_pr_tables);
+    tree->label_pr_tables = NULL;
+    tree->quantized_pr_tables = tables;
+    tree->table_format = table_format;
+    tree->table_scale = scale;
+
+    return true;
+}
+
+size_t
+rdt_tree_get_size(RDTree* tree)
+{
+    size_t node_size = tree->compact_nodes ?
+        sizeof(RDTCompactNode) : sizeof(Node);
+
+    return tree->n_nodes * node_size +
+        tree->n_pr_tables * tree->header.n_labels *
+        get_table_element_size(tree->table_format);
+}
+
 static bool
 check_forest_consistency(struct gm_logger* log,
                          RDTree** forest,
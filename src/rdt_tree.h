@@ -35,18 +35,63 @@
 
 #define vector(type,size) type __attribute__ ((vector_size(sizeof(type)*(size))))
 
-#define RDT_VERSION 4
+#define RDT_VERSION 5
 
+/* Node formats for version >= 5 trees (see RDTExtHeader)
+ *
+ * The full format is a complete, breadth-first array of 2^depth - 1 nodes
+ * which is only supported for loading, and is converted to the sparse
+ * format as it's loaded.
+ */
+#define RDT_NODE_FORMAT_FULL     0
+#define RDT_NODE_FORMAT_COMPACT  1
+#define RDT_NODE_FORMAT_SPARSE   2
+
+/* Label probability table formats for version >= 5 trees */
+#define RDT_TABLE_FORMAT_FLOAT   0
+#define RDT_TABLE_FORMAT_U8      1
+#define RDT_TABLE_FORMAT_U16     2
+
+/* Set in RDTCompactNode::idx to indicate a leaf node */
+#define RDT_COMPACT_LEAF_BIT     0x80000000
+
+/* Only nodes that are reachable from the root are stored, and the children
+ * of a split node are explicitly indexed, with the right child always
+ * immediately following the left child.
+ *
+ * Split nodes may also have the label distribution of all the training
+ * pixels that reached them, so inference can stop at a limited depth.
+ *
+ * Nodes that haven't been trained yet have a label_pr_idx of INT_MAX and
+ * no children.
+ */
 typedef struct {
     /* XXX: Note that (at least with gcc) then uv will have a 16 byte
-     * aligment resulting in a total struct size of 32 bytes with 4 bytes
-     * alignment padding at the end
+     * aligment resulting in a total struct size of 32 bytes, which leaves
+     * room for the child and split table indices without any padding
      */
     vector(float,4) uv;     // U in [0:2] and V in [2:4]
     float t;                // Threshold
     uint32_t label_pr_idx;  // Index into label probability table (1-based)
+    uint32_t left_idx;      // Left child index, if label_pr_idx == 0
+    uint32_t split_pr_idx;  // Like label_pr_idx for split nodes (0 if none)
 } Node;
 
+/* A 16 byte, inference-only node representation.
+ *
+ * Like Node, only nodes that are reachable from the root are stored, but
+ * the leaf table index and child index share a single field.
+ *
+ * If RDT_COMPACT_LEAF_BIT is set in idx then the remaining bits are a
+ * (zero-based) index into the label probability tables. Otherwise idx is
+ * the index of the left child and the right child immediately follows.
+ */
+typedef struct {
+    uint16_t uv[4];         // Half-float U in [0:2] and V in [2:4]
+    float t;                // Threshold
+    uint32_t idx;           // Leaf table index or left child index
+} RDTCompactNode;
+
 typedef struct __attribute__((__packed__)) {
     char    tag[3];
     uint8_t version;
@@ -56,11 +101,26 @@ typedef struct __attribute__((__packed__)) {
     float   fov;
 } RDTHeader;
 
+/* Follows the RDTHeader for version >= 5 trees */
+typedef struct __attribute__((__packed__)) {
+    uint8_t  node_format;
+    uint8_t  table_format;
+    uint8_t  reserved[2];
+    float    table_scale;   // Probability = quantized value * table_scale
+    uint32_t n_nodes;
+    uint32_t n_pr_tables;
+} RDTExtHeader;
+
 typedef struct {
     RDTHeader header;
-    Node* nodes;
+    uint32_t n_nodes;
+    Node* nodes;                    // NULL for compact trees
+    RDTCompactNode* compact_nodes;  // NULL unless compact
     uint32_t n_pr_tables;
-    float* label_pr_tables;
+    float* label_pr_tables;         // NULL if quantized
+    uint8_t table_format;           // RDT_TABLE_FORMAT_*
+    float table_scale;              // Scale of quantized table values
+    void* quantized_pr_tables;      // NULL unless quantized
 } RDTree;
 
 #ifdef __cplusplus
@@ -89,6 +149,35 @@ rdt_tree_load_from_file(struct gm_logger* log,
 void
 rdt_tree_destroy(RDTree* tree);
 
+/* Converts a tree to the compact, inference-only node format in place.
+ *
+ * Compact nodes have no split node distributions, so those tables are
+ * dropped.
+ *
+ * Compact nodes are laid out in a van Emde Boas order so that deep walks
+ * touch few cache lines and pages, but since each node has an explicit child
+ * index, readers don't depend on the order.
+ *
+ * Fails if any node reachable from the root hasn't been trained.
+ */
+bool
+rdt_tree_compact(struct gm_logger* log,
+                 RDTree* tree,
+                 char** err);
+
+/* Quantizes the label probability tables of a tree in place to one of the
+ * integer RDT_TABLE_FORMAT_ formats.
+ */
+bool
+rdt_tree_quantize(struct gm_logger* log,
+                  RDTree* tree,
+                  int table_format,
+                  char** err);
+
+/* The number of bytes of node and label probability data for the tree */
+size_t
+rdt_tree_get_size(RDTree* tree);
+
 bool
 rdt_tree_save(RDTree* tree, const char* filename);
 
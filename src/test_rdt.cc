@@ -23,9 +23,11 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <getopt.h>
 
 #include <vector>
+#include <thread>
 
 #include "half.hpp"
 
@@ -34,10 +36,19 @@
 #include "infer.h"
 
 #include <glimpse_rdt.h>
+#include <glimpse_thread_pool.h>
 
 using half_float::half;
 
 static bool threaded_opt = false;
+static int n_threads_opt = 0;
+static bool work_stealing_opt = false;
+static InferLabelsOptions infer_opts;
+static bool compact_opt = false;
+static int quantize_opt = RDT_TABLE_FORMAT_FLOAT;
+static float cascade_opt = 0.f;
+static int coarse_opt = 0;
+static int max_depth_opt = 0;
 static bool verbose_opt = false;
 
 static uint64_t
@@ -132,6 +143,112 @@ logger_abort_cb(struct gm_logger *logger, void *user_data)
     abort();
 }
 
+static void
+evaluate_forest(RDTree **forest,
+                int n_trees,
+                struct gm_thread_pool *pool,
+                half *depth_images,
+                uint8_t *label_images,
+                int n_images,
+                int width,
+                int height,
+                int n_labels,
+                float *probs,
+                std::vector<float> &all_accuracies,
+                std::vector<uint64_t> &inference_timings)
+{
+    uint64_t start, end;
+
+    int label_incidence[n_labels];
+    int correct_label_inference[n_labels];
+
+    all_accuracies.clear();
+    all_accuracies.reserve(n_images);
+
+    inference_timings.clear();
+    inference_timings.reserve(n_images);
+
+    infer_opts.workspace = infer_labels_workspace_new();
+
+    for (int i = 0; i < n_images; i++) {
+        int64_t off = i * width * height;
+        start = get_time();
+        infer_labels<half>(forest,
+                           n_trees,
+                           &depth_images[off],
+                           width,
+                           height,
+                           probs,
+                           pool,
+                           &infer_opts);
+        end = get_time();
+        inference_timings.push_back(end - start);
+
+        uint8_t *labels = &label_images[off];
+
+        memset(label_incidence, 0, sizeof(label_incidence));
+        memset(correct_label_inference, 0, sizeof(correct_label_inference));
+
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                int off = y * width + x;
+
+                int actual_label = (int)labels[off];
+
+                float *pr_table = &probs[off * n_labels];
+                uint8_t inferred_label = 0;
+                float pr = -1.0;
+                for (int l = 0; l < n_labels; l++) {
+                    if (pr_table[l] > pr) {
+                        inferred_label = l;
+                        pr = pr_table[l];
+                    }
+                }
+
+                label_incidence[actual_label]++;
+                if (inferred_label == actual_label) {
+                    correct_label_inference[inferred_label]++;
+                }
+            }
+        }
+
+        int present_labels = 0;
+        float accuracy = 0.f;
+        for (int l = 0; l < n_labels; l++) {
+            if (label_incidence[l] > 0) {
+                accuracy += correct_label_inference[l] /
+                    (float)label_incidence[l];
+                present_labels++;
+            }
+        }
+        accuracy /= (float)present_labels;
+
+        all_accuracies.push_back(accuracy);
+    }
+
+    infer_labels_workspace_free(infer_opts.workspace);
+    infer_opts.workspace = NULL;
+}
+
+static size_t
+get_forest_size(RDTree **forest, int n_trees)
+{
+    size_t size = 0;
+    for (int i = 0; i < n_trees; i++)
+        size += rdt_tree_get_size(forest[i]);
+    return size;
+}
+
+template<typename T>
+static double
+get_average(std::vector<T> &values)
+{
+    double sum = 0;
+    for (int i = 0; i < (int)values.size(); i++)
+        sum += values[i];
+    return values.size() ? sum / values.size() : 0;
+}
+
 static void
 usage(void)
 {
@@ -142,6 +259,34 @@ usage(void)
 "given index of images.\n"
 "\n"
 "  -t, --threaded                Use multi-threaded inference.\n"
+"  -j, --threads=NUMBER          Number of inference threads to use.\n"
+"                                (implies --threaded, default: autodetect)\n"
+"  -s, --work-stealing           Let idle inference threads steal work.\n"
+"      --schedule=MODE           How to divide pixels between threads:\n"
+"                                'tiles' (default), 'rows' or 'strided'.\n"
+"      --tile-size=WxH           Size of tiles (or height of row bands)\n"
+"                                assigned to each thread at a time.\n"
+"      --traversal=MODE          How to walk the trees: 'scalar' (default),\n"
+"                                'batched' (SIMD, multiple pixels per tree\n"
+"                                level) or 'interleaved' (all trees in\n"
+"                                lockstep with prefetching).\n"
+"  -c, --compact                 Convert the trees to the compact node\n"
+"                                format and report the difference in size,\n"
+"                                accuracy and timing.\n"
+"  -q, --quantize=FORMAT         Quantize leaf label probability tables\n"
+"                                (FORMAT = u8 or u16) and report the\n"
+"                                difference in size, accuracy and timing.\n"
+"      --cascade=CONFIDENCE      Only evaluate more than the first tree for\n"
+"                                pixels labelled with less than CONFIDENCE\n"
+"                                and report the difference in accuracy and\n"
+"                                timing.\n"
+"      --coarse=SCALE            Infer labels coarse to fine, starting with\n"
+"                                every SCALE'th pixel, and report the\n"
+"                                difference in accuracy and timing.\n"
+"      --max-depth=DEPTH         Stop walking the trees at DEPTH, using\n"
+"                                the label distributions of split nodes,\n"
+"                                and report the difference in accuracy and\n"
+"                                timing.\n"
 "  -v, --verbose                 Verbose output.\n"
 "  -h, --help                    Display this message.\n"
     );
@@ -156,9 +301,19 @@ main(int argc, char **argv)
     struct gm_logger *log = gm_logger_new(logger_cb, NULL);
     gm_logger_set_abort_callback(log, logger_abort_cb, NULL);
 
-    const char *short_options="vht";
+    const char *short_options="vhtj:scq:";
     const struct option long_options[] = {
         {"threaded",        no_argument,        0, 't'},
+        {"threads",         required_argument,  0, 'j'},
+        {"work-stealing",   no_argument,        0, 's'},
+        {"schedule",        required_argument,  0, 'S'},
+        {"tile-size",       required_argument,  0, 'T'},
+        {"traversal",       required_argument,  0, 'R'},
+        {"compact",         no_argument,        0, 'c'},
+        {"quantize",        required_argument,  0, 'q'},
+        {"cascade",         required_argument,  0, 'C'},
+        {"coarse",          required_argument,  0, 'F'},
+        {"max-depth",       required_argument,  0, 'D'},
         {"verbose",         no_argument,        0, 'v'},
         {"help",            no_argument,        0, 'h'},
         {0, 0, 0, 0}
@@ -172,6 +327,68 @@ main(int argc, char **argv)
         case 't':
             threaded_opt = true;
             break;
+        case 'j':
+            threaded_opt = true;
+            n_threads_opt = atoi(optarg);
+            break;
+        case 's':
+            work_stealing_opt = true;
+            break;
+        case 'c':
+            compact_opt = true;
+            break;
+        case 'q':
+            if (strcmp(optarg, "u8") == 0)
+                quantize_opt = RDT_TABLE_FORMAT_U8;
+            else if (strcmp(optarg, "u16") == 0)
+                quantize_opt = RDT_TABLE_FORMAT_U16;
+            else
+                usage();
+            break;
+        case 'C':
+            cascade_opt = strtof(optarg, NULL);
+            if (cascade_opt <= 0.f || cascade_opt > 1.f)
+                usage();
+            break;
+        case 'F':
+            coarse_opt = atoi(optarg);
+            if (coarse_opt < 2)
+                usage();
+            break;
+        case 'D':
+            max_depth_opt = atoi(optarg);
+            if (max_depth_opt < 1)
+                usage();
+            break;
+        case 'S':
+            if (strcmp(optarg, "tiles") == 0)
+                infer_opts.schedule = INFER_SCHEDULE_TILES;
+            else if (strcmp(optarg, "rows") == 0)
+                infer_opts.schedule = INFER_SCHEDULE_ROWS;
+            else if (strcmp(optarg, "strided") == 0)
+                infer_opts.schedule = INFER_SCHEDULE_STRIDED;
+            else
+                usage();
+            break;
+        case 'R':
+            if (strcmp(optarg, "scalar") == 0)
+                infer_opts.traversal = INFER_TRAVERSAL_SCALAR;
+            else if (strcmp(optarg, "batched") == 0)
+                infer_opts.traversal = INFER_TRAVERSAL_BATCHED;
+            else if (strcmp(optarg, "interleaved") == 0)
+                infer_opts.traversal = INFER_TRAVERSAL_INTERLEAVED;
+            else
+                usage();
+            break;
+        case 'T':
+            if (sscanf(optarg, "%dx%d", &infer_opts.tile_width,
+                       &infer_opts.tile_height) != 2)
+            {
+                if (sscanf(optarg, "%d", &infer_opts.tile_height) != 1)
+                    usage();
+                infer_opts.tile_width = infer_opts.tile_height;
+            }
+            break;
         case 'v':
             verbose_opt = true;
             break;
@@ -238,72 +455,66 @@ main(int argc, char **argv)
     end = get_time();
     uint64_t load_data_duration = end - start;
 
-    float *probs = (float*)xmalloc(width * height * sizeof(float) * n_labels);
+    struct gm_thread_pool *pool = NULL;
+    if (threaded_opt) {
+        int n_threads = n_threads_opt;
+        if (n_threads <= 0)
+            n_threads = std::max(1u, std::thread::hardware_concurrency());
+        pool = thread_pool_alloc(log, "Inference", n_threads,
+                                 work_stealing_opt, &err);
+        if (!pool) {
+            fprintf(stderr, "Failed to create thread pool: %s\n", err);
+            exit(1);
+        }
+    }
 
-    int label_incidence[n_labels];
-    int correct_label_inference[n_labels];
+    float *probs = (float*)xmalloc(width * height * sizeof(float) * n_labels);
 
     std::vector<float> all_accuracies;
-    all_accuracies.reserve(n_images);
-
     std::vector<uint64_t> inference_timings;
-    inference_timings.reserve(n_images);
-
-    for (int i = 0; i < n_images; i++) {
-        int64_t off = i * width * height;
-        start = get_time();
-        infer_labels<half>(forest,
-                           n_trees,
-                           &depth_images[off],
-                           width,
-                           height,
-                           probs,
-                           threaded_opt);
-        end = get_time();
-        inference_timings.push_back(end - start);
-
-        uint8_t *labels = &label_images[off];
-
-        memset(label_incidence, 0, sizeof(label_incidence));
-        memset(correct_label_inference, 0, sizeof(correct_label_inference));
-
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                int off = y * width + x;
-
-                int actual_label = (int)labels[off];
 
-                float *pr_table = &probs[off * n_labels];
-                uint8_t inferred_label = 0;
-                float pr = -1.0;
-                for (int l = 0; l < n_labels; l++) {
-                    if (pr_table[l] > pr) {
-                        inferred_label = l;
-                        pr = pr_table[l];
-                    }
-                }
-
-                label_incidence[actual_label]++;
-                if (inferred_label == actual_label) {
-                    correct_label_inference[inferred_label]++;
-                }
+    /* To measure the effect of converting to the compact node format and/or
+     * quantized tables, or of cascaded, coarse to fine or depth limited
+     * evaluation, we first evaluate the forest as loaded...
+     */
+    bool convert = compact_opt || quantize_opt != RDT_TABLE_FORMAT_FLOAT ||
+        cascade_opt > 0.f || coarse_opt > 1 || max_depth_opt > 0;
+    size_t orig_forest_size = get_forest_size(forest, n_trees);
+    double orig_average_accuracy = 0;
+    double orig_average_timing = 0;
+    if (convert) {
+        evaluate_forest(forest, n_trees, pool,
+                        depth_images, label_images, n_images,
+                        width, height, n_labels, probs,
+                        all_accuracies, inference_timings);
+        orig_average_accuracy = get_average(all_accuracies);
+        orig_average_timing = get_average(inference_timings);
+
+        for (int i = 0; i < n_trees; i++) {
+            if (compact_opt && !rdt_tree_compact(log, forest[i], &err)) {
+                fprintf(stderr, "Failed to compact %s: %s\n",
+                        tree_paths[i], err);
+                exit(1);
             }
-        }
-
-        int present_labels = 0;
-        float accuracy = 0.f;
-        for (int l = 0; l < n_labels; l++) {
-            if (label_incidence[l] > 0) {
-                accuracy += correct_label_inference[l] /
-                    (float)label_incidence[l];
-                present_labels++;
+            if (quantize_opt != RDT_TABLE_FORMAT_FLOAT &&
+                !rdt_tree_quantize(log, forest[i], quantize_opt, &err))
+            {
+                fprintf(stderr, "Failed to quantize %s: %s\n",
+                        tree_paths[i], err);
+                exit(1);
             }
         }
-        accuracy /= (float)present_labels;
 
-        all_accuracies.push_back(accuracy);
+        infer_opts.cascade_confidence = cascade_opt;
+        infer_opts.coarse_scale = coarse_opt;
+        infer_opts.max_depth = max_depth_opt;
     }
 
+    evaluate_forest(forest, n_trees, pool,
+                    depth_images, label_images, n_images,
+                    width, height, n_labels, probs,
+                    all_accuracies, inference_timings);
+
 
     /*
      * Post-processing of metrics...
@@ -373,6 +584,16 @@ main(int argc, char **argv)
            get_format_duration(load_forest_duration),
            get_format_duration_suffix(load_forest_duration));
 
+    size_t forest_size = get_forest_size(forest, n_trees);
+    if (convert) {
+        printf("Forest size: %.2fMB (converted), %.2fMB (original) - %.1f%%\n",
+               forest_size / (1024.0 * 1024.0),
+               orig_forest_size / (1024.0 * 1024.0),
+               100.0 * forest_size / orig_forest_size);
+    } else {
+        printf("Forest size: %.2fMB\n", forest_size / (1024.0 * 1024.0));
+    }
+
     printf("Loaded %d images from '%s' index in %.2f%s\n",
            n_images,
            index_name,
@@ -400,6 +621,29 @@ main(int argc, char **argv)
     printf("  • Worst:   %.2f\n", worst_accuracy);
     printf("  • Best:    %.2f\n", best_accuracy);
 
+    if (convert) {
+        printf("Converted vs. original forest:\n");
+        printf("  • Average accuracy delta: %+.5f\n",
+               average_accuracy - orig_average_accuracy);
+        printf("  • Average timing: %.2f%s (original: %.2f%s)\n",
+               get_format_duration(average_inference_timing),
+               get_format_duration_suffix(average_inference_timing),
+               get_format_duration(orig_average_timing),
+               get_format_duration_suffix(orig_average_timing));
+        printf("  • Average time saved: %.1f%%\n",
+               100.0 * (orig_average_timing - average_inference_timing) /
+               orig_average_timing);
+        if (cascade_opt > 0.f) {
+            printf("  • Cascade confidence: %.2f\n", cascade_opt);
+        }
+        if (coarse_opt > 1) {
+            printf("  • Coarse to fine scale: %d\n", coarse_opt);
+        }
+        if (max_depth_opt > 0) {
+            printf("  • Maximum depth: %d\n", max_depth_opt);
+        }
+    }
+
     printf("Histogram of accuracies:\n");
     static const char *bars[] = {
         " ",
@@ -430,5 +674,8 @@ main(int argc, char **argv)
         printf("| %d\n", histogram[i]);
     }
 
+    if (pool)
+        thread_pool_free(pool);
+
     return 0;
 }
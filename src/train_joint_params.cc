@@ -74,6 +74,7 @@ typedef struct {
 
     int      n_joints;      // Number of joints
     JSON_Value* joint_map;  // Map between joints and labels
+    struct gm_joint_map* compiled_joint_map; // joint_map, for inference
     float*   joints;        // List of joint positions for each image
 
     int      n_bandwidths;  // Number of bandwidth values
@@ -227,16 +228,16 @@ thread_body(void* userdata)
     for (int i = i_start, idx = ctx->width * ctx->height * i_start;
          i < i_end; i++, idx += ctx->width * ctx->height)
     {
-        ctx->inferred[i] = infer_labels<half>(ctx->forest, ctx->n_trees,
-                                              &ctx->depth_images[idx],
-                                              ctx->width, ctx->height);
-
-        // Calculate pixel weight
+        // Infer labels and calculate pixel weights together
         int weight_idx = i * ctx->width * ctx->height * ctx->n_joints;
-        calc_pixel_weights<half>(&ctx->depth_images[idx], ctx->inferred[i],
-                                 ctx->width, ctx->height, n_labels,
-                                 ctx->joint_map,
-                                 &ctx->weights[weight_idx]);
+        ctx->inferred[i] = (float*)xmalloc(ctx->width * ctx->height *
+                                           n_labels * sizeof(float));
+        infer_labels_with_weights<half>(ctx->forest, ctx->n_trees,
+                                        &ctx->depth_images[idx],
+                                        ctx->width, ctx->height,
+                                        ctx->compiled_joint_map,
+                                        &ctx->weights[weight_idx],
+                                        ctx->inferred[i]);
 
         // Calculate inference accuracy if label images were specified
         if (ctx->check_accuracy)
@@ -322,6 +323,9 @@ thread_body(void* userdata)
     float output_freq = (c_end - c_start) /
         (PROGRESS_WIDTH / (float)ctx->n_threads);
 
+    InferJointsWorkspace* workspace =
+        infer_joints_workspace_new(ctx->width, ctx->height, ctx->n_joints, 0);
+
     for (int c = c_start; c < c_end; c++)
     {
         int bandwidth_idx = c / bandwidth_stride;
@@ -356,17 +360,17 @@ thread_body(void* userdata)
             float* weights = &ctx->weights[weight_idx];
 
             // Get joint positions
-            InferredJoints* result =
+            const InferredJoints* result =
                 infer_joints<half>(depth_image, pr_table, weights,
                                    ctx->width, ctx->height, n_labels,
-                                   ctx->joint_map,
+                                   ctx->compiled_joint_map,
                                    ctx->forest[0]->header.fov,
-                                   params);
+                                   params, workspace);
 
             // Calculate distance from expected joint position and accumulate
             for (int j = 0; j < ctx->n_joints; j++)
             {
-                if (!result->joints[j])
+                if (!result->n_candidates[j])
                 {
                     // If there's no predicted joint, just add a large number to
                     // the accumulated distance. Note that distances are in
@@ -375,7 +379,8 @@ thread_body(void* userdata)
                     continue;
                 }
 
-                Joint* inferred_joint = (Joint*)result->joints[j]->data;
+                const Joint* inferred_joint =
+                    inferred_joint_candidates(result, j);
                 float* actual_joint =
                     &ctx->joints[((i * ctx->n_joints) + j) * 3];
 
@@ -388,9 +393,6 @@ thread_body(void* userdata)
                 // Accumulate
                 acc_distance[j] += distance;
             }
-
-            // Free joint positions
-            free_joints(result);
         }
 
         // See if this combination is better than the current best for any
@@ -414,6 +416,8 @@ thread_body(void* userdata)
         }
     }
 
+    infer_joints_workspace_free(workspace);
+
     xfree(data);
     pthread_exit(NULL);
 }
@@ -668,6 +672,8 @@ main(int argc, char** argv)
         fprintf(stderr, "Failed to load joint map %s\n", joint_map_path);
         return 1;
     }
+    ctx.compiled_joint_map = gm_joint_map_new(ctx.log, ctx.joint_map,
+                                              NULL); // simply abort on error
 
     printf("Generating test parameters...\n");
     printf("%u bandwidths from %.3f to %.3f\n",
@@ -906,6 +912,7 @@ main(int argc, char** argv)
     xfree(best_thresholds);
     xfree(ctx.offsets);
     xfree(best_offsets);
+    gm_joint_map_free(ctx.compiled_joint_map);
     json_value_free(ctx.joint_map);
     xfree(ctx.joints);
     rdt_forest_destroy(ctx.forest, ctx.n_trees);
@@ -29,6 +29,23 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+/* Without F16C enabled for the whole build, depth_to_float_n() still uses it
+ * for bulk conversions on CPUs that report it at runtime
+ */
+#if !defined(__F16C__) && defined(__x86_64__) && \
+    defined(__GNUC__) && !defined(__clang__)
+#define DEPTH_TO_FLOAT_DISPATCH_F16C
+#endif
+
+#if defined(__F16C__) || defined(DEPTH_TO_FLOAT_DISPATCH_F16C)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__ARM_FP16_FORMAT_IEEE)
+#include <arm_neon.h>
+#endif
 
 #include "half.hpp"
 
@@ -44,6 +61,83 @@ typedef struct {
     int i;
 } Int3D;
 
+/* Converts a depth value to float. half_float::half converts in software
+ * so where the target supports it (F16C on x86, fp16 storage on ARM) half
+ * depth values are converted in hardware instead.
+ */
+template<typename FloatT>
+inline float
+depth_to_float(FloatT depth)
+{
+    return (float)depth;
+}
+
+template<>
+inline float
+depth_to_float<half_float::half>(half_float::half depth)
+{
+#if defined(__F16C__)
+    uint16_t bits;
+    memcpy(&bits, &depth, sizeof(bits));
+    return _cvtsh_ss(bits);
+#elif defined(__ARM_NEON) && defined(__ARM_FP16_FORMAT_IEEE)
+    __fp16 value;
+    memcpy(&value, &depth, sizeof(value));
+    return (float)value;
+#else
+    return (float)depth;
+#endif
+}
+
+/* Converts a run of n depth values to float */
+template<typename FloatT>
+inline void
+depth_to_float_n(const FloatT* depth, float* out, int n)
+{
+    for (int i = 0; i < n; ++i) {
+        out[i] = depth_to_float(depth[i]);
+    }
+}
+
+#if defined(__F16C__) || defined(DEPTH_TO_FLOAT_DISPATCH_F16C)
+/* Converts as many whole runs of 8 as fit in n, returning how many */
+#if defined(DEPTH_TO_FLOAT_DISPATCH_F16C)
+__attribute__((target("avx,f16c")))
+#endif
+inline int
+depth_to_float_n_f16c(const half_float::half* depth, float* out, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i bits = _mm_loadu_si128((const __m128i*)&depth[i]);
+        _mm256_storeu_ps(&out[i], _mm256_cvtph_ps(bits));
+    }
+    return i;
+}
+#endif
+
+template<>
+inline void
+depth_to_float_n<half_float::half>(const half_float::half* depth,
+                                   float* out, int n)
+{
+    int i = 0;
+#if defined(__F16C__)
+    i = depth_to_float_n_f16c(depth, out, n);
+#elif defined(DEPTH_TO_FLOAT_DISPATCH_F16C)
+    if (__builtin_cpu_supports("f16c"))
+        i = depth_to_float_n_f16c(depth, out, n);
+#elif defined(__ARM_NEON) && defined(__ARM_FP16_FORMAT_IEEE)
+    for (; i + 4 <= n; i += 4) {
+        float16x4_t value = vld1_f16((const __fp16*)&depth[i]);
+        vst1q_f32(&out[i], vcvt_f32_f16(value));
+    }
+#endif
+    for (; i < n; ++i) {
+        out[i] = depth_to_float(depth[i]);
+    }
+}
+
 template<typename FloatT>
 inline float
 sample_uv(FloatT* depth_image, int width, int height,
@@ -74,15 +168,112 @@ sample_uv(FloatT* depth_image, int width, int height,
 
     float upixel = (u[0] >= 0 && u[0] < (int)width &&
                     u[1] >= 0 && u[1] < (int)height) ?
-        (float)depth_image[((u[1] * width) + u[0])] : 1000.f;
+        depth_to_float(depth_image[((u[1] * width) + u[0])]) : 1000.f;
     float vpixel = (v[0] >= 0 && v[0] < (int)width &&
                     v[1] >= 0 && v[1] < (int)height) ?
-        (float)depth_image[((v[1] * width) + v[0])] : 1000.f;
+        depth_to_float(depth_image[((v[1] * width) + v[0])]) : 1000.f;
 
     return upixel - vpixel;
 #endif
 }
 
+/* Padded depth images are surrounded by a border of background depth so
+ * that sample_uv_padded() can clamp sample coordinates into the border
+ * instead of checking whether they are in bounds. Since any out of bounds
+ * coordinate is clamped onto the border a single pixel is enough, however
+ * large the u,v offsets are, which keeps the copy small. The clamp is a
+ * branchless min/max per coordinate, unlike the range checks and selects
+ * of sample_uv().
+ *
+ * Padded images are addressed via a pointer to their first (non-border)
+ * pixel with a row stride of padded_depth_image_stride(width).
+ */
+#define DEPTH_IMAGE_PADDING 1
+
+inline int
+padded_depth_image_stride(int width)
+{
+    return width + 2 * DEPTH_IMAGE_PADDING;
+}
+
+inline size_t
+padded_depth_image_size(int width, int height)
+{
+    return (size_t)padded_depth_image_stride(width) *
+        (height + 2 * DEPTH_IMAGE_PADDING);
+}
+
+/* Returns a pointer to the first pixel of a padded depth image, given the
+ * start of its padded_depth_image_size() elements
+ */
+template<typename FloatT>
+inline FloatT*
+padded_depth_image_origin(FloatT* padded, int width)
+{
+    return padded + DEPTH_IMAGE_PADDING * padded_depth_image_stride(width) +
+        DEPTH_IMAGE_PADDING;
+}
+
+/* Copies a depth image over the pixels of a padded image, leaving its
+ * border untouched
+ */
+template<typename FloatT>
+inline void
+copy_depth_image_to_padded(const FloatT* depth_image, int width, int height,
+                           FloatT* padded)
+{
+    int stride = padded_depth_image_stride(width);
+    FloatT* origin = padded_depth_image_origin(padded, width);
+
+    for (int y = 0; y < height; ++y) {
+        memcpy(origin + y * stride, depth_image + y * width,
+               width * sizeof(FloatT));
+    }
+}
+
+/* Copies a depth image into 'padded', which must have room for
+ * padded_depth_image_size() elements, and returns a pointer to the first
+ * pixel of the padded copy
+ */
+template<typename FloatT>
+inline FloatT*
+pad_depth_image(const FloatT* depth_image, int width, int height,
+                FloatT* padded)
+{
+    size_t size = padded_depth_image_size(width, height);
+
+    for (size_t i = 0; i < size; ++i) {
+        padded[i] = (FloatT)1000.f;
+    }
+    copy_depth_image_to_padded(depth_image, width, height, padded);
+
+    return padded_depth_image_origin(padded, width);
+}
+
+inline int
+clamp_sample_coord(int coord, int extent)
+{
+    return std::min(std::max(coord, -DEPTH_IMAGE_PADDING),
+                    extent - 1 + DEPTH_IMAGE_PADDING);
+}
+
+/* Equivalent to sample_uv() for a padded depth image */
+template<typename FloatT>
+inline float
+sample_uv_padded(FloatT* depth_image, int width, int height,
+                 Int2D pixel, float depth, UVPair uv)
+{
+    int stride = padded_depth_image_stride(width);
+
+    int ux = clamp_sample_coord((int)(pixel[0] + uv[0] / depth), width);
+    int uy = clamp_sample_coord((int)(pixel[1] + uv[1] / depth), height);
+    int vx = clamp_sample_coord((int)(pixel[0] + uv[2] / depth), width);
+    int vy = clamp_sample_coord((int)(pixel[1] + uv[3] / depth), height);
+
+    return depth_to_float(depth_image[uy * stride + ux]) -
+        depth_to_float(depth_image[vy * stride + vx]);
+}
+
 typedef struct {
     int32_t hours;
     int32_t minutes;